@@ -1,306 +1,6859 @@
 
+// Build with -DNO_SDL for a headless-only binary that never links SDL
+#ifndef NO_SDL
 #include <SDL.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
 #include <time.h>
 #include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef USE_LZ4
+#include <lz4.h>
+#endif
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+// Build with mpicc -DUSE_MPI for distributed headless runs under mpirun
+#ifdef USE_MPI
+#include <mpi.h>
+#endif
+// Build with -DUSE_GL -lGL -lEGL for the OpenGL 4.3 compute force backend and
+// the instanced body renderer (--renderer gl)
+#ifdef USE_GL
+#define GL_GLEXT_PROTOTYPES 1
+#include <GL/glcorearb.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+#ifdef NO_SDL
+typedef uint8_t Uint8;
+#endif
+// Build with -DFORCE_MIXED to evaluate direct-sum pair terms in float32 and
+// sum them in double, or -DFORCE_FLOAT to sum in float32 as well. Bodies are
+// stored and integrated in double either way.
+#if defined(FORCE_FLOAT) || defined(FORCE_MIXED)
+#define FORCE_SINGLE 1
+typedef float force_real;
+#define force_sqrt sqrtf
+#else
+typedef double force_real;
+#define force_sqrt sqrt
+#endif
+#ifdef FORCE_FLOAT
+typedef float force_sum;
+#define FORCE_PRECISION_NAME "float"
+#elif defined(FORCE_MIXED)
+typedef double force_sum;
+#define FORCE_PRECISION_NAME "mixed"
+#else
+typedef double force_sum;
+#define FORCE_PRECISION_NAME "double"
+#endif
 #define INITIAL_WINDOW_WIDTH 1200
 #define INITIAL_WINDOW_HEIGHT 800
-#define MAX_BODIES 100
-#define G 0.5
-#define SOFTENING 5.0
+#define MAX_BODIES 16777216
+#define INITIAL_BODY_CAPACITY 128
+#define COMPACT_RATIO 16
+#define COMPACT_INTERVAL 64
+#define DEFAULT_GRAVITY 0.5
+#define DEFAULT_SOFTENING 5.0
 #define TIME_STEP 0.1
 #define BODY_RADIUS 5
-#define MAX_VELOCITY 50.0
-#define MAX_MASS 50000.0
+#define DEFAULT_MAX_VELOCITY 50.0
+#define DEFAULT_MAX_MASS 50000.0
 #define MAX_RADIUS 100.0
+#define BH_DEFAULT_THETA 0.5
+#define QUAD_MAX_DEPTH 40
+#define QUAD_REBUILD_FRACTION 8
+#define QUAD_ROOT_SLACK 0.0625
+#define FMM_DEFAULT_ORDER 4
+#define FMM_MAX_ORDER 12
+#define FMM_LEAF_SIZE 32
+#define FMM_TASK_BODIES 2048
+#define FMM_MAX_THETA 0.9
+#define IMPORT_LEAF_SIZE 16
+#define DOMAIN_BALANCE_INTERVAL 32
+#define DOMAIN_IMBALANCE_LIMIT 1.1
+#define DOMAIN_SAMPLES 256
+#define FORCE_ERROR_INTERVAL 300
+#define MAX_THREADS 256
+#define FORCE_TILE 512
+#define ROW_BLOCK 64
+#define CONTACT_WRAP_LIMIT 64
+#define MERGE_BLOCK 4096
+#define FORCE_PAD 16
+#define FORCE_SUM_CHUNK 256
+#define GPU_TILE 256
+#define DEFAULT_INITIAL_BODIES 5
+#define DEFAULT_HEADLESS_STEPS 1000
+#define PHYSICS_RATE 60.0
+#define MAX_SUBSTEPS_PER_TICK 8
+#define SNAPSHOT_INTERVAL (1.0 / 240)
+#define PAUSED_POLL_INTERVAL 0.01
+#define IDLE_WAIT_MS 250
+#define DEFAULT_REFRESH_RATE 60
+#define COMMAND_QUEUE_SIZE 256
+#define CONFIG_MAX_DEPTH 8
+#define GLOW_MARGIN 12
+#define LOD_GLOW_RADIUS 3.0
+#define LOD_DISK_RADIUS 1.5
+#define SPLAT_CELL 4
+#define SPLAT_MIN_COUNT 4
+#define SPLAT_ALPHA 32
+#define CAMERA_MIN_ZOOM (1.0 / 64)
+#define CAMERA_MAX_ZOOM 16.0
+#define CAMERA_ZOOM_STEP 1.25
+#define CAMERA_PAN_STEP 50
+#define SPRITE_ATLAS_WIDTH 2048
+#define BENCH_DIRECT_LIMIT 50000
+#define BENCH_MIN_SECONDS 0.25
+#define BENCH_MAX_REPEATS 20
+#define PROFILE_HISTORY 256
+#define TRACE_MAX_EVENTS (1 << 20)
+#define LOG_QUEUE_SIZE 4096
+#define LOG_MESSAGE_MAX 240
+#define LOG_RATE_LIMIT 20
+#define ENERGY_DIRECT_LIMIT 20000
+#define BLOCK_MAX_LEVEL 10
+#define BLOCK_ETA 0.2
+#define BLOCK_TREE_FRACTION 64
+#define CHECKPOINT_VERSION 2
+#define CHECKPOINT_ALIGN 64
+#define DEFAULT_CHECKPOINT_PATH "gravity.ckpt"
+#define TRAJECTORY_VERSION 1
+#define DEFAULT_TRAJECTORY_INTERVAL 10
+#define ZSTD_LEVEL 3
+#define GENERATOR_BLOCK 4096
+#define RANDOM_BATCH 64
+#define RANDOM_PREFETCH 3
+#define PLUMMER_CUTOFF 10.0
+#define KUZMIN_CUTOFF 10.0
+#define VIRIAL_PAIR_SAMPLES (1 << 20)
+#define VIRIAL_PAIR_BLOCK 16384
 int window_width = INITIAL_WINDOW_WIDTH;
 int window_height = INITIAL_WINDOW_HEIGHT;
 bool simulation_paused = false;
 bool warning_shown = false;
 bool is_dragging = false;
+bool is_panning = false;
 int drag_start_x = 0;
 int drag_start_y = 0;
 int drag_current_x = 0;
 int drag_current_y = 0;
+typedef enum {
+    FORCE_DIRECT,
+    FORCE_BARNES_HUT,
+    FORCE_GPU,
+    FORCE_FMM
+} ForceBackend;
+ForceBackend force_backend = FORCE_DIRECT;
+int fmm_order = FMM_DEFAULT_ORDER;
+bool gpu_ready = false;
+double bh_theta = BH_DEFAULT_THETA;
+bool report_force_error = false;
+typedef void (*DirectKernel)(int begin, int end);
+DirectKernel direct_kernel = NULL;
+const char *direct_kernel_name = "auto";
+typedef void (*Integrator)();
+Integrator integrator = NULL;
+const char *integrator_name = "euler";
+double time_step = TIME_STEP;
+// Build with -DFIXED_PHYSICS to compile G and the softening into the force
+// kernels as constants; --gravity and --softening are then refused
+#ifdef FIXED_PHYSICS
+#define gravity_constant DEFAULT_GRAVITY
+#define softening_length DEFAULT_SOFTENING
+#else
+double gravity_constant = DEFAULT_GRAVITY;
+double softening_length = DEFAULT_SOFTENING;
+#endif
+double max_velocity = DEFAULT_MAX_VELOCITY;
+double max_mass = DEFAULT_MAX_MASS;
+int body_limit = MAX_BODIES;
+// Whether bodies.ax/ay still hold the accelerations of the current positions,
+// which lets the leapfrog family reuse the last kick's force evaluation
+bool forces_current = false;
+bool contacts_current = false;
+double forces_seconds = 0;
+double block_eta = BLOCK_ETA;
+int step_count = 0;
+int thread_count = 1;
+int requested_threads = 0;
+// This process's place among the MPI ranks; a plain run is rank 0 of 1
+int rank_id = 0, rank_count = 1;
+bool headless = false;
+int headless_steps = DEFAULT_HEADLESS_STEPS;
+bool seed_given = false;
+// Parameters set on the command line take precedence over a loaded checkpoint
+bool force_given = false, theta_given = false, integrator_given = false;
+bool block_eta_given = false, dt_given = false, size_given = false, fmm_order_given = false;
+bool gravity_given = false, softening_given = false, max_velocity_given = false, max_mass_given = false;
+uint64_t random_seed = 0;
+int initial_body_count = DEFAULT_INITIAL_BODIES;
+typedef enum {
+    DISTRIBUTION_RANDOM,
+    DISTRIBUTION_UNIFORM,
+    DISTRIBUTION_PLUMMER,
+    DISTRIBUTION_KUZMIN,
+    DISTRIBUTION_COUNT
+} Distribution;
+const char *distribution_names[DISTRIBUTION_COUNT] = {"random", "uniform", "plummer", "kuzmin"};
+Distribution distribution = DISTRIBUTION_RANDOM;
+const char *initial_conditions_path = NULL;
+const char *output_path = NULL;
+const char *checkpoint_path = NULL;
+int checkpoint_interval = 0;
+const char *trajectory_path = NULL;
+int trajectory_interval = DEFAULT_TRAJECTORY_INTERVAL;
+const char *trajectory_format_name = "f64";
+const char *trajectory_codec_name = "none";
+double physics_rate = PHYSICS_RATE;
+bool benchmark = false;
+bool show_profile = false;
+bool gl_bodies_requested = false;
+bool density_view = false;
+bool gl_bodies_ready = false;
+const char *benchmark_sizes = "100,1000,10000,100000,1000000";
+const char *benchmark_output = NULL;
+// Bodies are stored as parallel arrays so the force kernels stream only the
+// fields they read; BODY_FIELDS lists every array once for bulk operations
+#define BODY_FIELDS(X) \
+    X(double, x) X(double, y) \
+    X(double, vx) X(double, vy) \
+    X(double, ax) X(double, ay) \
+    X(double, mass) X(double, radius) \
+    X(bool, active) \
+    X(Uint8, r) X(Uint8, g) X(Uint8, b) \
+    X(Uint8, level) \
+    X(uint32_t, id)
 typedef struct {
-    double x, y;
-    double vx, vy;
-    double ax, ay;
-    double mass;
-    double radius;
-    bool active;
-    Uint8 r, g, b;
-} Body;
-Body bodies[MAX_BODIES];
+#define DECLARE_BODY_FIELD(type, name) type *name;
+    BODY_FIELDS(DECLARE_BODY_FIELD)
+#undef DECLARE_BODY_FIELD
+} BodyArrays;
+BodyArrays bodies;
 int body_count = 0;
-void init_bodies() {
-    srand(time(NULL));
-    body_count = 5;   
+int body_capacity = 0;
+int dead_body_count = 0;
+// Ids survive compaction, so trajectories can follow a body across frames
+uint32_t next_body_id = 0;
+
+// Quadtree cell; the four children of a node are stored next to each other
+typedef struct {
+    double cx, cy, half;
+    double mass, mx, my;
+    int children;
+    int first;
+    int depth;
+} QuadNode;
+QuadNode *quad_nodes = NULL;
+int quad_node_count = 0;
+int quad_node_capacity = 0;
+int *quad_next = NULL;
+int quad_next_capacity = 0;
+// The tree is kept between force passes. quad_leaf[b] is the leaf holding
+// body b (-1 if none), and quad_order lists every index below
+// quad_order_count, active bodies in Morton order as of the last rebuild.
+int *quad_leaf = NULL, *quad_order = NULL;
+int quad_leaf_capacity = 0, quad_order_capacity = 0, quad_order_count = 0;
+uint64_t *quad_keys = NULL, *quad_key_scratch = NULL;
+int quad_built_nodes = 0, quad_moved = 0;
+long long quad_rebuilds = 0, quad_refits = 0;
+bool quad_rebuild_pending = true;
+
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Asynchronous logger. Producers format straight into a slot of a bounded
+// lock-free queue (one sequence number per slot) and a background thread
+// writes the slots out in order, so the physics loop never waits on stdout.
+// A full queue drops the message instead of blocking. Noisy message types are
+// additionally limited to LOG_RATE_LIMIT lines per second, with a count of
+// what was suppressed.
+typedef enum { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR, LOG_QUIET } LogLevel;
+const char *log_level_names[] = {"debug", "info", "warn", "error", "quiet"};
+typedef enum {
+    TOPIC_GENERAL,
+    TOPIC_COLLISION,
+    TOPIC_FAR_BODY,
+    TOPIC_MASS_LIMIT,
+    TOPIC_VELOCITY,
+    TOPIC_COUNT
+} LogTopic;
+const char *log_topic_names[TOPIC_COUNT] = {"general", "collision", "far-body", "mass-limit", "velocity"};
+
+typedef struct {
+    atomic_size_t sequence;
+    char text[LOG_MESSAGE_MAX];
+} LogSlot;
+typedef struct {
+    atomic_llong window;
+    atomic_int emitted;
+    atomic_int suppressed;
+} LogLimiter;
+LogSlot log_queue[LOG_QUEUE_SIZE];
+atomic_size_t log_head = 0;
+atomic_size_t log_tail = 0;
+atomic_int log_dropped = 0;
+LogLimiter log_limiters[TOPIC_COUNT];
+LogLevel log_level = LOG_INFO;
+atomic_bool logger_running = false;
+pthread_t logger_thread;
+
+void log_enqueue(const char *format, va_list args) {
+    if (!atomic_load_explicit(&logger_running, memory_order_acquire)) {
+        vprintf(format, args);
+        return;
+    }
+    
+    size_t position = atomic_load_explicit(&log_head, memory_order_relaxed);
+    LogSlot *slot;
+    for (;;) {
+        slot = &log_queue[position % LOG_QUEUE_SIZE];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(&log_head, &position, position + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) break;
+        } else if (difference < 0) {
+            atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            position = atomic_load_explicit(&log_head, memory_order_relaxed);
+        }
+    }
+    vsnprintf(slot->text, LOG_MESSAGE_MAX, format, args);
+    atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+}
+
+void log_enqueuef(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    log_enqueue(format, args);
+    va_end(args);
+}
+
+// Whether a message of this topic fits in the current one-second window;
+// the first message of a new window reports what the previous one dropped
+bool log_allow(LogTopic topic) {
+    if (topic == TOPIC_GENERAL) return true;
+    LogLimiter *limiter = &log_limiters[topic];
+    long long window = (long long)now_seconds();
+    long long current = atomic_load_explicit(&limiter->window, memory_order_relaxed);
+    if (current != window &&
+        atomic_compare_exchange_strong_explicit(&limiter->window, &current, window,
+                                                memory_order_relaxed, memory_order_relaxed)) {
+        atomic_store_explicit(&limiter->emitted, 0, memory_order_relaxed);
+        int suppressed = atomic_exchange_explicit(&limiter->suppressed, 0, memory_order_relaxed);
+        if (suppressed > 0) log_enqueuef("(%d %s messages suppressed)\n", suppressed, log_topic_names[topic]);
+    }
+    if (atomic_fetch_add_explicit(&limiter->emitted, 1, memory_order_relaxed) < LOG_RATE_LIMIT) return true;
+    atomic_fetch_add_explicit(&limiter->suppressed, 1, memory_order_relaxed);
+    return false;
+}
+
+void log_message(LogLevel level, LogTopic topic, const char *format, ...) {
+    if (level < log_level || !log_allow(topic)) return;
+    va_list args;
+    va_start(args, format);
+    log_enqueue(format, args);
+    va_end(args);
+}
+
+// Writes out every complete slot; true if anything was written
+bool log_drain() {
+    bool wrote = false;
+    size_t tail = atomic_load_explicit(&log_tail, memory_order_relaxed);
+    for (;;) {
+        LogSlot *slot = &log_queue[tail % LOG_QUEUE_SIZE];
+        if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != tail + 1) break;
+        fputs(slot->text, stdout);
+        atomic_store_explicit(&slot->sequence, tail + LOG_QUEUE_SIZE, memory_order_release);
+        tail++;
+        wrote = true;
+    }
+    if (wrote) {
+        fflush(stdout);
+        atomic_store_explicit(&log_tail, tail, memory_order_release);
+    }
+    return wrote;
+}
+
+void *logger_thread_main(void *arg) {
+    while (atomic_load(&logger_running)) {
+        if (!log_drain()) usleep(1000);
+    }
+    log_drain();
+    return NULL;
+}
+
+// Blocks until everything logged so far is on stdout, so that direct
+// printf output that follows cannot overtake it
+void log_flush() {
+    if (!atomic_load(&logger_running)) return;
+    size_t head = atomic_load(&log_head);
+    while (atomic_load(&log_tail) < head) usleep(200);
+}
+
+void start_logger() {
+    for (int k = 0; k < LOG_QUEUE_SIZE; k++) atomic_init(&log_queue[k].sequence, k);
+    atomic_store(&logger_running, true);
+    if (pthread_create(&logger_thread, NULL, logger_thread_main, NULL) != 0) {
+        atomic_store(&logger_running, false);
+    }
+}
+
+void stop_logger() {
+    if (!atomic_load(&logger_running)) return;
+    atomic_store(&logger_running, false);
+    pthread_join(logger_thread, NULL);
+    
+    for (int topic = 0; topic < TOPIC_COUNT; topic++) {
+        int suppressed = atomic_load(&log_limiters[topic].suppressed);
+        if (suppressed > 0) printf("(%d %s messages suppressed)\n", suppressed, log_topic_names[topic]);
+    }
+    int dropped = atomic_load(&log_dropped);
+    if (dropped > 0) printf("(%d log messages dropped: queue full)\n", dropped);
+}
+
+// Stage timers. Each zone keeps a ring of its last PROFILE_HISTORY durations
+// for the overlay; with --trace every sample is also kept for the Chrome
+// trace-event dump. Physics zones are written by the physics thread and read
+// by the renderer, so samples are relaxed atomics.
+typedef enum {
+    ZONE_EVENTS,
+    ZONE_STABILITY,
+    ZONE_FORCES,
+    ZONE_INTEGRATE,
+    ZONE_COLLISIONS,
+    ZONE_BACKGROUND,
+    ZONE_BODIES,
+    ZONE_PRESENT,
+    ZONE_COUNT
+} ProfileZone;
+const char *zone_names[ZONE_COUNT] = {
+    "events", "stability", "forces", "integrate", "collisions", "background", "bodies", "present"
+};
+typedef struct {
+    _Atomic float samples[PROFILE_HISTORY];
+    atomic_uint count;
+} ZoneHistory;
+ZoneHistory zone_history[ZONE_COUNT];
+
+typedef struct {
+    double start, duration;
+    uint8_t zone, thread;
+} TraceEvent;
+TraceEvent *trace_events = NULL;
+atomic_int trace_event_count = 0;
+const char *trace_path = NULL;
+double trace_epoch = 0;
+_Thread_local int profile_thread = 0;
+
+// The overlay gets the zone's own time (minus `excluded`, spent in nested
+// zones); the trace keeps the full span so that nesting shows up there
+void profile_end_excluding(ProfileZone zone, double start, double excluded) {
+    double end = now_seconds();
+    ZoneHistory *history = &zone_history[zone];
+    unsigned slot = atomic_load_explicit(&history->count, memory_order_relaxed);
+    atomic_store_explicit(&history->samples[slot % PROFILE_HISTORY], (float)(end - start - excluded), memory_order_relaxed);
+    atomic_store_explicit(&history->count, slot + 1, memory_order_release);
+    
+    if (trace_events) {
+        int index = atomic_fetch_add_explicit(&trace_event_count, 1, memory_order_relaxed);
+        if (index < TRACE_MAX_EVENTS) {
+            trace_events[index] = (TraceEvent){start - trace_epoch, end - start, zone, profile_thread};
+        }
+    }
+}
+
+void profile_end(ProfileZone zone, double start) {
+    profile_end_excluding(zone, start, 0);
+}
+
+int compare_floats(const void *a, const void *b) {
+    float fa = *(const float *)a, fb = *(const float *)b;
+    return (fa > fb) - (fa < fb);
+}
+
+// Rolling p50 and p99 in milliseconds; false until the zone has samples
+bool zone_percentiles(ProfileZone zone, double *p50, double *p99) {
+    ZoneHistory *history = &zone_history[zone];
+    unsigned count = atomic_load_explicit(&history->count, memory_order_acquire);
+    int n = count < PROFILE_HISTORY ? (int)count : PROFILE_HISTORY;
+    if (n == 0) return false;
+    
+    float sorted[PROFILE_HISTORY];
+    for (int k = 0; k < n; k++) {
+        sorted[k] = atomic_load_explicit(&history->samples[k], memory_order_relaxed);
+    }
+    qsort(sorted, n, sizeof(float), compare_floats);
+    *p50 = sorted[(n - 1) / 2] * 1000.0;
+    *p99 = sorted[(n - 1) * 99 / 100] * 1000.0;
+    return true;
+}
+
+void start_trace() {
+    if (!trace_path) return;
+    trace_events = malloc(TRACE_MAX_EVENTS * sizeof(TraceEvent));
+    if (!trace_events) {
+        printf("ERROR: Out of memory for the trace buffer\n");
+        exit(1);
+    }
+    trace_epoch = now_seconds();
+}
+
+// Writes the recorded zones as complete ("X") events, one track per thread
+bool write_trace() {
+    if (!trace_events) return true;
+    FILE *file = fopen(trace_path, "w");
+    if (!file) {
+        log_message(LOG_ERROR, TOPIC_GENERAL, "ERROR: Cannot write trace '%s'\n", trace_path);
+        return false;
+    }
+    int count = atomic_load(&trace_event_count);
+    if (count > TRACE_MAX_EVENTS) {
+        log_message(LOG_WARN, TOPIC_GENERAL, "Trace buffer full: kept the first %d of %d events\n", TRACE_MAX_EVENTS, count);
+        count = TRACE_MAX_EVENTS;
+    }
+    
+    fprintf(file, "{\"traceEvents\": [\n");
+    fprintf(file, "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, \"args\": {\"name\": \"main\"}},\n");
+    fprintf(file, "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 1, \"args\": {\"name\": \"physics\"}}");
+    for (int k = 0; k < count; k++) {
+        TraceEvent *event = &trace_events[k];
+        fprintf(file, ",\n  {\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+                zone_names[event->zone], event->thread, event->start * 1e6, event->duration * 1e6);
+    }
+    fprintf(file, "\n], \"displayTimeUnit\": \"ms\"}\n");
+    fclose(file);
+    log_message(LOG_INFO, TOPIC_GENERAL, "Wrote %d trace events to %s\n", count, trace_path);
+    
+    free(trace_events);
+    trace_events = NULL;
+    return true;
+}
+
+// Counter-based PRNG (Philox4x32-10). A block is a pure function of the key
+// and a 128-bit counter (stream index, round), so each body draws from its own
+// stream and the result is the same whatever the thread count or the order of
+// evaluation.
+typedef struct {
+    uint64_t key;
+    uint64_t index;
+    uint64_t round;
+    uint32_t words[RANDOM_PREFETCH * 4];
+    int used;
+    int available;
+} RandomStream;
+
+#define PHILOX_ROUND(c0, c1, c2, c3, k0, k1) { \
+        uint64_t p0 = (uint64_t)0xD2511F53u * c0; \
+        uint64_t p1 = (uint64_t)0xCD9E8D57u * c2; \
+        uint32_t n0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0; \
+        uint32_t n2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1; \
+        c1 = (uint32_t)p1; \
+        c3 = (uint32_t)p0; \
+        c0 = n0; \
+        c2 = n2; \
+    }
+
+void philox4x32(uint64_t key, uint64_t index, uint64_t round, uint32_t out[4]) {
+    uint32_t c0 = (uint32_t)index, c1 = (uint32_t)(index >> 32);
+    uint32_t c2 = (uint32_t)round, c3 = (uint32_t)(round >> 32);
+    uint32_t k0 = (uint32_t)key, k1 = (uint32_t)(key >> 32);
+    for (int pass = 0; pass < 10; pass++) {
+        PHILOX_ROUND(c0, c1, c2, c3, k0, k1)
+        k0 += 0x9E3779B9u;
+        k1 += 0xBB67AE85u;
+    }
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+}
+
+// The same block for RANDOM_BATCH consecutive streams, laid out so that the
+// compiler vectorizes across streams; out[w][k] is word w of stream index + k
+void philox4x32_batch(uint64_t key, uint64_t index, uint64_t round, uint32_t out[4][RANDOM_BATCH]) {
+    uint32_t c0[RANDOM_BATCH], c1[RANDOM_BATCH], c2[RANDOM_BATCH], c3[RANDOM_BATCH];
+    for (int k = 0; k < RANDOM_BATCH; k++) {
+        c0[k] = (uint32_t)(index + k);
+        c1[k] = (uint32_t)((index + k) >> 32);
+        c2[k] = (uint32_t)round;
+        c3[k] = (uint32_t)(round >> 32);
+    }
+    uint32_t k0 = (uint32_t)key, k1 = (uint32_t)(key >> 32);
+    for (int pass = 0; pass < 10; pass++) {
+        for (int k = 0; k < RANDOM_BATCH; k++) PHILOX_ROUND(c0[k], c1[k], c2[k], c3[k], k0, k1)
+        k0 += 0x9E3779B9u;
+        k1 += 0xBB67AE85u;
+    }
+    memcpy(out[0], c0, sizeof(c0));
+    memcpy(out[1], c1, sizeof(c1));
+    memcpy(out[2], c2, sizeof(c2));
+    memcpy(out[3], c3, sizeof(c3));
+}
+
+RandomStream random_stream(uint64_t key, uint64_t index) {
+    RandomStream stream;
+    stream.key = key;
+    stream.index = index;
+    stream.round = 0;
+    stream.used = stream.available = 0;
+    return stream;
+}
+
+uint32_t random_bits(RandomStream *stream) {
+    if (stream->used == stream->available) {
+        philox4x32(stream->key, stream->index, stream->round++, stream->words);
+        stream->used = 0;
+        stream->available = 4;
+    }
+    return stream->words[stream->used++];
+}
+
+// Uniform in the open interval (0, 1) with 32 random bits
+double random_uniform(RandomStream *stream) {
+    return (random_bits(stream) + 0.5) * 0x1.0p-32;
+}
+
+// Standard normal deviate (Box-Muller, one of the pair)
+double random_normal(RandomStream *stream) {
+    double u = random_uniform(stream);
+    double phi = 2 * M_PI * random_uniform(stream);
+    return sqrt(-2 * log(u)) * cos(phi);
+}
+
+// Stream for bodies added one at a time (mouse clicks, IC files without colours)
+RandomStream interactive_random;
+
+// Heap blocks obtained for scratch buffers, which should stop growing once
+// they have all reached their working size
+atomic_llong heap_allocations = 0;
+
+// Grows a heap array geometrically so that it holds at least `needed` elements
+void *grow_buffer(void *buffer, int *capacity, int needed, size_t element_size) {
+    if (needed <= *capacity) return buffer;
+    
+    long long new_capacity = *capacity ? *capacity : 64;
+    while (new_capacity < needed) new_capacity *= 2;
+    void *grown = realloc(buffer, (size_t)new_capacity * element_size);
+    if (!grown) {
+        printf("ERROR: Out of memory (requested %lld elements)\n", new_capacity);
+        exit(1);
+    }
+    heap_allocations++;
+    *capacity = (int)new_capacity;
+    return grown;
+}
+
+// Bump allocator for scratch that lives no longer than one step (or frame).
+// Callers take a mark and release back to it, so nested users stack. What
+// does not fit spills to its own heap block; the reset at the end of the
+// main-loop iteration then grows the block to the high-water mark, so once
+// warmed up a step runs without touching the heap.
+#define ARENA_ALIGN 64
+
+typedef struct ArenaSpill {
+    struct ArenaSpill *next;
+    size_t offset;
+} ArenaSpill;
+
+typedef struct {
+    char *base;
+    size_t capacity, used, high_water;
+    ArenaSpill *spills;
+} Arena;
+
+// Physics scratch, used only by the thread that steps; render scratch likewise
+Arena step_arena, frame_arena;
+
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    size_t offset = arena->used;
+    arena->used += size;
+    if (arena->used > arena->high_water) arena->high_water = arena->used;
+    if (arena->used <= arena->capacity) return arena->base + offset;
+    
+    ArenaSpill *spill = aligned_alloc(ARENA_ALIGN, ARENA_ALIGN + size);
+    if (!spill) {
+        printf("ERROR: Out of memory (arena spill of %zu bytes)\n", size);
+        exit(1);
+    }
+    heap_allocations++;
+    spill->next = arena->spills;
+    spill->offset = offset;
+    arena->spills = spill;
+    return (char *)spill + ARENA_ALIGN;
+}
+
+size_t arena_mark(const Arena *arena) {
+    return arena->used;
+}
+
+void arena_release(Arena *arena, size_t mark) {
+    while (arena->spills && arena->spills->offset >= mark) {
+        ArenaSpill *spill = arena->spills;
+        arena->spills = spill->next;
+        free(spill);
+    }
+    arena->used = mark;
+}
+
+void arena_reset(Arena *arena) {
+    arena_release(arena, 0);
+    if (arena->high_water <= arena->capacity) return;
+    // An eighth of headroom, so a slowly growing peak does not regrow every step
+    size_t capacity = (arena->high_water + arena->high_water / 8 + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    free(arena->base);
+    arena->base = aligned_alloc(ARENA_ALIGN, capacity);
+    if (!arena->base) {
+        printf("ERROR: Out of memory (arena of %zu bytes)\n", capacity);
+        exit(1);
+    }
+    heap_allocations++;
+    arena->capacity = capacity;
+}
+
+void detach_mapped_bodies();
+
+void reserve_bodies(int count) {
+    if (count <= body_capacity) return;
+    detach_mapped_bodies();
+    
+    int capacity = body_capacity ? body_capacity : INITIAL_BODY_CAPACITY;
+    while (capacity < count) capacity *= 2;
+#define GROW_BODY_FIELD(type, name) { \
+        int field_capacity = body_capacity; \
+        bodies.name = grow_buffer(bodies.name, &field_capacity, capacity, sizeof(type)); \
+    }
+    BODY_FIELDS(GROW_BODY_FIELD)
+#undef GROW_BODY_FIELD
+    body_capacity = capacity;
+}
+
+// Dead bodies keep zero mass so the vector kernels can sweep them branch-free
+void remove_body(int i) {
+    bodies.active[i] = false;
+    bodies.mass[i] = 0;
+    dead_body_count++;
+    forces_current = false;
+}
+
+// Squeezes out inactive slots, keeping the survivors in their original order
+void compact_bodies() {
+    int live = 0;
     for (int i = 0; i < body_count; i++) {
-        bodies[i].x = rand() % window_width;
-        bodies[i].y = rand() % window_height;
-        bodies[i].vx = (rand() % 100 - 50) / 50.0;
-        bodies[i].vy = (rand() % 100 - 50) / 50.0;
-        bodies[i].ax = 0;
-        bodies[i].ay = 0;
-        bodies[i].mass = 100 + rand() % 900;
-        bodies[i].radius = BODY_RADIUS + (bodies[i].mass / 200);
-        bodies[i].active = true;
-        bodies[i].r = rand() % 256;
-        bodies[i].g = rand() % 256;
-        bodies[i].b = rand() % 256;
+        if (!bodies.active[i]) continue;
+        if (live != i) {
+#define MOVE_BODY_FIELD(type, name) bodies.name[live] = bodies.name[i];
+            BODY_FIELDS(MOVE_BODY_FIELD)
+#undef MOVE_BODY_FIELD
+        }
+        live++;
     }
+    body_count = live;
+    dead_body_count = 0;
+    contacts_current = false;
 }
 
-void calculate_forces() {
+// Appends a live body and returns its index, or -1 once body_limit is reached
+int append_body(double x, double y, double vx, double vy, double mass, Uint8 r, Uint8 g, Uint8 b) {
+    if (body_count >= body_limit && dead_body_count > 0) {
+        compact_bodies();
+    }
+    if (body_count >= body_limit) {
+        log_message(LOG_WARN, TOPIC_GENERAL, "WARNING: Body limit of %d reached, body not added\n", body_limit);
+        return -1;
+    }
+    forces_current = false;
+    contacts_current = false;
+    
+    reserve_bodies(body_count + 1);
+    int i = body_count++;
+    bodies.x[i] = x;
+    bodies.y[i] = y;
+    bodies.vx[i] = vx;
+    bodies.vy[i] = vy;
+    bodies.ax[i] = 0;
+    bodies.ay[i] = 0;
+    bodies.mass[i] = mass;
+    bodies.radius[i] = fmin(BODY_RADIUS + mass / 200, MAX_RADIUS);
+    bodies.active[i] = true;
+    bodies.r[i] = r;
+    bodies.g[i] = g;
+    bodies.b[i] = b;
+    bodies.level[i] = 0;
+    bodies.id[i] = next_body_id++;
+    return i;
+}
+
+void maybe_compact_bodies() {
+    if (dead_body_count == 0) return;
+    if (dead_body_count * COMPACT_RATIO >= body_count || step_count % COMPACT_INTERVAL == 0) {
+        compact_bodies();
+    }
+}
+
+// Minimal fork-join pool. Task k always runs on thread k % thread_count, so a
+// given thread count reproduces the same work split (and rounding) every run.
+typedef void (*ParallelTask)(int task, int thread, void *context);
+pthread_t pool_threads[MAX_THREADS];
+pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;
+pthread_cond_t pool_idle = PTHREAD_COND_INITIALIZER;
+ParallelTask pool_task = NULL;
+void *pool_context = NULL;
+int pool_task_count = 0;
+int pool_generation = 0;
+int pool_busy = 0;
+bool pool_stopping = false;
+
+void run_thread_share(int thread, ParallelTask task, void *context, int task_count) {
+    for (int k = thread; k < task_count; k += thread_count) {
+        task(k, thread, context);
+    }
+}
+
+void *pool_worker(void *arg) {
+    int thread = (int)(intptr_t)arg;
+    int seen = 0;
+    
+    pthread_mutex_lock(&pool_mutex);
+    while (true) {
+        while (pool_generation == seen && !pool_stopping) {
+            pthread_cond_wait(&pool_wake, &pool_mutex);
+        }
+        if (pool_stopping) break;
+        
+        seen = pool_generation;
+        ParallelTask task = pool_task;
+        void *context = pool_context;
+        int task_count = pool_task_count;
+        pthread_mutex_unlock(&pool_mutex);
+        
+        run_thread_share(thread, task, context, task_count);
+        
+        pthread_mutex_lock(&pool_mutex);
+        if (--pool_busy == 0) pthread_cond_signal(&pool_idle);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+    return NULL;
+}
+
+void parallel_for(int task_count, ParallelTask task, void *context) {
+    if (thread_count <= 1 || task_count <= 1) {
+        for (int k = 0; k < task_count; k++) task(k, 0, context);
+        return;
+    }
+    
+    pthread_mutex_lock(&pool_mutex);
+    pool_task = task;
+    pool_context = context;
+    pool_task_count = task_count;
+    pool_busy = thread_count - 1;
+    pool_generation++;
+    pthread_cond_broadcast(&pool_wake);
+    pthread_mutex_unlock(&pool_mutex);
+    
+    run_thread_share(0, task, context, task_count);
+    
+    pthread_mutex_lock(&pool_mutex);
+    while (pool_busy > 0) pthread_cond_wait(&pool_idle, &pool_mutex);
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+void start_thread_pool(int requested) {
+    if (requested <= 0) requested = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (requested < 1) requested = 1;
+    if (requested > MAX_THREADS) requested = MAX_THREADS;
+    thread_count = requested;
+    
+    for (int t = 1; t < thread_count; t++) {
+        if (pthread_create(&pool_threads[t], NULL, pool_worker, (void *)(intptr_t)t) != 0) {
+            log_message(LOG_WARN, TOPIC_GENERAL, "WARNING: Could only start %d worker threads\n", t);
+            thread_count = t;
+            break;
+        }
+    }
+}
+
+void stop_thread_pool() {
+    pthread_mutex_lock(&pool_mutex);
+    pool_stopping = true;
+    pthread_cond_broadcast(&pool_wake);
+    pthread_mutex_unlock(&pool_mutex);
+    
+    for (int t = 1; t < thread_count; t++) {
+        pthread_join(pool_threads[t], NULL);
+    }
+    thread_count = 1;
+}
+
+// Reads "x y vx vy mass [r g b]" per line; blank lines and # comments are skipped
+bool load_initial_conditions(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        log_message(LOG_ERROR, TOPIC_GENERAL, "ERROR: Cannot open initial conditions '%s'\n", path);
+        return false;
+    }
+    
+    char line[512];
+    int line_number = 0;
+    body_count = 0;
+    dead_body_count = 0;
+    while (fgets(line, sizeof(line), file)) {
+        line_number++;
+        char *text = line;
+        while (*text == ' ' || *text == '\t') text++;
+        if (*text == '#' || *text == '\n' || *text == '\r' || *text == '\0') continue;
+        
+        double x, y, vx, vy, mass;
+        int r = -1, g = -1, b = -1;
+        int fields = sscanf(text, "%lf %lf %lf %lf %lf %d %d %d", &x, &y, &vx, &vy, &mass, &r, &g, &b);
+        if (fields < 5 || mass <= 0) {
+            log_message(LOG_ERROR, TOPIC_GENERAL, "ERROR: %s:%d: expected 'x y vx vy mass [r g b]'\n", path, line_number);
+            fclose(file);
+            return false;
+        }
+        
+        if (fields < 8) {
+            r = (int)(256 * random_uniform(&interactive_random));
+            g = (int)(256 * random_uniform(&interactive_random));
+            b = (int)(256 * random_uniform(&interactive_random));
+        }
+        if (append_body(x, y, vx, vy, mass, (Uint8)r, (Uint8)g, (Uint8)b) < 0) break;
+    }
+    
+    fclose(file);
+    return true;
+}
+
+bool save_bodies_text(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        log_message(LOG_ERROR, TOPIC_GENERAL, "ERROR: Cannot write '%s'\n", path);
+        return false;
+    }
+    
+    fprintf(file, "# x y vx vy mass r g b (step %d)\n", step_count);
     for (int i = 0; i < body_count; i++) {
-        if (!bodies[i].active) continue;
-        bodies[i].ax = 0;
-        bodies[i].ay = 0;
+        if (!bodies.active[i]) continue;
+        fprintf(file, "%.17g %.17g %.17g %.17g %.17g %d %d %d\n",
+                bodies.x[i], bodies.y[i], bodies.vx[i], bodies.vy[i], bodies.mass[i],
+                bodies.r[i], bodies.g[i], bodies.b[i]);
+    }
+    
+    fclose(file);
+    return true;
+}
+
+// Binary checkpoints: a header with the simulation parameters, a table with
+// one entry per BODY_FIELDS array, then the arrays themselves, each aligned so
+// that a private mapping of the file can serve as the body arrays directly.
+// Every slot up to body_count is stored, tombstones included, so a resumed
+// run continues exactly where the saved one was.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t field_count;
+    uint32_t byte_order;
+    int64_t body_count;
+    int64_t dead_body_count;
+    int64_t step_count;
+    double gravity, softening;
+    double max_velocity, max_mass;
+    double time_step, bh_theta, block_eta;
+    int32_t window_width, window_height;
+    int32_t force_backend;
+    int32_t forces_current;
+    char integrator[16];
+} CheckpointHeader;
+typedef struct {
+    char label[16];
+    uint32_t element_size;
+    uint32_t reserved;
+    uint64_t offset;
+} CheckpointField;
+static const char checkpoint_magic[8] = {'G', 'S', 'I', 'M', 'C', 'K', 'P', 'T'};
+#define COUNT_BODY_FIELD(type, name) + 1
+enum { BODY_FIELD_COUNT = 0 BODY_FIELDS(COUNT_BODY_FIELD) };
+#undef COUNT_BODY_FIELD
+
+// When the body arrays point into a mapped checkpoint, this is the mapping
+void *mapped_bodies = NULL;
+size_t mapped_bodies_size = 0;
+
+bool select_integrator(const char *request);
+
+void release_bodies() {
+    if (mapped_bodies) {
+        munmap(mapped_bodies, mapped_bodies_size);
+        mapped_bodies = NULL;
+    } else {
+#define FREE_BODY_FIELD(type, name) free(bodies.name);
+        BODY_FIELDS(FREE_BODY_FIELD)
+#undef FREE_BODY_FIELD
+    }
+    memset(&bodies, 0, sizeof(bodies));
+    body_capacity = 0;
+}
+
+// Moves mapped arrays to the heap, so that they can grow
+void detach_mapped_bodies() {
+    if (!mapped_bodies) return;
+    BodyArrays heap;
+    int capacity = body_count > 0 ? body_count : 1;
+#define COPY_OUT_BODY_FIELD(type, name) \
+    heap.name = malloc((size_t)capacity * sizeof(type)); \
+    if (!heap.name) { \
+        printf("ERROR: Out of memory while detaching the checkpoint\n"); \
+        exit(1); \
+    } \
+    memcpy(heap.name, bodies.name, (size_t)body_count * sizeof(type));
+    BODY_FIELDS(COPY_OUT_BODY_FIELD)
+#undef COPY_OUT_BODY_FIELD
+    munmap(mapped_bodies, mapped_bodies_size);
+    mapped_bodies = NULL;
+    bodies = heap;
+    body_capacity = capacity;
+}
+
+uint64_t checkpoint_align(uint64_t offset) {
+    return (offset + CHECKPOINT_ALIGN - 1) & ~(uint64_t)(CHECKPOINT_ALIGN - 1);
+}
+
+bool write_padding(FILE *file, uint64_t *offset) {
+    static const char zeros[CHECKPOINT_ALIGN] = {0};
+    uint64_t aligned = checkpoint_align(*offset);
+    if (aligned > *offset && fwrite(zeros, 1, aligned - *offset, file) != aligned - *offset) return false;
+    *offset = aligned;
+    return true;
+}
+
+// Streams the arrays straight from memory into a temporary file, which then
+// replaces `path`, so a crash mid-save never destroys the previous checkpoint
+bool save_checkpoint(const char *path) {
+    char temp_path[4096];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    FILE *file = fopen(temp_path, "wb");
+    if (!file) {
+        log_message(LOG_ERROR, TOPIC_GENERAL, "ERROR: Cannot write '%s'\n", temp_path);
+        return false;
+    }
+    double start = now_seconds();
+    
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, checkpoint_magic, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.header_size = sizeof(CheckpointHeader);
+    header.field_count = BODY_FIELD_COUNT;
+    header.byte_order = 0x01020304;
+    header.body_count = body_count;
+    header.dead_body_count = dead_body_count;
+    header.step_count = step_count;
+    header.gravity = gravity_constant;
+    header.softening = softening_length;
+    header.max_velocity = max_velocity;
+    header.max_mass = max_mass;
+    header.time_step = time_step;
+    header.bh_theta = bh_theta;
+    header.block_eta = block_eta;
+    header.window_width = window_width;
+    header.window_height = window_height;
+    header.force_backend = force_backend;
+    header.forces_current = forces_current;
+    snprintf(header.integrator, sizeof(header.integrator), "%s", integrator_name);
+    
+    CheckpointField fields[BODY_FIELD_COUNT];
+    memset(fields, 0, sizeof(fields));
+    uint64_t offset = sizeof(header) + sizeof(fields);
+    int f = 0;
+#define DESCRIBE_BODY_FIELD(type, name) \
+    snprintf(fields[f].label, sizeof(fields[f].label), "%s", #name); \
+    fields[f].element_size = sizeof(type); \
+    offset = checkpoint_align(offset); \
+    fields[f].offset = offset; \
+    offset += (uint64_t)body_count * sizeof(type); \
+    f++;
+    BODY_FIELDS(DESCRIBE_BODY_FIELD)
+#undef DESCRIBE_BODY_FIELD
+    
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(fields, sizeof(fields), 1, file) == 1;
+    offset = sizeof(header) + sizeof(fields);
+#define WRITE_BODY_FIELD(type, name) \
+    if (ok) { \
+        ok = write_padding(file, &offset) && \
+             fwrite(bodies.name, sizeof(type), body_count, file) == (size_t)body_count; \
+        offset += (uint64_t)body_count * sizeof(type); \
+    }
+    BODY_FIELDS(WRITE_BODY_FIELD)
+#undef WRITE_BODY_FIELD
+    
+    if (fclose(file) != 0) ok = false;
+    if (!ok || rename(temp_path, path) != 0) {
+        log_message(LOG_ERROR, TOPIC_GENERAL, "ERROR: Writing checkpoint '%s' failed\n", path);
+        remove(temp_path);
+        return false;
+    }
+    log_message(LOG_INFO, TOPIC_GENERAL, "Saved %d bodies at step %d to %s (%.1f MB in %.1f ms)\n",
+                                         body_count, step_count, path, offset / 1e6, (now_seconds() - start) * 1000);
+    return true;
+}
+
+// Maps the checkpoint copy-on-write and points the body arrays into it; the
+// pages are only read (or copied, once written) as the simulation touches
+// them. A file whose fields do not match this build is copied instead.
+bool load_checkpoint(const char *path) {
+    double start = now_seconds();
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        log_message(LOG_ERROR, TOPIC_GENERAL, "ERROR: Cannot open checkpoint '%s'\n", path);
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(CheckpointHeader)) {
+        close(fd);
+        log_message(LOG_ERROR, TOPIC_GENERAL, "ERROR: '%s' is not a checkpoint\n", path);
+        return false;
     }
+    size_t size = info.st_size;
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        log_message(LOG_ERROR, TOPIC_GENERAL, "ERROR: Cannot map checkpoint '%s'\n", path);
+        return false;
+    }
+    
+    const CheckpointHeader *header = map;
+    const CheckpointField *fields = (const CheckpointField *)((const char *)map + sizeof(CheckpointHeader));
+    const char *problem = NULL;
+    if (memcmp(header->magic, checkpoint_magic, sizeof(header->magic)) != 0) problem = "not a checkpoint";
+    else if (header->byte_order != 0x01020304) problem = "written on a machine of different byte order";
+    else if (header->version != CHECKPOINT_VERSION || header->header_size != sizeof(CheckpointHeader)) problem = "unsupported version";
+    else if (header->body_count < 0 || header->body_count > MAX_BODIES) problem = "bad body count";
+    else if (header->dead_body_count < 0 || header->dead_body_count > header->body_count) problem = "bad dead body count";
+    else if (header->body_count - header->dead_body_count > body_limit) problem = "more bodies than --max-bodies allows";
+    else if (sizeof(CheckpointHeader) + header->field_count * sizeof(CheckpointField) > size) problem = "truncated";
+    if (problem) {
+        munmap(map, size);
+        log_message(LOG_ERROR, TOPIC_GENERAL, "ERROR: '%s': %s\n", path, problem);
+        return false;
+    }
+    
+    // Locate each of this build's fields; zero-copy needs all of them
+    int count = (int)header->body_count;
+    const void *sources[BODY_FIELD_COUNT];
+    bool complete = true, have_ids = false;
+    int f = 0;
+#define FIND_BODY_FIELD(type, name) \
+    sources[f] = NULL; \
+    for (uint32_t k = 0; k < header->field_count; k++) { \
+        if (strncmp(fields[k].label, #name, sizeof(fields[k].label)) == 0 && \
+            fields[k].element_size == sizeof(type) && \
+            fields[k].offset % CHECKPOINT_ALIGN == 0 && \
+            fields[k].offset + (uint64_t)count * sizeof(type) <= size) { \
+            sources[f] = (const char *)map + fields[k].offset; \
+        } \
+    } \
+    if (!sources[f]) complete = false; \
+    if (strcmp(#name, "id") == 0) have_ids = sources[f] != NULL; \
+    f++;
+    BODY_FIELDS(FIND_BODY_FIELD)
+#undef FIND_BODY_FIELD
     
+    if (complete) {
+        release_bodies();
+        f = 0;
+#define MAP_BODY_FIELD(type, name) bodies.name = (type *)sources[f++];
+        BODY_FIELDS(MAP_BODY_FIELD)
+#undef MAP_BODY_FIELD
+        mapped_bodies = map;
+        mapped_bodies_size = size;
+        body_capacity = count;
+    } else {
+        body_count = 0;
+        reserve_bodies(count);
+        f = 0;
+#define COPY_BODY_FIELD(type, name) \
+        if (sources[f]) memcpy(bodies.name, sources[f], (size_t)count * sizeof(type)); \
+        else memset(bodies.name, 0, (size_t)count * sizeof(type)); \
+        f++;
+        BODY_FIELDS(COPY_BODY_FIELD)
+#undef COPY_BODY_FIELD
+    }
+    
+    body_count = count;
+    dead_body_count = (int)header->dead_body_count;
+    // Checkpoints from before body ids get them in slot order
+    next_body_id = 0;
     for (int i = 0; i < body_count; i++) {
-        if (!bodies[i].active) continue;
+        if (!have_ids) bodies.id[i] = i;
+        if (bodies.id[i] >= next_body_id) next_body_id = bodies.id[i] + 1;
+    }
+    step_count = (int)header->step_count;
+    if (!dt_given) time_step = header->time_step;
+    if (!theta_given) bh_theta = header->bh_theta;
+    if (!block_eta_given) block_eta = header->block_eta;
+    if (!max_velocity_given) max_velocity = header->max_velocity;
+    if (!max_mass_given) max_mass = header->max_mass;
+    if (!size_given) {
+        window_width = header->window_width;
+        window_height = header->window_height;
+    }
+    if (!force_given) {
+        force_backend = header->force_backend == FORCE_BARNES_HUT || header->force_backend == FORCE_FMM ?
+                        (ForceBackend)header->force_backend : FORCE_DIRECT;
+    }
+#ifndef FIXED_PHYSICS
+    if (!gravity_given) gravity_constant = header->gravity;
+    if (!softening_given) softening_length = header->softening;
+#endif
+    // Saved accelerations are only reusable under the parameters they were computed with
+    forces_current = header->forces_current && complete && !theta_given && !force_given && !fmm_order_given &&
+                     header->gravity == gravity_constant && header->softening == softening_length;
+    char name[sizeof(header->integrator) + 1];
+    snprintf(name, sizeof(name), "%.*s", (int)sizeof(header->integrator), header->integrator);
+    if (header->gravity != gravity_constant || header->softening != softening_length) {
+        log_message(LOG_WARN, TOPIC_GENERAL, "WARNING: Checkpoint was written with G %g and softening %g\n",
+                                             header->gravity, header->softening);
+    }
+    if (header->max_velocity != max_velocity || header->max_mass != max_mass) {
+        log_message(LOG_WARN, TOPIC_GENERAL, "WARNING: Checkpoint was written with velocity limit %g and mass limit %g\n",
+                                             header->max_velocity, header->max_mass);
+    }
+    if (!complete) munmap(map, size);
+    if (!integrator_given && !select_integrator(name)) select_integrator("euler");
+    
+    log_message(LOG_INFO, TOPIC_GENERAL, "Loaded %d bodies at step %d from %s (%s, %.2f ms)\n",
+                                         body_count, step_count, path, complete ? "mapped" : "copied",
+                                         (now_seconds() - start) * 1000);
+    return true;
+}
+
+// Distributed runs point this at a per-rank file
+const char *default_checkpoint_path = DEFAULT_CHECKPOINT_PATH;
+
+const char *checkpoint_target() {
+    return checkpoint_path ? checkpoint_path : default_checkpoint_path;
+}
+
+bool is_checkpoint_file(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) return false;
+    char magic[sizeof(checkpoint_magic)];
+    bool match = fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+                 memcmp(magic, checkpoint_magic, sizeof(magic)) == 0;
+    fclose(file);
+    return match;
+}
+
+double kinetic_energy();
+double potential_energy();
+
+// Initial-condition generators. Body i draws only from stream i, and every
+// reduction runs over fixed blocks in block order, so a seed gives the same
+// bits on any thread count. Plummer and uniform velocities are scaled to
+// virial equilibrium (2K = |W|); the Kuzmin disk is a thin disk, so its
+// analytic circular speeds are already in equilibrium in this 2D solver.
+typedef struct {
+    Distribution distribution;
+    uint64_t seed;
+    double cx, cy;
+    double scale;
+    double kuzmin_mass_fraction;
+    double shift_vx, shift_vy;
+    double velocity_scale;
+    double *partials;
+} Generator;
+
+double *generator_partials = NULL;
+int generator_partials_capacity = 0;
+
+void generate_body(const Generator *generator, int i, RandomStream random) {
+    double x, y, vx, vy;
+    double a = generator->scale;
+    
+    if (generator->distribution == DISTRIBUTION_PLUMMER) {
+        // Positions and velocities of a 3D Plummer sphere (Aarseth, Henon &
+        // Wielen 1974) in units G = M = a = 1, projected onto the plane
+        double r;
+        do {
+            double c = cbrt(random_uniform(&random));
+            r = 1 / sqrt(1 / (c * c) - 1);
+        } while (r > PLUMMER_CUTOFF);
+        double q, y_q, w;
+        do {
+            q = random_uniform(&random);
+            y_q = 0.1 * random_uniform(&random);
+            w = 1 - q * q;
+        } while (y_q > q * q * w * w * w * sqrt(w));
+        double speed = q * M_SQRT2 / sqrt(sqrt(1 + r * r));
+        double cos_theta = 2 * random_uniform(&random) - 1;
+        double phi = 2 * M_PI * random_uniform(&random);
+        double radial = r * sqrt(1 - cos_theta * cos_theta);
+        x = generator->cx + a * radial * cos(phi);
+        y = generator->cy + a * radial * sin(phi);
+        cos_theta = 2 * random_uniform(&random) - 1;
+        phi = 2 * M_PI * random_uniform(&random);
+        double planar = speed * sqrt(1 - cos_theta * cos_theta);
+        vx = planar * cos(phi);
+        vy = planar * sin(phi);
+    } else if (generator->distribution == DISTRIBUTION_KUZMIN) {
+        // Invert M(<R) = 1 - a / sqrt(R^2 + a^2) over the mass inside the cutoff
+        double u = generator->kuzmin_mass_fraction * random_uniform(&random);
+        double R = a * sqrt(1 / ((1 - u) * (1 - u)) - 1);
+        double phi = 2 * M_PI * random_uniform(&random);
+        double t = sqrt(R * R + a * a);
+        double speed = R / (t * sqrt(t));
+        x = generator->cx + R * cos(phi);
+        y = generator->cy + R * sin(phi);
+        vx = -speed * sin(phi);
+        vy = speed * cos(phi);
+    } else if (generator->distribution == DISTRIBUTION_UNIFORM) {
+        x = window_width * random_uniform(&random);
+        y = window_height * random_uniform(&random);
+        vx = random_normal(&random);
+        vy = random_normal(&random);
+    } else {
+        x = (int)(window_width * random_uniform(&random));
+        y = (int)(window_height * random_uniform(&random));
+        vx = ((int)(100 * random_uniform(&random)) - 50) / 50.0;
+        vy = ((int)(100 * random_uniform(&random)) - 50) / 50.0;
+    }
+    
+    bodies.x[i] = x;
+    bodies.y[i] = y;
+    bodies.vx[i] = vx;
+    bodies.vy[i] = vy;
+    bodies.ax[i] = 0;
+    bodies.ay[i] = 0;
+    bodies.mass[i] = 100 + (int)(900 * random_uniform(&random));
+    bodies.radius[i] = BODY_RADIUS + (bodies.mass[i] / 200);
+    bodies.active[i] = true;
+    uint32_t colour = random_bits(&random);
+    bodies.r[i] = (Uint8)colour;
+    bodies.g[i] = (Uint8)(colour >> 8);
+    bodies.b[i] = (Uint8)(colour >> 16);
+    bodies.level[i] = 0;
+    bodies.id[i] = (uint32_t)i;
+}
+
+// Fills its block and records mass and momentum for the reductions. The first
+// RANDOM_PREFETCH blocks of each body's stream are computed in batches up
+// front, which covers all but the occasional rejection-sampling retry.
+void generate_task(int task, int thread, void *context) {
+    const Generator *generator = context;
+    int begin = task * GENERATOR_BLOCK;
+    int end = begin + GENERATOR_BLOCK < body_count ? begin + GENERATOR_BLOCK : body_count;
+    uint32_t words[RANDOM_PREFETCH][4][RANDOM_BATCH];
+    double mass = 0, px = 0, py = 0;
+    for (int i = begin; i < end; i++) {
+        int k = (i - begin) % RANDOM_BATCH;
+        if (k == 0) {
+            for (int round = 0; round < RANDOM_PREFETCH; round++) {
+                philox4x32_batch(generator->seed, (uint64_t)i, round, words[round]);
+            }
+        }
+        RandomStream random = random_stream(generator->seed, (uint64_t)i);
+        for (int w = 0; w < 4 * RANDOM_PREFETCH; w++) random.words[w] = words[w / 4][w % 4][k];
+        random.round = RANDOM_PREFETCH;
+        random.available = 4 * RANDOM_PREFETCH;
+        generate_body(generator, i, random);
+        mass += bodies.mass[i];
+        px += bodies.mass[i] * bodies.vx[i];
+        py += bodies.mass[i] * bodies.vy[i];
+    }
+    generator->partials[3 * task] = mass;
+    generator->partials[3 * task + 1] = px;
+    generator->partials[3 * task + 2] = py;
+}
+
+// Kinetic energy of the block in the centre-of-mass frame
+void generator_kinetic_task(int task, int thread, void *context) {
+    const Generator *generator = context;
+    int begin = task * GENERATOR_BLOCK;
+    int end = begin + GENERATOR_BLOCK < body_count ? begin + GENERATOR_BLOCK : body_count;
+    double kinetic = 0;
+    for (int i = begin; i < end; i++) {
+        double vx = bodies.vx[i] - generator->shift_vx;
+        double vy = bodies.vy[i] - generator->shift_vy;
+        kinetic += 0.5 * bodies.mass[i] * (vx * vx + vy * vy);
+    }
+    generator->partials[task] = kinetic;
+}
+
+// Potential energy of VIRIAL_PAIR_BLOCK random pairs; each Philox block under
+// the inverted seed picks two pairs
+void generator_potential_task(int task, int thread, void *context) {
+    const Generator *generator = context;
+    uint32_t words[4][RANDOM_BATCH];
+    double potential = 0;
+    for (int k = 0; k < VIRIAL_PAIR_BLOCK; k++) {
+        int lane = k / 2 % RANDOM_BATCH;
+        if (k % (2 * RANDOM_BATCH) == 0) {
+            philox4x32_batch(~generator->seed, ((uint64_t)task * VIRIAL_PAIR_BLOCK + k) / 2, 0, words);
+        }
+        int i = (int)(body_count * ((words[2 * (k % 2)][lane] + 0.5) * 0x1.0p-32));
+        int j = (int)((body_count - 1) * ((words[2 * (k % 2) + 1][lane] + 0.5) * 0x1.0p-32));
+        if (j >= i) j++;
+        double dx = bodies.x[j] - bodies.x[i];
+        double dy = bodies.y[j] - bodies.y[i];
+        potential -= gravity_constant * bodies.mass[i] * bodies.mass[j] / sqrt(dx * dx + dy * dy + softening_length * softening_length);
+    }
+    generator->partials[task] = potential;
+}
+
+void generator_scale_task(int task, int thread, void *context) {
+    const Generator *generator = context;
+    int begin = task * GENERATOR_BLOCK;
+    int end = begin + GENERATOR_BLOCK < body_count ? begin + GENERATOR_BLOCK : body_count;
+    for (int i = begin; i < end; i++) {
+        bodies.vx[i] = generator->velocity_scale * (bodies.vx[i] - generator->shift_vx);
+        bodies.vy[i] = generator->velocity_scale * (bodies.vy[i] - generator->shift_vy);
+    }
+}
+
+// Exact below VIRIAL_PAIR_SAMPLES pairs, otherwise a random-pair estimate
+double generator_potential(Generator *generator) {
+    double pairs = 0.5 * (double)body_count * (body_count - 1);
+    if (pairs <= VIRIAL_PAIR_SAMPLES) return potential_energy();
+    
+    int tasks = VIRIAL_PAIR_SAMPLES / VIRIAL_PAIR_BLOCK;
+    generator->partials = generator_partials = grow_buffer(generator_partials, &generator_partials_capacity, tasks, sizeof(double));
+    parallel_for(tasks, generator_potential_task, generator);
+    double potential = 0;
+    for (int k = 0; k < tasks; k++) potential += generator->partials[k];
+    return potential * pairs / ((double)tasks * VIRIAL_PAIR_BLOCK);
+}
+
+void generate_bodies(uint64_t seed) {
+    double start = now_seconds();
+    Generator generator = {distribution, seed, window_width / 2.0, window_height / 2.0, 0, 0, 0, 0, 1, NULL};
+    double extent = fmin(window_width, window_height) / 2;
+    if (distribution == DISTRIBUTION_PLUMMER) generator.scale = extent / PLUMMER_CUTOFF;
+    if (distribution == DISTRIBUTION_KUZMIN) {
+        generator.scale = extent / KUZMIN_CUTOFF;
+        generator.kuzmin_mass_fraction = 1 - 1 / sqrt(1 + KUZMIN_CUTOFF * KUZMIN_CUTOFF);
+    }
+    
+    int tasks = (body_count + GENERATOR_BLOCK - 1) / GENERATOR_BLOCK;
+    generator.partials = generator_partials = grow_buffer(generator_partials, &generator_partials_capacity, 3 * tasks, sizeof(double));
+    parallel_for(tasks, generate_task, &generator);
+    double mass = 0, px = 0, py = 0;
+    for (int k = 0; k < tasks; k++) {
+        mass += generator.partials[3 * k];
+        px += generator.partials[3 * k + 1];
+        py += generator.partials[3 * k + 2];
+    }
+    
+    if (distribution != DISTRIBUTION_RANDOM && body_count > 1) {
+        generator.shift_vx = px / mass;
+        generator.shift_vy = py / mass;
+        parallel_for(tasks, generator_kinetic_task, &generator);
+        double kinetic = 0;
+        for (int k = 0; k < tasks; k++) kinetic += generator.partials[k];
+        if (distribution == DISTRIBUTION_KUZMIN) {
+            // Speeds above are for G M = 1 with M the untruncated disk mass
+            generator.velocity_scale = sqrt(gravity_constant * mass / generator.kuzmin_mass_fraction);
+        } else {
+            generator.velocity_scale = sqrt(0.5 * fabs(generator_potential(&generator)) / kinetic);
+        }
+        parallel_for(tasks, generator_scale_task, &generator);
         
-        for (int j = i + 1; j < body_count; j++) {
-            if (!bodies[j].active) continue;
-            
-            double dx = bodies[j].x - bodies[i].x;
-            double dy = bodies[j].y - bodies[i].y;
-            double dist_sq = dx * dx + dy * dy + SOFTENING * SOFTENING;
-            double dist = sqrt(dist_sq);
-            
-            double force = G * bodies[i].mass * bodies[j].mass / dist_sq;
+        double rms = generator.velocity_scale * sqrt(2 * kinetic / mass);
+        if (rms > max_velocity / 3) {
+            log_message(LOG_WARN, TOPIC_GENERAL, "WARNING: Equilibrium speeds (rms %.1f) approach the velocity limit of %.0f; "
+                        "use a larger --size or fewer bodies\n", rms, max_velocity);
+        }
+    }
+    next_body_id = (uint32_t)body_count;
+    log_message(LOG_INFO, TOPIC_GENERAL, "Generated %d bodies (%s, seed %llu) in %.3f s\n",
+                body_count, distribution_names[distribution], (unsigned long long)seed, now_seconds() - start);
+}
+
+bool init_bodies() {
+    uint64_t seed = seed_given ? random_seed : (uint64_t)time(NULL);
+    interactive_random = random_stream(seed, UINT64_MAX);
+    step_count = 0;
+    next_body_id = 0;
+    contacts_current = false;
+    if (initial_conditions_path) {
+        if (is_checkpoint_file(initial_conditions_path)) return load_checkpoint(initial_conditions_path);
+        return load_initial_conditions(initial_conditions_path);
+    }
+    
+    body_count = initial_body_count;
+    dead_body_count = 0;
+    forces_current = false;
+    reserve_bodies(body_count);
+    generate_bodies(seed);
+    return true;
+}
+
+void calculate_forces_direct() {
+    for (int i = 0; i < body_count; i++) {
+        if (!bodies.active[i]) continue;
+        bodies.ax[i] = 0;
+        bodies.ay[i] = 0;
+    }
+    
+    for (int i = 0; i < body_count; i++) {
+        if (!bodies.active[i]) continue;
+        
+        for (int j = i + 1; j < body_count; j++) {
+            if (!bodies.active[j]) continue;
+            
+            double dx = bodies.x[j] - bodies.x[i];
+            double dy = bodies.y[j] - bodies.y[i];
+            double dist_sq = dx * dx + dy * dy + softening_length * softening_length;
+            double dist = sqrt(dist_sq);
+            
+            double force = gravity_constant * bodies.mass[i] * bodies.mass[j] / dist_sq;
             
             double fx = force * dx / dist;
             double fy = force * dy / dist;
             
-            bodies[i].ax += fx / bodies[i].mass;
-            bodies[i].ay += fy / bodies[i].mass;
-            bodies[j].ax -= fx / bodies[j].mass;
-            bodies[j].ay -= fy / bodies[j].mass;
+            bodies.ax[i] += fx / bodies.mass[i];
+            bodies.ay[i] += fy / bodies.mass[i];
+            bodies.ax[j] -= fx / bodies.mass[j];
+            bodies.ay[j] -= fy / bodies.mass[j];
+        }
+    }
+}
+
+// Positions and masses as the direct-sum kernels read them. In double builds
+// these are the body arrays themselves. Single-precision builds copy them to
+// float, relative to the centre of the area to keep the most mantissa bits,
+// and zero-pad to a multiple of FORCE_PAD so the SIMD loops need no tail.
+const force_real *force_x = NULL, *force_y = NULL, *force_mass = NULL;
+int force_input_count = 0;
+#ifdef FORCE_SINGLE
+float *force_x_buffer = NULL, *force_y_buffer = NULL, *force_mass_buffer = NULL;
+int force_x_capacity = 0, force_y_capacity = 0, force_mass_capacity = 0;
+
+void prepare_force_inputs() {
+    int padded = (body_count + FORCE_PAD - 1) / FORCE_PAD * FORCE_PAD;
+    force_x_buffer = grow_buffer(force_x_buffer, &force_x_capacity, padded, sizeof(float));
+    force_y_buffer = grow_buffer(force_y_buffer, &force_y_capacity, padded, sizeof(float));
+    force_mass_buffer = grow_buffer(force_mass_buffer, &force_mass_capacity, padded, sizeof(float));
+    double origin_x = window_width / 2.0, origin_y = window_height / 2.0;
+    for (int i = 0; i < body_count; i++) {
+        force_x_buffer[i] = (float)(bodies.x[i] - origin_x);
+        force_y_buffer[i] = (float)(bodies.y[i] - origin_y);
+        force_mass_buffer[i] = (float)bodies.mass[i];
+    }
+    for (int i = body_count; i < padded; i++) {
+        force_x_buffer[i] = force_y_buffer[i] = force_mass_buffer[i] = 0;
+    }
+    force_x = force_x_buffer;
+    force_y = force_y_buffer;
+    force_mass = force_mass_buffer;
+    force_input_count = padded;
+}
+#else
+void prepare_force_inputs() {
+    force_x = bodies.x;
+    force_y = bodies.y;
+    force_mass = bodies.mass;
+    force_input_count = body_count;
+}
+#endif
+
+// Contact candidates found by the CPU direct sum itself. While
+// calculate_forces_with_contacts() runs, the kernels compare each dist_sq
+// they compute against a per-row bound from contact_filter(), which assumes
+// the largest radius for the other body; the few pairs that pass are tested
+// exactly in note_contact(). Every pair within
+// radius_i + radius_j + contact_margin is kept, so the list stays a superset
+// of the touching pairs until a body has drifted contact_margin / 2, and the
+// collision stage only re-tests it instead of sweeping the bodies again.
+typedef struct {
+    int a, b;
+} CollisionPair;
+typedef struct {
+    CollisionPair *pairs;
+    int count, capacity;
+} PairList;
+PairList thread_pairs[MAX_THREADS];
+PairList collision_pairs;
+_Thread_local PairList *contact_list = NULL;
+double contact_reach = -1;
+double contact_margin = 0;
+double contact_drift = 0;
+int *wrapped_bodies = NULL;
+int wrapped_count = 0, wrapped_capacity = 0;
+
+void push_pair(PairList *list, int a, int b) {
+    list->pairs = grow_buffer(list->pairs, &list->capacity, list->count + 1, sizeof(CollisionPair));
+    list->pairs[list->count].a = a;
+    list->pairs[list->count].b = b;
+    list->count++;
+}
+
+bool bodies_touch(int i, int j, double margin) {
+    double dx = bodies.x[j] - bodies.x[i];
+    double dy = bodies.y[j] - bodies.y[i];
+    double reach = bodies.radius[i] + bodies.radius[j] + margin;
+    return dx * dx + dy * dy < reach * reach;
+}
+
+// Each pair is kept once, from its lower index; j may be a padding lane
+void note_contact(int i, int j) {
+    if (j <= i || j >= body_count || !bodies.active[i] || !bodies.active[j]) return;
+    if (bodies_touch(i, j, contact_margin)) push_pair(contact_list, i, j);
+}
+
+void note_contacts(int i, int j, unsigned lanes) {
+    for (; lanes; lanes &= lanes - 1) note_contact(i, j + __builtin_ctz(lanes));
+}
+
+// Bound on dist_sq (softened, as the kernels compute it) for row i; -1 when
+// contacts are not being collected, which no dist_sq is below
+double contact_filter(int i) {
+    if (contact_reach < 0) return -1;
+    double reach = bodies.radius[i] + contact_reach;
+    return reach * reach + softening_length * softening_length;
+}
+
+// Adds the interactions of body i with bodies [start, body_count) using an exact sqrt
+void direct_row_tail(int i, int start, force_sum *ax, force_sum *ay) {
+    double filter = contact_filter(i);
+    const force_real soft_sq = (force_real)(softening_length * softening_length);
+    for (int j = start; j < body_count; j++) {
+        force_real dx = force_x[j] - force_x[i];
+        force_real dy = force_y[j] - force_y[i];
+        force_real dist_sq = dx * dx + dy * dy + soft_sq;
+        if (dist_sq < filter) note_contact(i, j);
+        force_real inv_dist = 1 / force_sqrt(dist_sq);
+        force_real s = force_mass[j] * inv_dist * inv_dist * inv_dist;
+        *ax += s * dx;
+        *ay += s * dy;
+    }
+}
+
+// Row kernels compute the full acceleration of bodies [begin, end) against every
+// body. The self term vanishes because dx = dy = 0, and dead bodies have zero mass.
+void direct_rows_scalar(int begin, int end) {
+    for (int i = begin; i < end; i++) {
+        force_sum ax = 0, ay = 0;
+        if (bodies.active[i]) direct_row_tail(i, 0, &ax, &ay);
+        bodies.ax[i] = gravity_constant * ax;
+        bodies.ay[i] = gravity_constant * ay;
+    }
+}
+
+#if defined(HAVE_X86_KERNELS) && !defined(FORCE_SINGLE)
+__attribute__((target("avx2,fma")))
+void direct_rows_avx2(int begin, int end) {
+    const double *x = bodies.x;
+    const double *y = bodies.y;
+    const double *mass = bodies.mass;
+    int n4 = body_count & ~3;
+    const __m256d soft_sq = _mm256_set1_pd(softening_length * softening_length);
+    const __m256d half = _mm256_set1_pd(0.5);
+    const __m256d three_halves = _mm256_set1_pd(1.5);
+    
+    for (int i = begin; i < end; i++) {
+        if (!bodies.active[i]) {
+            bodies.ax[i] = 0;
+            bodies.ay[i] = 0;
+            continue;
+        }
+        
+        __m256d xi = _mm256_set1_pd(x[i]);
+        __m256d yi = _mm256_set1_pd(y[i]);
+        __m256d filter = _mm256_set1_pd(contact_filter(i));
+        __m256d ax = _mm256_setzero_pd();
+        __m256d ay = _mm256_setzero_pd();
+        
+        for (int j = 0; j < n4; j += 4) {
+            __m256d dx = _mm256_sub_pd(_mm256_loadu_pd(x + j), xi);
+            __m256d dy = _mm256_sub_pd(_mm256_loadu_pd(y + j), yi);
+            __m256d dist_sq = _mm256_fmadd_pd(dx, dx, _mm256_fmadd_pd(dy, dy, soft_sq));
+            int near = _mm256_movemask_pd(_mm256_cmp_pd(dist_sq, filter, _CMP_LT_OQ));
+            if (near) note_contacts(i, j, near);
+            
+            // 12-bit single precision estimate, then two Newton steps to ~46 bits
+            __m256d inv = _mm256_cvtps_pd(_mm_rsqrt_ps(_mm256_cvtpd_ps(dist_sq)));
+            __m256d half_dist_sq = _mm256_mul_pd(half, dist_sq);
+            inv = _mm256_mul_pd(inv, _mm256_fnmadd_pd(half_dist_sq, _mm256_mul_pd(inv, inv), three_halves));
+            inv = _mm256_mul_pd(inv, _mm256_fnmadd_pd(half_dist_sq, _mm256_mul_pd(inv, inv), three_halves));
+            
+            __m256d s = _mm256_mul_pd(_mm256_loadu_pd(mass + j), _mm256_mul_pd(inv, _mm256_mul_pd(inv, inv)));
+            ax = _mm256_fmadd_pd(s, dx, ax);
+            ay = _mm256_fmadd_pd(s, dy, ay);
+        }
+        
+        double lanes_x[4], lanes_y[4];
+        _mm256_storeu_pd(lanes_x, ax);
+        _mm256_storeu_pd(lanes_y, ay);
+        double sum_x = (lanes_x[0] + lanes_x[1]) + (lanes_x[2] + lanes_x[3]);
+        double sum_y = (lanes_y[0] + lanes_y[1]) + (lanes_y[2] + lanes_y[3]);
+        direct_row_tail(i, n4, &sum_x, &sum_y);
+        bodies.ax[i] = gravity_constant * sum_x;
+        bodies.ay[i] = gravity_constant * sum_y;
+    }
+}
+
+__attribute__((target("avx512f")))
+void direct_rows_avx512(int begin, int end) {
+    const double *x = bodies.x;
+    const double *y = bodies.y;
+    const double *mass = bodies.mass;
+    int n = body_count;
+    const __m512d soft_sq = _mm512_set1_pd(softening_length * softening_length);
+    const __m512d half = _mm512_set1_pd(0.5);
+    const __m512d three_halves = _mm512_set1_pd(1.5);
+    
+    for (int i = begin; i < end; i++) {
+        if (!bodies.active[i]) {
+            bodies.ax[i] = 0;
+            bodies.ay[i] = 0;
+            continue;
+        }
+        
+        __m512d xi = _mm512_set1_pd(x[i]);
+        __m512d yi = _mm512_set1_pd(y[i]);
+        __m512d filter = _mm512_set1_pd(contact_filter(i));
+        __m512d ax = _mm512_setzero_pd();
+        __m512d ay = _mm512_setzero_pd();
+        
+        for (int j = 0; j < n; j += 8) {
+            // Lanes past the end load zero mass and contribute nothing
+            __mmask8 lanes = n - j >= 8 ? 0xFF : (__mmask8)((1u << (n - j)) - 1);
+            __m512d dx = _mm512_sub_pd(_mm512_maskz_loadu_pd(lanes, x + j), xi);
+            __m512d dy = _mm512_sub_pd(_mm512_maskz_loadu_pd(lanes, y + j), yi);
+            __m512d dist_sq = _mm512_fmadd_pd(dx, dx, _mm512_fmadd_pd(dy, dy, soft_sq));
+            __mmask8 near = _mm512_cmp_pd_mask(dist_sq, filter, _CMP_LT_OQ) & lanes;
+            if (near) note_contacts(i, j, near);
+            
+            // 14-bit estimate, then two Newton steps to full double precision
+            __m512d inv = _mm512_rsqrt14_pd(dist_sq);
+            __m512d half_dist_sq = _mm512_mul_pd(half, dist_sq);
+            inv = _mm512_mul_pd(inv, _mm512_fnmadd_pd(half_dist_sq, _mm512_mul_pd(inv, inv), three_halves));
+            inv = _mm512_mul_pd(inv, _mm512_fnmadd_pd(half_dist_sq, _mm512_mul_pd(inv, inv), three_halves));
+            
+            __m512d s = _mm512_mul_pd(_mm512_maskz_loadu_pd(lanes, mass + j),
+                                      _mm512_mul_pd(inv, _mm512_mul_pd(inv, inv)));
+            ax = _mm512_fmadd_pd(s, dx, ax);
+            ay = _mm512_fmadd_pd(s, dy, ay);
+        }
+        
+        bodies.ax[i] = gravity_constant * _mm512_reduce_add_pd(ax);
+        bodies.ay[i] = gravity_constant * _mm512_reduce_add_pd(ay);
+    }
+}
+#endif
+
+#if defined(__aarch64__) && !defined(FORCE_SINGLE)
+void direct_rows_neon(int begin, int end) {
+    const double *x = bodies.x;
+    const double *y = bodies.y;
+    const double *mass = bodies.mass;
+    int n2 = body_count & ~1;
+    const float64x2_t soft_sq = vdupq_n_f64(softening_length * softening_length);
+    
+    for (int i = begin; i < end; i++) {
+        if (!bodies.active[i]) {
+            bodies.ax[i] = 0;
+            bodies.ay[i] = 0;
+            continue;
+        }
+        
+        float64x2_t xi = vdupq_n_f64(x[i]);
+        float64x2_t yi = vdupq_n_f64(y[i]);
+        float64x2_t filter = vdupq_n_f64(contact_filter(i));
+        float64x2_t ax = vdupq_n_f64(0);
+        float64x2_t ay = vdupq_n_f64(0);
+        
+        for (int j = 0; j < n2; j += 2) {
+            float64x2_t dx = vsubq_f64(vld1q_f64(x + j), xi);
+            float64x2_t dy = vsubq_f64(vld1q_f64(y + j), yi);
+            float64x2_t dist_sq = vfmaq_f64(vfmaq_f64(soft_sq, dy, dy), dx, dx);
+            uint64x2_t near = vcltq_f64(dist_sq, filter);
+            if (vgetq_lane_u64(near, 0) | vgetq_lane_u64(near, 1)) {
+                note_contacts(i, j, (unsigned)(vgetq_lane_u64(near, 0) & 1) | (unsigned)(vgetq_lane_u64(near, 1) & 2));
+            }
+            
+            // 8-bit estimate, then three Newton steps via FRSQRTS
+            float64x2_t inv = vrsqrteq_f64(dist_sq);
+            inv = vmulq_f64(inv, vrsqrtsq_f64(vmulq_f64(dist_sq, inv), inv));
+            inv = vmulq_f64(inv, vrsqrtsq_f64(vmulq_f64(dist_sq, inv), inv));
+            inv = vmulq_f64(inv, vrsqrtsq_f64(vmulq_f64(dist_sq, inv), inv));
+            
+            float64x2_t s = vmulq_f64(vld1q_f64(mass + j), vmulq_f64(inv, vmulq_f64(inv, inv)));
+            ax = vfmaq_f64(ax, s, dx);
+            ay = vfmaq_f64(ay, s, dy);
+        }
+        
+        double sum_x = vaddvq_f64(ax);
+        double sum_y = vaddvq_f64(ay);
+        direct_row_tail(i, n2, &sum_x, &sum_y);
+        bodies.ax[i] = gravity_constant * sum_x;
+        bodies.ay[i] = gravity_constant * sum_y;
+    }
+}
+#endif
+
+// Single-precision row kernels: twice the lanes of the double ones, with one
+// Newton step on the hardware rsqrt estimate for ~23 bits. Lane sums are
+// flushed into force_sum every FORCE_SUM_CHUNK bodies, so mixed builds lose
+// no accuracy to long float accumulations.
+#if defined(HAVE_X86_KERNELS) && defined(FORCE_SINGLE)
+__attribute__((target("avx2,fma")))
+void direct_rows_avx2(int begin, int end) {
+    const float *x = force_x;
+    const float *y = force_y;
+    const float *mass = force_mass;
+    int n = force_input_count;
+    const __m256 soft_sq = _mm256_set1_ps(softening_length * softening_length);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 three_halves = _mm256_set1_ps(1.5f);
+    
+    for (int i = begin; i < end; i++) {
+        if (!bodies.active[i]) {
+            bodies.ax[i] = 0;
+            bodies.ay[i] = 0;
+            continue;
+        }
+        
+        __m256 xi = _mm256_set1_ps(x[i]);
+        __m256 yi = _mm256_set1_ps(y[i]);
+        __m256 filter = _mm256_set1_ps((float)contact_filter(i));
+        force_sum sum_x = 0, sum_y = 0;
+        for (int chunk = 0; chunk < n; chunk += FORCE_SUM_CHUNK) {
+            int chunk_end = chunk + FORCE_SUM_CHUNK < n ? chunk + FORCE_SUM_CHUNK : n;
+            __m256 ax = _mm256_setzero_ps();
+            __m256 ay = _mm256_setzero_ps();
+            for (int j = chunk; j < chunk_end; j += 8) {
+                __m256 dx = _mm256_sub_ps(_mm256_loadu_ps(x + j), xi);
+                __m256 dy = _mm256_sub_ps(_mm256_loadu_ps(y + j), yi);
+                __m256 dist_sq = _mm256_fmadd_ps(dx, dx, _mm256_fmadd_ps(dy, dy, soft_sq));
+                int near = _mm256_movemask_ps(_mm256_cmp_ps(dist_sq, filter, _CMP_LT_OQ));
+                if (near) note_contacts(i, j, near);
+                __m256 inv = _mm256_rsqrt_ps(dist_sq);
+                inv = _mm256_mul_ps(inv, _mm256_fnmadd_ps(_mm256_mul_ps(half, dist_sq), _mm256_mul_ps(inv, inv), three_halves));
+                __m256 s = _mm256_mul_ps(_mm256_loadu_ps(mass + j), _mm256_mul_ps(inv, _mm256_mul_ps(inv, inv)));
+                ax = _mm256_fmadd_ps(s, dx, ax);
+                ay = _mm256_fmadd_ps(s, dy, ay);
+            }
+            float lanes_x[8], lanes_y[8];
+            _mm256_storeu_ps(lanes_x, ax);
+            _mm256_storeu_ps(lanes_y, ay);
+            for (int k = 0; k < 8; k++) {
+                sum_x += lanes_x[k];
+                sum_y += lanes_y[k];
+            }
+        }
+        bodies.ax[i] = gravity_constant * sum_x;
+        bodies.ay[i] = gravity_constant * sum_y;
+    }
+}
+
+__attribute__((target("avx512f")))
+void direct_rows_avx512(int begin, int end) {
+    const float *x = force_x;
+    const float *y = force_y;
+    const float *mass = force_mass;
+    int n = force_input_count;
+    const __m512 soft_sq = _mm512_set1_ps(softening_length * softening_length);
+    const __m512 half = _mm512_set1_ps(0.5f);
+    const __m512 three_halves = _mm512_set1_ps(1.5f);
+    
+    for (int i = begin; i < end; i++) {
+        if (!bodies.active[i]) {
+            bodies.ax[i] = 0;
+            bodies.ay[i] = 0;
+            continue;
+        }
+        
+        __m512 xi = _mm512_set1_ps(x[i]);
+        __m512 yi = _mm512_set1_ps(y[i]);
+        __m512 filter = _mm512_set1_ps((float)contact_filter(i));
+        force_sum sum_x = 0, sum_y = 0;
+        for (int chunk = 0; chunk < n; chunk += FORCE_SUM_CHUNK) {
+            int chunk_end = chunk + FORCE_SUM_CHUNK < n ? chunk + FORCE_SUM_CHUNK : n;
+            __m512 ax = _mm512_setzero_ps();
+            __m512 ay = _mm512_setzero_ps();
+            for (int j = chunk; j < chunk_end; j += 16) {
+                __m512 dx = _mm512_sub_ps(_mm512_loadu_ps(x + j), xi);
+                __m512 dy = _mm512_sub_ps(_mm512_loadu_ps(y + j), yi);
+                __m512 dist_sq = _mm512_fmadd_ps(dx, dx, _mm512_fmadd_ps(dy, dy, soft_sq));
+                __mmask16 near = _mm512_cmp_ps_mask(dist_sq, filter, _CMP_LT_OQ);
+                if (near) note_contacts(i, j, near);
+                __m512 inv = _mm512_rsqrt14_ps(dist_sq);
+                inv = _mm512_mul_ps(inv, _mm512_fnmadd_ps(_mm512_mul_ps(half, dist_sq), _mm512_mul_ps(inv, inv), three_halves));
+                __m512 s = _mm512_mul_ps(_mm512_loadu_ps(mass + j), _mm512_mul_ps(inv, _mm512_mul_ps(inv, inv)));
+                ax = _mm512_fmadd_ps(s, dx, ax);
+                ay = _mm512_fmadd_ps(s, dy, ay);
+            }
+            sum_x += _mm512_reduce_add_ps(ax);
+            sum_y += _mm512_reduce_add_ps(ay);
+        }
+        bodies.ax[i] = gravity_constant * sum_x;
+        bodies.ay[i] = gravity_constant * sum_y;
+    }
+}
+#endif
+
+#if defined(__aarch64__) && defined(FORCE_SINGLE)
+void direct_rows_neon(int begin, int end) {
+    const float *x = force_x;
+    const float *y = force_y;
+    const float *mass = force_mass;
+    int n = force_input_count;
+    const float32x4_t soft_sq = vdupq_n_f32(softening_length * softening_length);
+    const uint32x4_t lane_bits = {1, 2, 4, 8};
+    
+    for (int i = begin; i < end; i++) {
+        if (!bodies.active[i]) {
+            bodies.ax[i] = 0;
+            bodies.ay[i] = 0;
+            continue;
+        }
+        
+        float32x4_t xi = vdupq_n_f32(x[i]);
+        float32x4_t yi = vdupq_n_f32(y[i]);
+        float32x4_t filter = vdupq_n_f32((float)contact_filter(i));
+        force_sum sum_x = 0, sum_y = 0;
+        for (int chunk = 0; chunk < n; chunk += FORCE_SUM_CHUNK) {
+            int chunk_end = chunk + FORCE_SUM_CHUNK < n ? chunk + FORCE_SUM_CHUNK : n;
+            float32x4_t ax = vdupq_n_f32(0);
+            float32x4_t ay = vdupq_n_f32(0);
+            for (int j = chunk; j < chunk_end; j += 4) {
+                float32x4_t dx = vsubq_f32(vld1q_f32(x + j), xi);
+                float32x4_t dy = vsubq_f32(vld1q_f32(y + j), yi);
+                float32x4_t dist_sq = vfmaq_f32(vfmaq_f32(soft_sq, dy, dy), dx, dx);
+                uint32x4_t near = vcltq_f32(dist_sq, filter);
+                if (vmaxvq_u32(near)) note_contacts(i, j, vaddvq_u32(vandq_u32(near, lane_bits)));
+                
+                // 8-bit estimate, then two Newton steps via FRSQRTS
+                float32x4_t inv = vrsqrteq_f32(dist_sq);
+                inv = vmulq_f32(inv, vrsqrtsq_f32(vmulq_f32(dist_sq, inv), inv));
+                inv = vmulq_f32(inv, vrsqrtsq_f32(vmulq_f32(dist_sq, inv), inv));
+                
+                float32x4_t s = vmulq_f32(vld1q_f32(mass + j), vmulq_f32(inv, vmulq_f32(inv, inv)));
+                ax = vfmaq_f32(ax, s, dx);
+                ay = vfmaq_f32(ay, s, dy);
+            }
+            sum_x += vaddvq_f32(ax);
+            sum_y += vaddvq_f32(ay);
+        }
+        bodies.ax[i] = gravity_constant * sum_x;
+        bodies.ay[i] = gravity_constant * sum_y;
+    }
+}
+#endif
+
+// Picks the widest direct-sum kernel the CPU supports, or the one requested
+bool select_direct_kernel(const char *request) {
+    bool automatic = strcmp(request, "auto") == 0;
+    
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if ((automatic || strcmp(request, "avx512") == 0) && __builtin_cpu_supports("avx512f")) {
+        direct_kernel = direct_rows_avx512;
+        direct_kernel_name = "avx512";
+        return true;
+    }
+    if ((automatic || strcmp(request, "avx2") == 0) &&
+        __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        direct_kernel = direct_rows_avx2;
+        direct_kernel_name = "avx2";
+        return true;
+    }
+#endif
+#ifdef __aarch64__
+    if (automatic || strcmp(request, "neon") == 0) {
+        direct_kernel = direct_rows_neon;
+        direct_kernel_name = "neon";
+        return true;
+    }
+#endif
+    if (strcmp(request, "scalar") == 0) {
+        direct_kernel = direct_rows_scalar;
+        direct_kernel_name = "scalar";
+        return true;
+    }
+    // Without SIMD the symmetric pass wins, as it evaluates each pair once
+    if (automatic || strcmp(request, "pairwise") == 0) {
+        direct_kernel = NULL;
+        direct_kernel_name = "pairwise";
+        return true;
+    }
+    
+    printf("Force kernel '%s' is not available on this CPU\n", request);
+    return false;
+}
+
+// Per-thread acceleration buffers for the symmetric pairwise pass, taken
+// from the step arena for the length of one pass
+typedef struct {
+    double *ax, *ay;
+} ThreadAccumulator;
+ThreadAccumulator thread_accumulators[MAX_THREADS];
+int *tile_pairs = NULL;
+
+void clear_accumulator_task(int task, int thread, void *context) {
+    ThreadAccumulator *acc = &thread_accumulators[thread];
+    memset(acc->ax, 0, body_count * sizeof(double));
+    memset(acc->ay, 0, body_count * sizeof(double));
+}
+
+// Applies every pair between tiles I and J (j > i inside a diagonal tile) to
+// the calling thread's own buffer, so the symmetric update never races
+void pairwise_tile_task(int task, int thread, void *context) {
+    int i_begin = tile_pairs[2 * task] * FORCE_TILE;
+    int j_begin = tile_pairs[2 * task + 1] * FORCE_TILE;
+    int i_end = i_begin + FORCE_TILE < body_count ? i_begin + FORCE_TILE : body_count;
+    int j_end = j_begin + FORCE_TILE < body_count ? j_begin + FORCE_TILE : body_count;
+    double *acc_x = thread_accumulators[thread].ax;
+    double *acc_y = thread_accumulators[thread].ay;
+    const force_real *x = force_x;
+    const force_real *y = force_y;
+    const force_real *mass = force_mass;
+    // A local, so the stores into acc_x/acc_y cannot force a reload per pair
+    const force_real soft_sq = (force_real)(softening_length * softening_length);
+    contact_list = &thread_pairs[thread];
+    
+    for (int i = i_begin; i < i_end; i++) {
+        force_real xi = x[i], yi = y[i], mi = mass[i];
+        force_sum ax = 0, ay = 0;
+        double filter = contact_filter(i);
+        
+        for (int j = i_begin == j_begin ? i + 1 : j_begin; j < j_end; j++) {
+            force_real dx = x[j] - xi;
+            force_real dy = y[j] - yi;
+            force_real dist_sq = dx * dx + dy * dy + soft_sq;
+            if (dist_sq < filter) note_contact(i, j);
+            force_real inv_dist = 1 / force_sqrt(dist_sq);
+            force_real inv_dist3 = inv_dist * inv_dist * inv_dist;
+            
+            ax += mass[j] * inv_dist3 * dx;
+            ay += mass[j] * inv_dist3 * dy;
+            acc_x[j] -= mi * inv_dist3 * dx;
+            acc_y[j] -= mi * inv_dist3 * dy;
+        }
+        
+        acc_x[i] += ax;
+        acc_y[i] += ay;
+    }
+}
+
+// Sums the per-thread buffers in thread order, giving the same bits every run
+void reduce_accumulator_task(int task, int thread, void *context) {
+    int begin = task * FORCE_TILE;
+    int end = begin + FORCE_TILE < body_count ? begin + FORCE_TILE : body_count;
+    
+    for (int i = begin; i < end; i++) {
+        double ax = 0, ay = 0;
+        for (int t = 0; t < thread_count; t++) {
+            ax += thread_accumulators[t].ax[i];
+            ay += thread_accumulators[t].ay[i];
+        }
+        bodies.ax[i] = gravity_constant * ax;
+        bodies.ay[i] = gravity_constant * ay;
+    }
+}
+
+void calculate_forces_pairwise() {
+    int tiles = (body_count + FORCE_TILE - 1) / FORCE_TILE;
+    int pair_count = tiles * (tiles + 1) / 2;
+    size_t mark = arena_mark(&step_arena);
+    tile_pairs = arena_alloc(&step_arena, 2 * (size_t)pair_count * sizeof(int));
+    for (int t = 0; t < thread_count; t++) {
+        thread_accumulators[t].ax = arena_alloc(&step_arena, body_count * sizeof(double));
+        thread_accumulators[t].ay = arena_alloc(&step_arena, body_count * sizeof(double));
+    }
+    
+    int k = 0;
+    for (int ti = 0; ti < tiles; ti++) {
+        for (int tj = ti; tj < tiles; tj++) {
+            tile_pairs[k++] = ti;
+            tile_pairs[k++] = tj;
+        }
+    }
+    
+    prepare_force_inputs();
+    parallel_for(thread_count, clear_accumulator_task, NULL);
+    parallel_for(pair_count, pairwise_tile_task, NULL);
+    parallel_for(tiles, reduce_accumulator_task, NULL);
+    arena_release(&step_arena, mark);
+}
+
+// Row kernels need no reduction: each target body is owned by one task
+void direct_rows_task(int task, int thread, void *context) {
+    int begin = task * ROW_BLOCK;
+    int end = begin + ROW_BLOCK < body_count ? begin + ROW_BLOCK : body_count;
+    contact_list = &thread_pairs[thread];
+    direct_kernel(begin, end);
+}
+
+void calculate_forces_rows() {
+    if (direct_kernel == NULL) {
+        calculate_forces_pairwise();
+        return;
+    }
+    prepare_force_inputs();
+    parallel_for((body_count + ROW_BLOCK - 1) / ROW_BLOCK, direct_rows_task, NULL);
+}
+
+// The direct sum with contact collection switched on. The filter adds a pixel
+// so that float builds, which compare in single precision, miss nothing.
+void calculate_forces_with_contacts() {
+    double max_radius = 0;
+    for (int i = 0; i < body_count; i++) {
+        if (bodies.active[i]) max_radius = fmax(max_radius, bodies.radius[i]);
+    }
+    // Room for both bodies of a pair to drift one step at the velocity limit,
+    // with a little slack for rounding in clamp_velocity()
+    contact_margin = (2 * max_velocity + 1) * fabs(time_step);
+    for (int t = 0; t < thread_count; t++) {
+        thread_pairs[t].count = 0;
+    }
+    contact_reach = max_radius + contact_margin + 1;
+    calculate_forces_rows();
+    contact_reach = -1;
+    contacts_current = true;
+    contact_drift = 0;
+    wrapped_count = 0;
+}
+
+// OpenGL compute backend for the direct sum. The context comes from EGL, so it
+// needs neither a window nor SDL, and it is made current on whichever thread
+// evaluates forces first. Device buffers persist and only grow; each
+// evaluation uploads positions and masses (16 bytes a body, float32 relative
+// to the centre of the area) and reads back accelerations, both O(N) against
+// the O(N^2) kernel. The kernel is the classic shared-memory tiling: each
+// work group stages GPU_TILE bodies at a time and every invocation sums
+// their pull on its own body.
+#ifdef USE_GL
+static const char *gpu_force_shader =
+    "#version 430\n"
+    "layout(local_size_x = 256) in;\n"
+    "layout(std430, binding = 0) readonly buffer Bodies { vec4 body[]; };\n"
+    "layout(std430, binding = 1) writeonly buffer Accelerations { vec2 acceleration[]; };\n"
+    "uniform int body_count;\n"
+    "uniform float softening_sq;\n"
+    "shared vec4 tile[256];\n"
+    "void main() {\n"
+    "    uint i = gl_GlobalInvocationID.x;\n"
+    "    vec2 self = i < uint(body_count) ? body[i].xy : vec2(0.0);\n"
+    "    vec2 acc = vec2(0.0);\n"
+    "    for (int start = 0; start < body_count; start += 256) {\n"
+    "        uint j = uint(start) + gl_LocalInvocationID.x;\n"
+    "        tile[gl_LocalInvocationID.x] = j < uint(body_count) ? body[j] : vec4(0.0);\n"
+    "        barrier();\n"
+    "        for (int k = 0; k < 256; k++) {\n"
+    "            vec2 d = tile[k].xy - self;\n"
+    "            float inv = inversesqrt(dot(d, d) + softening_sq);\n"
+    "            acc += (tile[k].z * inv * inv * inv) * d;\n"
+    "        }\n"
+    "        barrier();\n"
+    "    }\n"
+    "    if (i < uint(body_count)) acceleration[i] = acc;\n"
+    "}\n";
+
+EGLDisplay gpu_display = EGL_NO_DISPLAY;
+EGLContext gpu_context = EGL_NO_CONTEXT;
+_Thread_local bool gpu_context_current = false;
+GLuint gpu_program = 0;
+GLuint gpu_body_buffer = 0, gpu_acceleration_buffer = 0;
+GLint gpu_count_uniform = -1;
+int gpu_buffer_capacity = 0;
+float *gpu_upload = NULL, *gpu_result = NULL;
+int gpu_upload_capacity = 0, gpu_result_capacity = 0;
+
+bool start_gpu() {
+    PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (get_platform_display) gpu_display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (gpu_display == EGL_NO_DISPLAY) gpu_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (gpu_display == EGL_NO_DISPLAY || !eglInitialize(gpu_display, NULL, NULL) || !eglBindAPI(EGL_OPENGL_API)) {
+        log_message(LOG_ERROR, TOPIC_GENERAL, "ERROR: No EGL display for the GPU backend (0x%x)\n", eglGetError());
+        return false;
+    }
+    const EGLint attributes[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 4,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    gpu_context = eglCreateContext(gpu_display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, attributes);
+    if (gpu_context == EGL_NO_CONTEXT || !eglMakeCurrent(gpu_display, EGL_NO_SURFACE, EGL_NO_SURFACE, gpu_context)) {
+        log_message(LOG_ERROR, TOPIC_GENERAL, "ERROR: Could not create an OpenGL 4.3 context (0x%x)\n", eglGetError());
+        eglTerminate(gpu_display);
+        return false;
+    }
+    
+    GLuint shader = glCreateShader(GL_COMPUTE_SHADER);
+    glShaderSource(shader, 1, &gpu_force_shader, NULL);
+    glCompileShader(shader);
+    GLint ok = 0;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+    if (ok) {
+        gpu_program = glCreateProgram();
+        glAttachShader(gpu_program, shader);
+        glLinkProgram(gpu_program);
+        glGetProgramiv(gpu_program, GL_LINK_STATUS, &ok);
+    }
+    if (!ok) {
+        char info[1024] = "";
+        if (gpu_program) glGetProgramInfoLog(gpu_program, sizeof(info), NULL, info);
+        else glGetShaderInfoLog(shader, sizeof(info), NULL, info);
+        log_message(LOG_ERROR, TOPIC_GENERAL, "ERROR: GPU force shader failed to build: %s\n", info);
+        glDeleteShader(shader);
+        eglMakeCurrent(gpu_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        eglDestroyContext(gpu_display, gpu_context);
+        eglTerminate(gpu_display);
+        return false;
+    }
+    glDeleteShader(shader);
+    glUseProgram(gpu_program);
+    glUniform1f(glGetUniformLocation(gpu_program, "softening_sq"), softening_length * softening_length);
+    gpu_count_uniform = glGetUniformLocation(gpu_program, "body_count");
+    glGenBuffers(1, &gpu_body_buffer);
+    glGenBuffers(1, &gpu_acceleration_buffer);
+    
+    log_message(LOG_INFO, TOPIC_GENERAL, "GPU forces on %s (%s)\n", (const char *)glGetString(GL_RENDERER),
+                (const char *)glGetString(GL_VERSION));
+    // The physics thread takes the context over on its first evaluation
+    eglMakeCurrent(gpu_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    gpu_ready = true;
+    return true;
+}
+
+void stop_gpu() {
+    if (!gpu_ready) return;
+    eglMakeCurrent(gpu_display, EGL_NO_SURFACE, EGL_NO_SURFACE, gpu_context);
+    glDeleteBuffers(1, &gpu_body_buffer);
+    glDeleteBuffers(1, &gpu_acceleration_buffer);
+    glDeleteProgram(gpu_program);
+    eglMakeCurrent(gpu_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(gpu_display, gpu_context);
+    eglTerminate(gpu_display);
+    free(gpu_upload);
+    free(gpu_result);
+    gpu_ready = false;
+}
+
+// Runs the kernel over every body and leaves G-scaled accelerations in
+// gpu_result as interleaved (ax, ay) floats
+void gpu_compute() {
+    if (!gpu_context_current) {
+        eglMakeCurrent(gpu_display, EGL_NO_SURFACE, EGL_NO_SURFACE, gpu_context);
+        glUseProgram(gpu_program);
+        gpu_context_current = true;
+    }
+    if (body_count > gpu_buffer_capacity) {
+        int capacity = gpu_buffer_capacity ? gpu_buffer_capacity : 1024;
+        while (capacity < body_count) capacity *= 2;
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, gpu_body_buffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, (GLsizeiptr)capacity * 4 * sizeof(float), NULL, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, gpu_acceleration_buffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, (GLsizeiptr)capacity * 2 * sizeof(float), NULL, GL_DYNAMIC_READ);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, gpu_body_buffer);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, gpu_acceleration_buffer);
+        gpu_buffer_capacity = capacity;
+    }
+    
+    gpu_upload = grow_buffer(gpu_upload, &gpu_upload_capacity, 4 * body_count, sizeof(float));
+    gpu_result = grow_buffer(gpu_result, &gpu_result_capacity, 2 * body_count, sizeof(float));
+    double origin_x = window_width / 2.0, origin_y = window_height / 2.0;
+    for (int i = 0; i < body_count; i++) {
+        gpu_upload[4 * i] = (float)(bodies.x[i] - origin_x);
+        gpu_upload[4 * i + 1] = (float)(bodies.y[i] - origin_y);
+        gpu_upload[4 * i + 2] = (float)bodies.mass[i];
+        gpu_upload[4 * i + 3] = 0;
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, gpu_body_buffer);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, (GLsizeiptr)body_count * 4 * sizeof(float), gpu_upload);
+    glUniform1i(gpu_count_uniform, body_count);
+    glDispatchCompute((body_count + GPU_TILE - 1) / GPU_TILE, 1, 1);
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, gpu_acceleration_buffer);
+    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, (GLsizeiptr)body_count * 2 * sizeof(float), gpu_result);
+}
+
+void calculate_forces_gpu() {
+    if (body_count == 0) return;
+    gpu_compute();
+    for (int i = 0; i < body_count; i++) {
+        bodies.ax[i] = bodies.active[i] ? gravity_constant * gpu_result[2 * i] : 0;
+        bodies.ay[i] = bodies.active[i] ? gravity_constant * gpu_result[2 * i + 1] : 0;
+    }
+}
+
+// The kernel always covers every body; only the listed ones take the result
+void calculate_forces_gpu_subset(const int *list, int count) {
+    gpu_compute();
+    for (int k = 0; k < count; k++) {
+        int i = list[k];
+        bodies.ax[i] = gravity_constant * gpu_result[2 * i];
+        bodies.ay[i] = gravity_constant * gpu_result[2 * i + 1];
+    }
+}
+#else
+bool start_gpu() {
+    return false;
+}
+
+void stop_gpu() {
+}
+
+void calculate_forces_gpu() {
+}
+
+void calculate_forces_gpu_subset(const int *list, int count) {
+}
+#endif
+
+const char *force_backend_name() {
+    if (force_backend == FORCE_BARNES_HUT) return "Barnes-Hut";
+    if (force_backend == FORCE_FMM) return "FMM";
+    if (force_backend == FORCE_GPU) return "GPU direct sum";
+    return "direct sum";
+}
+
+// The tree always walks in double and the shader always runs in float
+const char *force_precision_name() {
+    if (force_backend == FORCE_BARNES_HUT || force_backend == FORCE_FMM) return "double";
+    if (force_backend == FORCE_GPU) return "float";
+    return FORCE_PRECISION_NAME;
+}
+
+int quad_new_node(double cx, double cy, double half, int depth) {
+    if (quad_node_count == quad_node_capacity) {
+        int capacity = quad_node_capacity ? quad_node_capacity * 2 : 256;
+        QuadNode *nodes = realloc(quad_nodes, capacity * sizeof(QuadNode));
+        if (!nodes) {
+            printf("ERROR: Out of memory while building the quadtree\n");
+            exit(1);
+        }
+        quad_nodes = nodes;
+        quad_node_capacity = capacity;
+    }
+    
+    QuadNode *node = &quad_nodes[quad_node_count];
+    node->cx = cx;
+    node->cy = cy;
+    node->half = half;
+    node->mass = 0;
+    node->mx = 0;
+    node->my = 0;
+    node->children = -1;
+    node->first = -1;
+    node->depth = depth;
+    return quad_node_count++;
+}
+
+int quad_child_for(const QuadNode *node, double x, double y) {
+    return node->children + (x >= node->cx) + 2 * (y >= node->cy);
+}
+
+void quad_split(int n) {
+    double cx = quad_nodes[n].cx;
+    double cy = quad_nodes[n].cy;
+    double quarter = quad_nodes[n].half / 2;
+    int depth = quad_nodes[n].depth + 1;
+    
+    int first_child = quad_new_node(cx - quarter, cy - quarter, quarter, depth);
+    quad_new_node(cx + quarter, cy - quarter, quarter, depth);
+    quad_new_node(cx - quarter, cy + quarter, quarter, depth);
+    quad_new_node(cx + quarter, cy + quarter, quarter, depth);
+    quad_nodes[n].children = first_child;
+    
+    // A split leaf only ever holds one body, so it moves down as a whole
+    int b = quad_nodes[n].first;
+    int child = quad_child_for(&quad_nodes[n], bodies.x[b], bodies.y[b]);
+    quad_nodes[n].first = -1;
+    quad_nodes[child].first = b;
+    quad_leaf[b] = child;
+}
+
+void quad_insert(int b) {
+    int n = 0;
+    while (true) {
+        if (quad_nodes[n].children >= 0) {
+            n = quad_child_for(&quad_nodes[n], bodies.x[b], bodies.y[b]);
+            continue;
+        }
+        
+        if (quad_nodes[n].first < 0) {
+            quad_nodes[n].first = b;
+            quad_next[b] = -1;
+            quad_leaf[b] = n;
+            return;
+        }
+        
+        // Coincident bodies would split forever; keep them in one leaf instead
+        if (quad_nodes[n].depth >= QUAD_MAX_DEPTH) {
+            quad_next[b] = quad_nodes[n].first;
+            quad_nodes[n].first = b;
+            quad_leaf[b] = n;
+            return;
+        }
+        
+        quad_split(n);
+    }
+}
+
+void quad_unlink(int b) {
+    int *link = &quad_nodes[quad_leaf[b]].first;
+    while (*link != b) link = &quad_next[*link];
+    *link = quad_next[b];
+    quad_leaf[b] = -1;
+}
+
+bool quad_contains(int n, double x, double y) {
+    return fabs(x - quad_nodes[n].cx) <= quad_nodes[n].half && fabs(y - quad_nodes[n].cy) <= quad_nodes[n].half;
+}
+
+// A leaf must keep its bodies inside its cell, or the walk's opening test
+// (which trusts the cell bounds) could approximate a cell holding the body
+bool quad_body_moves(int i) {
+    bool wanted = i < body_count && bodies.active[i];
+    int leaf = quad_leaf[i];
+    if (leaf < 0) return wanted;
+    return !wanted || !quad_contains(leaf, bodies.x[i], bodies.y[i]);
+}
+
+// Interleaves 16-bit cell coordinates; x takes the low bit to match the
+// child numbering in quad_child_for(), so key order is depth-first order
+uint32_t morton_spread(uint32_t v) {
+    v &= 0xffff;
+    v = (v | v << 8) & 0x00ff00ff;
+    v = (v | v << 4) & 0x0f0f0f0f;
+    v = (v | v << 2) & 0x33333333;
+    v = (v | v << 1) & 0x55555555;
+    return v;
+}
+
+uint32_t morton_key(double x, double y, double min_x, double min_y, double scale) {
+    uint32_t cell_x = (uint32_t)fmin(65535, fmax(0, (x - min_x) * scale));
+    uint32_t cell_y = (uint32_t)fmin(65535, fmax(0, (y - min_y) * scale));
+    return morton_spread(cell_x) | morton_spread(cell_y) << 1;
+}
+
+// LSD radix sort of (key << 32 | index) on the key half, eight bits a pass
+void morton_sort(uint64_t *keys, uint64_t *scratch, int count) {
+    for (int shift = 32; shift < 64; shift += 8) {
+        int offsets[257] = {0};
+        for (int k = 0; k < count; k++) offsets[(keys[k] >> shift & 0xff) + 1]++;
+        for (int d = 0; d < 256; d++) offsets[d + 1] += offsets[d];
+        for (int k = 0; k < count; k++) scratch[offsets[keys[k] >> shift & 0xff]++] = keys[k];
+        uint64_t *swap = keys;
+        keys = scratch;
+        scratch = swap;
+    }
+}
+
+// First position in sorted keys[begin, end) whose key digit at this level
+// (0 is the root's quadrant) is >= digit
+int morton_digit_bound(const uint64_t *keys, int begin, int end, int level, uint32_t digit) {
+    int shift = 2 * (15 - level);
+    while (begin < end) {
+        int mid = begin + (end - begin) / 2;
+        if ((keys[mid] >> 32 >> shift & 3) < digit) begin = mid + 1;
+        else end = mid;
+    }
+    return begin;
+}
+
+// Masses and centres of mass from the current positions. Bodies never sit
+// outside their cell, so the fixed cell bounds need no refit
+void refit_quadtree() {
+    // Children always come after their parent, so a reverse sweep is bottom-up
+    for (int n = quad_node_count - 1; n >= 0; n--) {
+        QuadNode *node = &quad_nodes[n];
+        double mass = 0, mx = 0, my = 0;
+        
+        if (node->children >= 0) {
+            for (int c = node->children; c < node->children + 4; c++) {
+                mass += quad_nodes[c].mass;
+                mx += quad_nodes[c].mass * quad_nodes[c].mx;
+                my += quad_nodes[c].mass * quad_nodes[c].my;
+            }
+        } else {
+            for (int b = node->first; b >= 0; b = quad_next[b]) {
+                mass += bodies.mass[b];
+                mx += bodies.mass[b] * bodies.x[b];
+                my += bodies.mass[b] * bodies.y[b];
+            }
+        }
+        
+        node->mass = mass;
+        node->mx = mass > 0 ? mx / mass : node->cx;
+        node->my = mass > 0 ? my / mass : node->cy;
+    }
+}
+
+// Inserting in Morton order allocates nodes roughly depth-first, and the
+// walk follows quad_order, so neighbouring bodies share cached nodes
+void build_quadtree() {
+    double min_x = INFINITY, min_y = INFINITY;
+    double max_x = -INFINITY, max_y = -INFINITY;
+    for (int i = 0; i < body_count; i++) {
+        if (!bodies.active[i]) continue;
+        min_x = fmin(min_x, bodies.x[i]);
+        min_y = fmin(min_y, bodies.y[i]);
+        max_x = fmax(max_x, bodies.x[i]);
+        max_y = fmax(max_y, bodies.y[i]);
+    }
+    
+    quad_node_count = 0;
+    quad_next = grow_buffer(quad_next, &quad_next_capacity, body_count, sizeof(int));
+    quad_leaf = grow_buffer(quad_leaf, &quad_leaf_capacity, body_count, sizeof(int));
+    quad_order = grow_buffer(quad_order, &quad_order_capacity, body_count, sizeof(int));
+    quad_order_count = body_count;
+    quad_moved = 0;
+    quad_rebuild_pending = false;
+    quad_rebuilds++;
+    for (int i = 0; i < body_count; i++) quad_leaf[i] = -1;
+    
+    if (min_x > max_x) {
+        quad_new_node(0, 0, 1, 0);
+        for (int i = 0; i < body_count; i++) quad_order[i] = i;
+        quad_built_nodes = quad_node_count;
+        return;
+    }
+    
+    // The slack lets bodies drift outward for a while before the root has to grow
+    double half = fmax(max_x - min_x, max_y - min_y) / 2 * (1 + QUAD_ROOT_SLACK) + 1e-9;
+    quad_new_node((min_x + max_x) / 2, (min_y + max_y) / 2, half, 0);
+    
+    size_t mark = arena_mark(&step_arena);
+    quad_keys = arena_alloc(&step_arena, body_count * sizeof(uint64_t));
+    quad_key_scratch = arena_alloc(&step_arena, body_count * sizeof(uint64_t));
+    int active = 0;
+    double scale = 65536 / (2 * half);
+    for (int i = 0; i < body_count; i++) {
+        if (!bodies.active[i]) continue;
+        uint32_t key = morton_key(bodies.x[i], bodies.y[i], quad_nodes[0].cx - half, quad_nodes[0].cy - half, scale);
+        quad_keys[active++] = (uint64_t)key << 32 | (uint32_t)i;
+    }
+    morton_sort(quad_keys, quad_key_scratch, active);
+    
+    int inactive = active;
+    for (int k = 0; k < active; k++) {
+        quad_order[k] = (int)(uint32_t)quad_keys[k];
+        quad_insert(quad_order[k]);
+    }
+    for (int i = 0; i < body_count; i++) {
+        if (!bodies.active[i]) quad_order[inactive++] = i;
+    }
+    arena_release(&step_arena, mark);
+    quad_built_nodes = quad_node_count;
+    refit_quadtree();
+}
+
+// Moves only the bodies that strayed from their leaf, then refits. Any
+// change to the body set is just more moves, so compaction and merges need
+// no hook. Too many moves since the last build, a body outside the root, or
+// a node count bloated by empty leaves means a full rebuild instead
+void update_quadtree() {
+    if (quad_rebuild_pending || quad_node_count == 0) {
+        build_quadtree();
+        return;
+    }
+    quad_next = grow_buffer(quad_next, &quad_next_capacity, body_count, sizeof(int));
+    quad_leaf = grow_buffer(quad_leaf, &quad_leaf_capacity, body_count, sizeof(int));
+    quad_order = grow_buffer(quad_order, &quad_order_capacity, body_count, sizeof(int));
+    for (int i = quad_order_count; i < body_count; i++) {
+        quad_leaf[i] = -1;
+        quad_order[quad_order_count++] = i;
+    }
+    
+    // Counted first, so that a tree past saving is not patched up in vain
+    int moving = 0;
+    for (int i = 0; i < quad_order_count; i++) moving += quad_body_moves(i);
+    if ((long long)(quad_moved + moving) * QUAD_REBUILD_FRACTION > body_count) {
+        build_quadtree();
+        return;
+    }
+    
+    for (int i = 0; i < quad_order_count; i++) {
+        if (!quad_body_moves(i)) continue;
+        if (quad_leaf[i] >= 0) quad_unlink(i);
+        if (i < body_count && bodies.active[i]) {
+            if (!quad_contains(0, bodies.x[i], bodies.y[i])) {
+                build_quadtree();
+                return;
+            }
+            quad_insert(i);
+        }
+        quad_moved++;
+    }
+    if (quad_node_count > 2 * quad_built_nodes) {
+        build_quadtree();
+        return;
+    }
+    quad_refits++;
+    refit_quadtree();
+}
+
+// Returns the number of body-body and body-cell terms evaluated
+int quad_accumulate(int i, double theta) {
+    int stack[4 * QUAD_MAX_DEPTH + 8];
+    int top = 0;
+    int interactions = 0;
+    double x = bodies.x[i];
+    double y = bodies.y[i];
+    double ax = 0, ay = 0;
+    double theta_sq = theta * theta;
+    double soft_sq = softening_length * softening_length;
+    
+    stack[top++] = 0;
+    while (top > 0) {
+        const QuadNode *node = &quad_nodes[stack[--top]];
+        if (node->mass == 0) continue;
+        
+        if (node->children < 0) {
+            for (int j = node->first; j >= 0; j = quad_next[j]) {
+                if (j == i) continue;
+                interactions++;
+                double dx = bodies.x[j] - x;
+                double dy = bodies.y[j] - y;
+                double dist_sq = dx * dx + dy * dy + soft_sq;
+                double inv_dist3 = 1.0 / (dist_sq * sqrt(dist_sq));
+                ax += gravity_constant * bodies.mass[j] * dx * inv_dist3;
+                ay += gravity_constant * bodies.mass[j] * dy * inv_dist3;
+            }
+            continue;
+        }
+        
+        double dx = node->mx - x;
+        double dy = node->my - y;
+        double d_sq = dx * dx + dy * dy;
+        double size = 2 * node->half;
+        bool inside = fabs(x - node->cx) <= node->half && fabs(y - node->cy) <= node->half;
+        
+        if (!inside && size * size < theta_sq * d_sq) {
+            interactions++;
+            double dist_sq = d_sq + soft_sq;
+            double inv_dist3 = 1.0 / (dist_sq * sqrt(dist_sq));
+            ax += gravity_constant * node->mass * dx * inv_dist3;
+            ay += gravity_constant * node->mass * dy * inv_dist3;
+        } else {
+            for (int c = node->children; c < node->children + 4; c++) {
+                stack[top++] = c;
+            }
+        }
+    }
+    
+    bodies.ax[i] = ax;
+    bodies.ay[i] = ay;
+    return interactions;
+}
+
+// Padded so that threads counting interactions do not share cache lines
+typedef struct {
+    long long count;
+    char padding[56];
+} PaddedCounter;
+PaddedCounter tree_interactions[MAX_THREADS];
+
+void quad_walk_task(int task, int thread, void *context) {
+    double theta = *(const double *)context;
+    int begin = task * ROW_BLOCK;
+    int end = begin + ROW_BLOCK < quad_order_count ? begin + ROW_BLOCK : quad_order_count;
+    long long interactions = 0;
+    for (int k = begin; k < end; k++) {
+        int i = quad_order[k];
+        if (i >= body_count || !bodies.active[i]) continue;
+        interactions += quad_accumulate(i, theta);
+    }
+    tree_interactions[thread].count += interactions;
+}
+
+long long count_tree_interactions() {
+    long long total = 0;
+    for (int t = 0; t < thread_count; t++) total += tree_interactions[t].count;
+    return total;
+}
+
+void calculate_forces_barnes_hut_with(double theta) {
+    update_quadtree();
+    for (int t = 0; t < thread_count; t++) tree_interactions[t].count = 0;
+    parallel_for((quad_order_count + ROW_BLOCK - 1) / ROW_BLOCK, quad_walk_task, &theta);
+}
+
+void calculate_forces_barnes_hut() {
+    calculate_forces_barnes_hut_with(bh_theta);
+}
+
+// Fast multipole method. Bodies are sorted by Morton key and cut into cells
+// of at most FMM_LEAF_SIZE bodies; a dual-tree walk turns well-separated
+// cell pairs into multipole-to-local translations and the rest into direct
+// sums. The expansions are Cartesian Taylor series of the softened 1/r
+// kernel: that kernel is not analytic in the plane, so the complex series of
+// logarithmic 2D gravity do not apply. Coefficient (kx, ky) of an order-p
+// expansion sits at n (n + 1) / 2 + ky, where n = kx + ky <= p.
+#define FMM_COEFFS(p) (((p) + 1) * ((p) + 2) / 2)
+typedef struct {
+    double cx, cy, radius;
+    int begin, end;
+    int children, child_count;
+    int parent, level;
+} FmmCell;
+// The cells grow one at a time and are kept between passes; everything else
+// is step-arena scratch that lasts one pass
+FmmCell *fmm_cells = NULL;
+int fmm_cell_count = 0, fmm_cell_capacity = 0;
+double *fmm_multipoles = NULL, *fmm_locals = NULL;
+// Bodies in key order, and where each body index landed
+double *fmm_x = NULL, *fmm_y = NULL, *fmm_mass = NULL, *fmm_ax = NULL, *fmm_ay = NULL;
+int *fmm_body = NULL, *fmm_slot = NULL, *fmm_frontier = NULL, *fmm_generations = NULL;
+int fmm_generation_capacity = 0;
+int fmm_body_count = 0, fmm_frontier_count = 0, fmm_generation_count = 0;
+PaddedCounter fmm_interactions[MAX_THREADS];
+double fmm_factorial[2 * FMM_MAX_ORDER + 1];
+
+int fmm_index(int kx, int ky) {
+    int n = kx + ky;
+    return n * (n + 1) / 2 + ky;
+}
+
+// Fills out[idx(k)] = t^k / k! for |k| <= order
+void fmm_monomials(double tx, double ty, int order, double *out) {
+    double px[FMM_MAX_ORDER + 1], py[FMM_MAX_ORDER + 1];
+    px[0] = py[0] = 1;
+    for (int k = 1; k <= order; k++) {
+        px[k] = px[k - 1] * tx / k;
+        py[k] = py[k - 1] * ty / k;
+    }
+    for (int n = 0; n <= order; n++) {
+        for (int ky = 0; ky <= n; ky++) out[fmm_index(n - ky, ky)] = px[n - ky] * py[ky];
+    }
+}
+
+// Derivatives d^n f(R) of f = 1 / sqrt(|R|^2 + softening_length^2) for |n| <= order,
+// from the Taylor coefficient recurrence
+// |n| s a_n = -(2|n| - 1) R . a_(n-1) - (|n| - 1) a_(n-2) with s = |R|^2 + eps^2
+void fmm_derivatives(double rx, double ry, int order, double *out) {
+    double s = rx * rx + ry * ry + softening_length * softening_length;
+    out[0] = 1 / sqrt(s);
+    for (int n = 1; n <= order; n++) {
+        for (int ky = 0; ky <= n; ky++) {
+            int kx = n - ky;
+            double first = 0, second = 0;
+            if (kx >= 1) first += rx * out[fmm_index(kx - 1, ky)];
+            if (ky >= 1) first += ry * out[fmm_index(kx, ky - 1)];
+            if (kx >= 2) second += out[fmm_index(kx - 2, ky)];
+            if (ky >= 2) second += out[fmm_index(kx, ky - 2)];
+            out[fmm_index(kx, ky)] = -((2 * n - 1) * first + (n - 1) * second) / (n * s);
+        }
+    }
+    for (int n = 1; n <= order; n++) {
+        for (int ky = 0; ky <= n; ky++) out[fmm_index(n - ky, ky)] *= fmm_factorial[n - ky] * fmm_factorial[ky];
+    }
+}
+
+int fmm_new_cell(int begin, int end, int parent, int level) {
+    fmm_cells = grow_buffer(fmm_cells, &fmm_cell_capacity, fmm_cell_count + 1, sizeof(FmmCell));
+    FmmCell *cell = &fmm_cells[fmm_cell_count];
+    cell->begin = begin;
+    cell->end = end;
+    cell->children = -1;
+    cell->child_count = 0;
+    cell->parent = parent;
+    cell->level = level;
+    return fmm_cell_count++;
+}
+
+
+// Cells are appended generation by generation, so parents precede children
+// and each generation is one contiguous run for the upward pass
+void build_fmm_tree() {
+    double min_x = INFINITY, min_y = INFINITY;
+    double max_x = -INFINITY, max_y = -INFINITY;
+    for (int i = 0; i < body_count; i++) {
+        if (!bodies.active[i]) continue;
+        min_x = fmin(min_x, bodies.x[i]);
+        min_y = fmin(min_y, bodies.y[i]);
+        max_x = fmax(max_x, bodies.x[i]);
+        max_y = fmax(max_y, bodies.y[i]);
+    }
+    quad_keys = arena_alloc(&step_arena, body_count * sizeof(uint64_t));
+    quad_key_scratch = arena_alloc(&step_arena, body_count * sizeof(uint64_t));
+    double half = fmax(max_x - min_x, max_y - min_y) / 2 * 1.0001 + 1e-9;
+    double scale = 65536 / (2 * half);
+    double origin_x = (min_x + max_x) / 2 - half, origin_y = (min_y + max_y) / 2 - half;
+    int count = 0;
+    for (int i = 0; i < body_count; i++) {
+        if (!bodies.active[i]) continue;
+        quad_keys[count++] = (uint64_t)morton_key(bodies.x[i], bodies.y[i], origin_x, origin_y, scale) << 32 | (uint32_t)i;
+    }
+    morton_sort(quad_keys, quad_key_scratch, count);
+    
+    fmm_x = arena_alloc(&step_arena, count * sizeof(double));
+    fmm_y = arena_alloc(&step_arena, count * sizeof(double));
+    fmm_mass = arena_alloc(&step_arena, count * sizeof(double));
+    fmm_ax = arena_alloc(&step_arena, count * sizeof(double));
+    fmm_ay = arena_alloc(&step_arena, count * sizeof(double));
+    fmm_body = arena_alloc(&step_arena, count * sizeof(int));
+    fmm_slot = arena_alloc(&step_arena, body_count * sizeof(int));
+    for (int k = 0; k < count; k++) {
+        int i = (int)(uint32_t)quad_keys[k];
+        fmm_body[k] = i;
+        fmm_slot[i] = k;
+        fmm_x[k] = bodies.x[i];
+        fmm_y[k] = bodies.y[i];
+        fmm_mass[k] = bodies.mass[i];
+    }
+    fmm_body_count = count;
+    
+    fmm_cell_count = 0;
+    fmm_generation_count = 0;
+    if (count == 0) return;
+    fmm_new_cell(0, count, -1, 0);
+    int generation_begin = 0;
+    while (generation_begin < fmm_cell_count) {
+        int generation_end = fmm_cell_count;
+        fmm_generations = grow_buffer(fmm_generations, &fmm_generation_capacity, fmm_generation_count + 1, sizeof(int));
+        fmm_generations[fmm_generation_count++] = generation_begin;
+        for (int c = generation_begin; c < generation_end; c++) {
+            int begin = fmm_cells[c].begin, end = fmm_cells[c].end, level = fmm_cells[c].level;
+            if (end - begin <= FMM_LEAF_SIZE) continue;
+            // A level where every body falls in one quadrant adds nothing
+            int bounds[5];
+            while (level < 16) {
+                bounds[0] = begin;
+                for (uint32_t digit = 1; digit < 4; digit++) bounds[digit] = morton_digit_bound(quad_keys, begin, end, level, digit);
+                bounds[4] = end;
+                int occupied = 0;
+                for (int d = 0; d < 4; d++) occupied += bounds[d + 1] > bounds[d];
+                if (occupied > 1) break;
+                level++;
+            }
+            // Bodies that share a key to the last bit stay in one leaf
+            if (level == 16) continue;
+            fmm_cells[c].children = fmm_cell_count;
+            for (int d = 0; d < 4; d++) {
+                if (bounds[d + 1] > bounds[d]) {
+                    fmm_new_cell(bounds[d], bounds[d + 1], c, level + 1);
+                    fmm_cells[c].child_count++;
+                }
+            }
+        }
+        generation_begin = generation_end;
+    }
+    fmm_generations = grow_buffer(fmm_generations, &fmm_generation_capacity, fmm_generation_count + 1, sizeof(int));
+    fmm_generations[fmm_generation_count] = fmm_cell_count;
+    
+    // Disjoint subtrees of at most FMM_TASK_BODIES bodies, one per task
+    fmm_frontier = arena_alloc(&step_arena, fmm_cell_count * sizeof(int));
+    fmm_frontier_count = 0;
+    for (int c = 0; c < fmm_cell_count; c++) {
+        const FmmCell *cell = &fmm_cells[c];
+        bool parent_split = cell->parent < 0 || fmm_cells[cell->parent].end - fmm_cells[cell->parent].begin > FMM_TASK_BODIES;
+        if (parent_split && (cell->end - cell->begin <= FMM_TASK_BODIES || cell->child_count == 0)) {
+            fmm_frontier[fmm_frontier_count++] = c;
+        }
+    }
+}
+
+// Centre of mass, reach and multipole of one cell: from its bodies for a
+// leaf, from its children (already done) otherwise
+void fmm_upward_cell(int c, int order) {
+    FmmCell *cell = &fmm_cells[c];
+    int coeffs = FMM_COEFFS(order);
+    double *multipole = &fmm_multipoles[(size_t)c * coeffs];
+    double terms[FMM_COEFFS(FMM_MAX_ORDER)];
+    double mass = 0, mx = 0, my = 0;
+    for (int k = 0; k < coeffs; k++) multipole[k] = 0;
+    
+    if (cell->child_count == 0) {
+        for (int k = cell->begin; k < cell->end; k++) {
+            mass += fmm_mass[k];
+            mx += fmm_mass[k] * fmm_x[k];
+            my += fmm_mass[k] * fmm_y[k];
+        }
+        cell->cx = mass > 0 ? mx / mass : fmm_x[cell->begin];
+        cell->cy = mass > 0 ? my / mass : fmm_y[cell->begin];
+        double reach_sq = 0;
+        for (int k = cell->begin; k < cell->end; k++) {
+            double dx = fmm_x[k] - cell->cx, dy = fmm_y[k] - cell->cy;
+            reach_sq = fmax(reach_sq, dx * dx + dy * dy);
+            fmm_monomials(dx, dy, order, terms);
+            for (int j = 0; j < coeffs; j++) multipole[j] += fmm_mass[k] * terms[j];
+        }
+        cell->radius = sqrt(reach_sq);
+        return;
+    }
+    
+    for (int child = cell->children; child < cell->children + cell->child_count; child++) {
+        double child_mass = fmm_multipoles[(size_t)child * coeffs];
+        mass += child_mass;
+        mx += child_mass * fmm_cells[child].cx;
+        my += child_mass * fmm_cells[child].cy;
+    }
+    cell->cx = mass > 0 ? mx / mass : fmm_cells[cell->children].cx;
+    cell->cy = mass > 0 ? my / mass : fmm_cells[cell->children].cy;
+    cell->radius = 0;
+    for (int child = cell->children; child < cell->children + cell->child_count; child++) {
+        const FmmCell *from = &fmm_cells[child];
+        const double *source = &fmm_multipoles[(size_t)child * coeffs];
+        double dx = from->cx - cell->cx, dy = from->cy - cell->cy;
+        cell->radius = fmax(cell->radius, sqrt(dx * dx + dy * dy) + from->radius);
+        fmm_monomials(dx, dy, order, terms);
+        // M_j += sum over i <= j of M_i (child) d^(j-i) / (j-i)!
+        for (int n = 0; n <= order; n++) {
+            for (int jy = 0; jy <= n; jy++) {
+                int jx = n - jy;
+                double sum = 0;
+                for (int iy = 0; iy <= jy; iy++) {
+                    for (int ix = 0; ix <= jx; ix++) sum += source[fmm_index(ix, iy)] * terms[fmm_index(jx - ix, jy - iy)];
+                }
+                multipole[fmm_index(jx, jy)] += sum;
+            }
+        }
+    }
+}
+
+typedef struct {
+    int begin, end;
+    int order;
+} FmmGeneration;
+
+void fmm_upward_task(int task, int thread, void *context) {
+    const FmmGeneration *generation = context;
+    int begin = generation->begin + task * ROW_BLOCK;
+    int end = begin + ROW_BLOCK < generation->end ? begin + ROW_BLOCK : generation->end;
+    for (int c = begin; c < end; c++) fmm_upward_cell(c, generation->order);
+}
+
+void fmm_p2p(int a, int b, long long *interactions) {
+    const FmmCell *target = &fmm_cells[a], *source = &fmm_cells[b];
+    double soft_sq = softening_length * softening_length;
+    for (int i = target->begin; i < target->end; i++) {
+        double x = fmm_x[i], y = fmm_y[i];
+        double ax = 0, ay = 0;
+        // The softening keeps the self term finite, and dx = dy = 0 makes it
+        // exactly zero, so the loop needs no j != i branch
+        for (int j = source->begin; j < source->end; j++) {
+            double dx = fmm_x[j] - x;
+            double dy = fmm_y[j] - y;
+            double dist_sq = dx * dx + dy * dy + soft_sq;
+            double inv_dist3 = 1.0 / (dist_sq * sqrt(dist_sq));
+            ax += fmm_mass[j] * dx * inv_dist3;
+            ay += fmm_mass[j] * dy * inv_dist3;
+        }
+        fmm_ax[i] += gravity_constant * ax;
+        fmm_ay[i] += gravity_constant * ay;
+    }
+    *interactions += (long long)(target->end - target->begin) * (source->end - source->begin);
+}
+
+// L_k += sum over |j| <= p - |k| of (-1)^|j| D_(k+j)(R) M_j, R = target - source
+void fmm_m2l(int a, int b, int order) {
+    int coeffs = FMM_COEFFS(order);
+    double derivatives[FMM_COEFFS(2 * FMM_MAX_ORDER)];
+    const double *multipole = &fmm_multipoles[(size_t)b * coeffs];
+    double *local = &fmm_locals[(size_t)a * coeffs];
+    fmm_derivatives(fmm_cells[a].cx - fmm_cells[b].cx, fmm_cells[a].cy - fmm_cells[b].cy, order, derivatives);
+    for (int n = 0; n <= order; n++) {
+        for (int ky = 0; ky <= n; ky++) {
+            int kx = n - ky;
+            double sum = 0;
+            for (int m = 0; m <= order - n; m++) {
+                double sign = m % 2 ? -1 : 1;
+                for (int jy = 0; jy <= m; jy++) {
+                    int jx = m - jy;
+                    sum += sign * derivatives[fmm_index(kx + jx, ky + jy)] * multipole[fmm_index(jx, jy)];
+                }
+            }
+            local[fmm_index(kx, ky)] += sum;
+        }
+    }
+}
+
+typedef struct {
+    double theta_sq;
+    int order;
+    long long interactions;
+} FmmWalk;
+
+void fmm_interact(int a, int b, FmmWalk *walk) {
+    const FmmCell *target = &fmm_cells[a], *source = &fmm_cells[b];
+    long long pairs = (long long)(target->end - target->begin) * (source->end - source->begin);
+    int coeffs = FMM_COEFFS(walk->order);
+    double dx = target->cx - source->cx, dy = target->cy - source->cy;
+    double reach = target->radius + source->radius;
+    if (a != b && reach * reach < walk->theta_sq * (dx * dx + dy * dy)) {
+        // A translation costs about coeffs^2 / 2; few enough pairs are cheaper summed
+        if (2 * pairs < coeffs * coeffs) {
+            fmm_p2p(a, b, &walk->interactions);
+        } else {
+            fmm_m2l(a, b, walk->order);
+            walk->interactions++;
+        }
+        return;
+    }
+    
+    bool target_leaf = target->child_count == 0, source_leaf = source->child_count == 0;
+    if (target_leaf && source_leaf) {
+        fmm_p2p(a, b, &walk->interactions);
+    } else if (!source_leaf && (target_leaf || source->radius >= target->radius)) {
+        for (int c = source->children; c < source->children + source->child_count; c++) fmm_interact(a, c, walk);
+    } else {
+        for (int c = target->children; c < target->children + target->child_count; c++) fmm_interact(c, b, walk);
+    }
+}
+
+// Shifts the local expansion down to the children, and evaluates it at the
+// bodies of a leaf
+void fmm_downward(int c, int order) {
+    const FmmCell *cell = &fmm_cells[c];
+    int coeffs = FMM_COEFFS(order);
+    const double *local = &fmm_locals[(size_t)c * coeffs];
+    double terms[FMM_COEFFS(FMM_MAX_ORDER)];
+    
+    if (cell->child_count == 0) {
+        for (int k = cell->begin; k < cell->end; k++) {
+            fmm_monomials(fmm_x[k] - cell->cx, fmm_y[k] - cell->cy, order, terms);
+            double ax = 0, ay = 0;
+            for (int n = 0; n < order; n++) {
+                for (int ky = 0; ky <= n; ky++) {
+                    int kx = n - ky;
+                    ax += local[fmm_index(kx + 1, ky)] * terms[fmm_index(kx, ky)];
+                    ay += local[fmm_index(kx, ky + 1)] * terms[fmm_index(kx, ky)];
+                }
+            }
+            fmm_ax[k] += gravity_constant * ax;
+            fmm_ay[k] += gravity_constant * ay;
+        }
+        return;
+    }
+    
+    for (int child = cell->children; child < cell->children + cell->child_count; child++) {
+        double *target = &fmm_locals[(size_t)child * coeffs];
+        fmm_monomials(fmm_cells[child].cx - cell->cx, fmm_cells[child].cy - cell->cy, order, terms);
+        // L_k' (child) += sum over k >= k' of L_k d^(k-k') / (k-k')!
+        for (int n = 0; n <= order; n++) {
+            for (int ky = 0; ky <= n; ky++) {
+                int kx = n - ky;
+                double sum = 0;
+                for (int m = n; m <= order; m++) {
+                    for (int jy = ky; jy <= m - kx; jy++) {
+                        int jx = m - jy;
+                        sum += local[fmm_index(jx, jy)] * terms[fmm_index(jx - kx, jy - ky)];
+                    }
+                }
+                target[fmm_index(kx, ky)] += sum;
+            }
+        }
+        fmm_downward(child, order);
+    }
+}
+
+void fmm_frontier_task(int task, int thread, void *context) {
+    FmmWalk walk = *(const FmmWalk *)context;
+    walk.interactions = 0;
+    int cell = fmm_frontier[task];
+    fmm_interact(cell, 0, &walk);
+    fmm_downward(cell, walk.order);
+    fmm_interactions[thread].count += walk.interactions;
+}
+
+// Accelerations of every active body, left in key order in fmm_ax / fmm_ay
+void run_fmm(int order, double theta) {
+    if (fmm_factorial[0] == 0) {
+        fmm_factorial[0] = 1;
+        for (int k = 1; k <= 2 * FMM_MAX_ORDER; k++) fmm_factorial[k] = fmm_factorial[k - 1] * k;
+    }
+    build_fmm_tree();
+    for (int t = 0; t < thread_count; t++) fmm_interactions[t].count = 0;
+    if (fmm_cell_count == 0) return;
+    
+    int coeffs = FMM_COEFFS(order);
+    fmm_multipoles = arena_alloc(&step_arena, (size_t)fmm_cell_count * coeffs * sizeof(double));
+    fmm_locals = arena_alloc(&step_arena, (size_t)fmm_cell_count * coeffs * sizeof(double));
+    memset(fmm_locals, 0, (size_t)fmm_cell_count * coeffs * sizeof(double));
+    memset(fmm_ax, 0, (size_t)fmm_body_count * sizeof(double));
+    memset(fmm_ay, 0, (size_t)fmm_body_count * sizeof(double));
+    
+    // Children sit in the next generation, so deepest first is bottom-up
+    for (int g = fmm_generation_count - 1; g >= 0; g--) {
+        FmmGeneration generation = {fmm_generations[g], fmm_generations[g + 1], order};
+        int cells = fmm_generations[g + 1] - fmm_generations[g];
+        parallel_for((cells + ROW_BLOCK - 1) / ROW_BLOCK, fmm_upward_task, &generation);
+    }
+    
+    // The series only converge while the two cells' discs stay apart
+    double clamped = fmin(theta, FMM_MAX_THETA);
+    FmmWalk walk = {clamped * clamped, order, 0};
+    parallel_for(fmm_frontier_count, fmm_frontier_task, &walk);
+}
+
+long long count_fmm_interactions() {
+    long long total = 0;
+    for (int t = 0; t < thread_count; t++) total += fmm_interactions[t].count;
+    return total;
+}
+
+void calculate_forces_fmm_with(int order, double theta) {
+    size_t mark = arena_mark(&step_arena);
+    run_fmm(order, theta);
+    for (int k = 0; k < fmm_body_count; k++) {
+        bodies.ax[fmm_body[k]] = fmm_ax[k];
+        bodies.ay[fmm_body[k]] = fmm_ay[k];
+    }
+    arena_release(&step_arena, mark);
+}
+
+void calculate_forces_fmm() {
+    calculate_forces_fmm_with(fmm_order, bh_theta);
+}
+
+// A full pass, but only the listed bodies take their new accelerations
+void calculate_forces_fmm_subset(const int *list, int count) {
+    size_t mark = arena_mark(&step_arena);
+    run_fmm(fmm_order, bh_theta);
+    for (int k = 0; k < count; k++) {
+        int slot = fmm_slot[list[k]];
+        bodies.ax[list[k]] = fmm_ax[slot];
+        bodies.ay[list[k]] = fmm_ay[slot];
+    }
+    arena_release(&step_arena, mark);
+}
+
+// Double-precision direct sums that --force-error measures against
+double *reference_ax = NULL, *reference_ay = NULL;
+int reference_ax_capacity = 0, reference_ay_capacity = 0;
+
+// Fills the reference accelerations and returns how long that took in ms
+double compute_reference_forces() {
+    reference_ax = grow_buffer(reference_ax, &reference_ax_capacity, body_count, sizeof(double));
+    reference_ay = grow_buffer(reference_ay, &reference_ay_capacity, body_count, sizeof(double));
+    double start = now_seconds();
+    calculate_forces_direct();
+    double direct_ms = (now_seconds() - start) * 1000;
+    for (int i = 0; i < body_count; i++) {
+        reference_ax[i] = bodies.ax[i];
+        reference_ay[i] = bodies.ay[i];
+    }
+    return direct_ms;
+}
+
+// RMS relative error of the current accelerations against the reference
+double force_error(double *max_err) {
+    double sum_sq = 0;
+    int active_count = 0;
+    *max_err = 0;
+    for (int i = 0; i < body_count; i++) {
+        if (!bodies.active[i]) continue;
+        double ex = bodies.ax[i] - reference_ax[i];
+        double ey = bodies.ay[i] - reference_ay[i];
+        double ref = sqrt(reference_ax[i] * reference_ax[i] + reference_ay[i] * reference_ay[i]);
+        double err = ref > 0 ? sqrt(ex * ex + ey * ey) / ref : 0;
+        sum_sq += err * err;
+        *max_err = fmax(*max_err, err);
+        active_count++;
+    }
+    return active_count ? sqrt(sum_sq / active_count) : 0;
+}
+
+// Compares the tree against direct summation for a few opening angles,
+// always including the one in use
+void report_barnes_hut_error() {
+    static const double presets[] = {0.2, 0.35, 0.5, 0.7, 1.0};
+    enum { PRESET_COUNT = sizeof(presets) / sizeof(presets[0]) };
+    double thetas[PRESET_COUNT + 1];
+    int count = 0;
+    bool placed = false;
+    for (int t = 0; t < PRESET_COUNT; t++) {
+        if (!placed && bh_theta <= presets[t]) {
+            if (bh_theta < presets[t]) thetas[count++] = bh_theta;
+            placed = true;
+        }
+        thetas[count++] = presets[t];
+    }
+    if (!placed) thetas[count++] = bh_theta;
+    double direct_ms = compute_reference_forces();
+    
+    log_message(LOG_INFO, TOPIC_GENERAL, "Barnes-Hut error vs direct sum (%d bodies, direct %.3f ms):\n", body_count, direct_ms);
+    for (int t = 0; t < count; t++) {
+        double start = now_seconds();
+        calculate_forces_barnes_hut_with(thetas[t]);
+        double tree_ms = (now_seconds() - start) * 1000;
+        double max_err;
+        double rms = force_error(&max_err);
+        log_message(LOG_INFO, TOPIC_GENERAL, "  theta %.2f%s: rms %.2e, max %.2e, tree %.3f ms\n", thetas[t],
+                                             thetas[t] == bh_theta ? " (active)" : "", rms, max_err, tree_ms);
+    }
+}
+
+// Compares the multipole solver against direct summation for a few orders,
+// always including the one in use
+void report_fmm_error() {
+    static const int presets[] = {2, 4, 6, 8, 10};
+    enum { PRESET_COUNT = sizeof(presets) / sizeof(presets[0]) };
+    int orders[PRESET_COUNT + 1];
+    int count = 0;
+    bool placed = false;
+    for (int k = 0; k < PRESET_COUNT; k++) {
+        if (!placed && fmm_order <= presets[k]) {
+            if (fmm_order < presets[k]) orders[count++] = fmm_order;
+            placed = true;
+        }
+        orders[count++] = presets[k];
+    }
+    if (!placed) orders[count++] = fmm_order;
+    double direct_ms = compute_reference_forces();
+    
+    log_message(LOG_INFO, TOPIC_GENERAL, "FMM error vs direct sum (%d bodies, theta %.2f, direct %.3f ms):\n",
+                                         body_count, fmin(bh_theta, FMM_MAX_THETA), direct_ms);
+    for (int k = 0; k < count; k++) {
+        double start = now_seconds();
+        calculate_forces_fmm_with(orders[k], bh_theta);
+        double fmm_ms = (now_seconds() - start) * 1000;
+        double max_err;
+        double rms = force_error(&max_err);
+        log_message(LOG_INFO, TOPIC_GENERAL, "  order %2d%s: rms %.2e, max %.2e, fmm %.3f ms\n", orders[k],
+                                             orders[k] == fmm_order ? " (active)" : "", rms, max_err, fmm_ms);
+    }
+}
+
+// Measures what the selected kernel and its precision give up
+void report_direct_error() {
+    bool gpu = force_backend == FORCE_GPU;
+    double direct_ms = compute_reference_forces();
+    double start = now_seconds();
+    if (gpu) calculate_forces_gpu();
+    else calculate_forces_rows();
+    double kernel_ms = (now_seconds() - start) * 1000;
+    double max_err;
+    double rms = force_error(&max_err);
+    log_message(LOG_INFO, TOPIC_GENERAL, "Direct-sum error, %s kernel in %s precision vs double (%d bodies): "
+                                         "rms %.2e, max %.2e, kernel %.3f ms, reference %.3f ms\n",
+                                         gpu ? "gpu" : direct_kernel_name, force_precision_name(),
+                                         body_count, rms, max_err, kernel_ms, direct_ms);
+}
+
+void calculate_forces_distributed();
+
+// The configured backend over the bodies this process holds
+void calculate_local_forces() {
+    bool report = report_force_error && step_count % FORCE_ERROR_INTERVAL == 0;
+    contacts_current = false;
+    if (force_backend == FORCE_BARNES_HUT) {
+        if (report) report_barnes_hut_error();
+        calculate_forces_barnes_hut();
+    } else if (force_backend == FORCE_FMM) {
+        if (report) report_fmm_error();
+        calculate_forces_fmm();
+    } else {
+        if (report) report_direct_error();
+        if (force_backend == FORCE_GPU) calculate_forces_gpu();
+        else calculate_forces_with_contacts();
+    }
+}
+
+void calculate_forces() {
+    if (rank_count > 1) calculate_forces_distributed();
+    else calculate_local_forces();
+}
+
+void clamp_velocity(int i) {
+    double speed = sqrt(bodies.vx[i] * bodies.vx[i] + bodies.vy[i] * bodies.vy[i]);
+    if (speed > max_velocity) {
+        double scale = max_velocity / speed;
+        bodies.vx[i] *= scale;
+        bodies.vy[i] *= scale;
+        if (!warning_shown) {
+            log_message(LOG_WARN, TOPIC_VELOCITY, "WARNING: Body %d velocity clamped (was %.2f, now %.2f)\n", i, speed, max_velocity);
+            warning_shown = true;
+        }
+    }
+}
+
+// True if the body jumped to the opposite edge
+bool wrap_position(int i) {
+    double x = bodies.x[i], y = bodies.y[i];
+    if (bodies.x[i] < 0) bodies.x[i] = window_width;
+    if (bodies.x[i] > window_width) bodies.x[i] = 0;
+    if (bodies.y[i] < 0) bodies.y[i] = window_height;
+    if (bodies.y[i] > window_height) bodies.y[i] = 0;
+    return bodies.x[i] != x || bodies.y[i] != y;
+}
+
+void kick_bodies(double dt) {
+    for (int i = 0; i < body_count; i++) {
+        if (!bodies.active[i]) continue;
+        bodies.vx[i] += bodies.ax[i] * dt;
+        bodies.vy[i] += bodies.ay[i] * dt;
+        clamp_velocity(i);
+    }
+}
+
+// Also tracks how far any body may have moved since the contacts were taken
+void drift_bodies(double dt) {
+    double max_speed_sq = 0;
+    for (int i = 0; i < body_count; i++) {
+        if (!bodies.active[i]) continue;
+        bodies.x[i] += bodies.vx[i] * dt;
+        bodies.y[i] += bodies.vy[i] * dt;
+        max_speed_sq = fmax(max_speed_sq, bodies.vx[i] * bodies.vx[i] + bodies.vy[i] * bodies.vy[i]);
+        if (wrap_position(i) && contacts_current && wrapped_count <= CONTACT_WRAP_LIMIT) {
+            wrapped_bodies = grow_buffer(wrapped_bodies, &wrapped_capacity, wrapped_count + 1, sizeof(int));
+            wrapped_bodies[wrapped_count++] = i;
+        }
+    }
+    contact_drift += sqrt(max_speed_sq) * fabs(dt);
+    forces_current = false;
+}
+
+// Semi-implicit Euler: kick with the accelerations just computed, then drift
+void update_bodies() {
+    kick_bodies(time_step);
+    drift_bodies(time_step);
+}
+
+// Integrators advance the state by one time_step, using calculate_forces()
+// (through evaluate_forces) as the acceleration callback
+void evaluate_forces() {
+    double start = now_seconds();
+    calculate_forces();
+    profile_end(ZONE_FORCES, start);
+    forces_seconds += now_seconds() - start;
+    forces_current = true;
+}
+
+void integrate_euler() {
+    evaluate_forces();
+    update_bodies();
+}
+
+// Kick-drift-kick leapfrog. The closing kick's accelerations are those of
+// the next step's opening kick, so it costs one force evaluation per step
+// as long as no body was added, removed or merged in between
+void leapfrog_substep(double h) {
+    if (!forces_current) evaluate_forces();
+    kick_bodies(h / 2);
+    drift_bodies(h);
+    evaluate_forces();
+    kick_bodies(h / 2);
+}
+
+void integrate_leapfrog() {
+    leapfrog_substep(time_step);
+}
+
+// Velocity Verlet: the same trajectory as KDK leapfrog, but the position
+// update and the first half kick are fused into a single pass
+void integrate_verlet() {
+    if (!forces_current) evaluate_forces();
+    double dt = time_step;
+    for (int i = 0; i < body_count; i++) {
+        if (!bodies.active[i]) continue;
+        bodies.x[i] += (bodies.vx[i] + 0.5 * bodies.ax[i] * dt) * dt;
+        bodies.y[i] += (bodies.vy[i] + 0.5 * bodies.ay[i] * dt) * dt;
+        bodies.vx[i] += 0.5 * bodies.ax[i] * dt;
+        bodies.vy[i] += 0.5 * bodies.ay[i] * dt;
+        clamp_velocity(i);
+        wrap_position(i);
+    }
+    evaluate_forces();
+    kick_bodies(dt / 2);
+}
+
+// Fourth-order Yoshida: three leapfrog substeps with the triple-jump weights,
+// three force evaluations per step
+void integrate_yoshida4() {
+    double cbrt2 = cbrt(2.0);
+    double w1 = 1 / (2 - cbrt2);
+    double w0 = -cbrt2 / (2 - cbrt2);
+    leapfrog_substep(w1 * time_step);
+    leapfrog_substep(w0 * time_step);
+    leapfrog_substep(w1 * time_step);
+}
+
+// Block time steps. A body on level L steps by time_step / 2^L, the level
+// being picked from how fast it is accelerating and moving relative to the
+// softening length. Time inside one time_step is counted in ticks of the
+// finest level. Everyone drifts to the next tick at which some level closes
+// its step, and only those bodies get new forces and their kicks (KDK), so
+// a few tight binaries do not drag the quiescent majority down to their step.
+int *block_active = NULL;
+int block_level_counts[BLOCK_MAX_LEVEL + 1];
+long long block_force_evaluations = 0;
+long long block_steps = 0;
+
+typedef struct {
+    const int *list;
+    int count;
+    bool tree;
+} SubsetForces;
+
+void subset_forces_task(int task, int thread, void *context) {
+    const SubsetForces *subset = context;
+    int begin = task * ROW_BLOCK;
+    int end = begin + ROW_BLOCK < subset->count ? begin + ROW_BLOCK : subset->count;
+    for (int k = begin; k < end; k++) {
+        int i = subset->list[k];
+        if (subset->tree) quad_accumulate(i, bh_theta);
+        else if (direct_kernel) direct_kernel(i, i + 1);
+        else direct_rows_scalar(i, i + 1);
+    }
+}
+
+// Accelerations of the listed bodies only, against all bodies. Rebuilding
+// the tree is O(N log N), so a small active set is summed directly instead
+void calculate_forces_subset(const int *list, int count) {
+    double start = now_seconds();
+    if (force_backend == FORCE_FMM && count * BLOCK_TREE_FRACTION >= body_count) {
+        calculate_forces_fmm_subset(list, count);
+        profile_end(ZONE_FORCES, start);
+        forces_seconds += now_seconds() - start;
+        return;
+    }
+    if (force_backend == FORCE_GPU && count * BLOCK_TREE_FRACTION >= body_count) {
+        calculate_forces_gpu_subset(list, count);
+        profile_end(ZONE_FORCES, start);
+        forces_seconds += now_seconds() - start;
+        return;
+    }
+    SubsetForces subset = {list, count, force_backend == FORCE_BARNES_HUT && count * BLOCK_TREE_FRACTION >= body_count};
+    if (subset.tree) update_quadtree();
+    else prepare_force_inputs();
+    parallel_for((count + ROW_BLOCK - 1) / ROW_BLOCK, subset_forces_task, &subset);
+    profile_end(ZONE_FORCES, start);
+    forces_seconds += now_seconds() - start;
+}
+
+int block_level_for(int i) {
+    double a = sqrt(bodies.ax[i] * bodies.ax[i] + bodies.ay[i] * bodies.ay[i]);
+    double v = sqrt(bodies.vx[i] * bodies.vx[i] + bodies.vy[i] * bodies.vy[i]);
+    double dt = INFINITY;
+    if (a > 0) dt = block_eta * sqrt(softening_length / a);
+    if (v > 0) dt = fmin(dt, block_eta * softening_length / v);
+    int level = 0;
+    while (level < BLOCK_MAX_LEVEL && time_step / (1 << level) > dt) level++;
+    return level;
+}
+
+void block_half_kick(int i, double tick_dt) {
+    double half = 0.5 * ((1 << BLOCK_MAX_LEVEL) >> bodies.level[i]) * tick_dt;
+    bodies.vx[i] += bodies.ax[i] * half;
+    bodies.vy[i] += bodies.ay[i] * half;
+    clamp_velocity(i);
+}
+
+void integrate_block() {
+    const int ticks = 1 << BLOCK_MAX_LEVEL;
+    const double tick_dt = time_step / ticks;
+    if (!forces_current) evaluate_forces();
+    size_t mark = arena_mark(&step_arena);
+    block_active = arena_alloc(&step_arena, body_count * sizeof(int));
+    
+    int live = 0;
+    memset(block_level_counts, 0, sizeof(block_level_counts));
+    for (int i = 0; i < body_count; i++) {
+        if (!bodies.active[i]) continue;
+        bodies.level[i] = block_level_for(i);
+        block_level_counts[bodies.level[i]]++;
+        block_half_kick(i, tick_dt);
+        live++;
+    }
+    
+    int tick = 0;
+    while (tick < ticks) {
+        int next = ticks;
+        for (int level = 0; level <= BLOCK_MAX_LEVEL; level++) {
+            if (!block_level_counts[level]) continue;
+            int stride = ticks >> level;
+            int end = (tick / stride + 1) * stride;
+            if (end < next) next = end;
+        }
+        drift_bodies((next - tick) * tick_dt);
+        tick = next;
+        
+        int count = 0;
+        for (int i = 0; i < body_count; i++) {
+            if (bodies.active[i] && tick % (ticks >> bodies.level[i]) == 0) block_active[count++] = i;
+        }
+        if (count == live) evaluate_forces();
+        else calculate_forces_subset(block_active, count);
+        block_force_evaluations += count;
+        
+        for (int k = 0; k < count; k++) {
+            int i = block_active[k];
+            block_half_kick(i, tick_dt);
+            if (tick == ticks) continue;
+            
+            // Refine freely; coarsen only onto a level whose step starts now
+            int level = bodies.level[i];
+            int wanted = block_level_for(i);
+            if (wanted > level) {
+                level = wanted;
+            } else {
+                while (level > wanted && tick % (ticks >> (level - 1)) == 0) level--;
+            }
+            block_level_counts[bodies.level[i]]--;
+            block_level_counts[level]++;
+            bodies.level[i] = level;
+            block_half_kick(i, tick_dt);
+        }
+    }
+    arena_release(&step_arena, mark);
+    block_steps++;
+    forces_current = true;
+}
+
+void report_block_levels() {
+    if (block_steps == 0) return;
+    char text[LOG_MESSAGE_MAX];
+    int length = 0;
+    for (int level = 0; level <= BLOCK_MAX_LEVEL; level++) {
+        if (block_level_counts[level] && length < (int)sizeof(text)) {
+            length += snprintf(text + length, sizeof(text) - length, " L%d:%d", level, block_level_counts[level]);
+        }
+    }
+    log_message(LOG_INFO, TOPIC_GENERAL, "Block levels at the last step:%s; %.1f body force evaluations per step\n",
+                                         text, (double)block_force_evaluations / block_steps);
+}
+
+bool select_integrator(const char *request) {
+    static const struct {
+        const char *name;
+        Integrator step;
+    } integrators[] = {
+        {"euler", integrate_euler},
+        {"leapfrog", integrate_leapfrog},
+        {"verlet", integrate_verlet},
+        {"yoshida4", integrate_yoshida4},
+        {"block", integrate_block},
+    };
+    for (int k = 0; k < (int)(sizeof(integrators) / sizeof(integrators[0])); k++) {
+        if (strcmp(request, integrators[k].name) == 0) {
+            integrator = integrators[k].step;
+            integrator_name = integrators[k].name;
+            return true;
+        }
+    }
+    printf("Unknown integrator '%s'\n", request);
+    return false;
+}
+
+double kinetic_energy() {
+    double kinetic = 0;
+    for (int i = 0; i < body_count; i++) {
+        if (!bodies.active[i]) continue;
+        kinetic += 0.5 * bodies.mass[i] * (bodies.vx[i] * bodies.vx[i] + bodies.vy[i] * bodies.vy[i]);
+    }
+    return kinetic;
+}
+
+// Softened potential energy, by direct summation
+double potential_energy() {
+    double potential = 0;
+    for (int i = 0; i < body_count; i++) {
+        if (!bodies.active[i]) continue;
+        for (int j = i + 1; j < body_count; j++) {
+            if (!bodies.active[j]) continue;
+            double dx = bodies.x[j] - bodies.x[i];
+            double dy = bodies.y[j] - bodies.y[i];
+            potential -= gravity_constant * bodies.mass[i] * bodies.mass[j] / sqrt(dx * dx + dy * dy + softening_length * softening_length);
+        }
+    }
+    return potential;
+}
+
+double total_energy() {
+    return kinetic_energy() + potential_energy();
+}
+
+bool check_stability() {
+    int active_count = 0;
+    for (int i = 0; i < body_count; i++) {
+        if (!bodies.active[i]) continue;
+        active_count++;
+        
+        if (isnan(bodies.x[i]) || isnan(bodies.y[i]) || 
+            isnan(bodies.vx[i]) || isnan(bodies.vy[i]) ||
+            isinf(bodies.x[i]) || isinf(bodies.y[i]) ||
+            isinf(bodies.vx[i]) || isinf(bodies.vy[i])) {
+            log_message(LOG_ERROR, TOPIC_GENERAL, "ERROR: Body %d has invalid values! Pausing simulation.\n", i);
+            log_message(LOG_ERROR, TOPIC_GENERAL, "  Position: (%.2f, %.2f), Velocity: (%.2f, %.2f)\n", 
+                                                  bodies.x[i], bodies.y[i], bodies.vx[i], bodies.vy[i]);
+            return false;
+        }
+        
+        if (bodies.x[i] < -1000 || bodies.x[i] > window_width + 1000 ||
+            bodies.y[i] < -1000 || bodies.y[i] > window_height + 1000) {
+            log_message(LOG_WARN, TOPIC_FAR_BODY, "WARNING: Body %d is far from visible area at (%.1f, %.1f)\n", 
+                                                  i, bodies.x[i], bodies.y[i]);
+        }
+    }
+    
+    return true;
+}
+
+// Uniform-grid broad phase: bodies are bucketed by cell into a hash table that
+// is rebuilt every step; only bodies in neighbouring cells are tested. It is
+// the fallback for steps whose forces did not collect contacts.
+int *grid_cell_x = NULL, *grid_cell_y = NULL;
+int *grid_bucket_start = NULL, *grid_bucket_bodies = NULL;
+int grid_bucket_mask = 0;
+double grid_cell_size = 0;
+
+unsigned int grid_hash(int cx, int cy) {
+    return ((unsigned int)cx * 73856093u ^ (unsigned int)cy * 19349663u) & grid_bucket_mask;
+}
+
+int grid_coordinate(double v) {
+    // fmin/fmax also map NaN to a finite cell; check_stability reports it later
+    return (int)floor(fmax(-1e9, fmin(1e9, v / grid_cell_size)));
+}
+
+void build_collision_grid() {
+    double max_radius = 0;
+    for (int i = 0; i < body_count; i++) {
+        if (bodies.active[i]) max_radius = fmax(max_radius, bodies.radius[i]);
+    }
+    // Touching bodies are at most two radii apart, so one ring of cells suffices
+    grid_cell_size = 2 * fmin(fmax(max_radius, 1.0), MAX_RADIUS);
+    
+    int buckets = 64;
+    while (buckets < 2 * body_count) buckets *= 2;
+    grid_bucket_mask = buckets - 1;
+    
+    grid_cell_x = arena_alloc(&step_arena, body_count * sizeof(int));
+    grid_cell_y = arena_alloc(&step_arena, body_count * sizeof(int));
+    grid_bucket_start = arena_alloc(&step_arena, (buckets + 1) * sizeof(int));
+    grid_bucket_bodies = arena_alloc(&step_arena, body_count * sizeof(int));
+    memset(grid_bucket_start, 0, (buckets + 1) * sizeof(int));
+    
+    for (int i = 0; i < body_count; i++) {
+        if (!bodies.active[i]) continue;
+        grid_cell_x[i] = grid_coordinate(bodies.x[i]);
+        grid_cell_y[i] = grid_coordinate(bodies.y[i]);
+        grid_bucket_start[grid_hash(grid_cell_x[i], grid_cell_y[i]) + 1]++;
+    }
+    for (int h = 0; h < buckets; h++) {
+        grid_bucket_start[h + 1] += grid_bucket_start[h];
+    }
+    
+    // Counting sort; grid_bucket_start[h] ends up pointing at bucket h + 1
+    for (int i = 0; i < body_count; i++) {
+        if (!bodies.active[i]) continue;
+        unsigned int h = grid_hash(grid_cell_x[i], grid_cell_y[i]);
+        grid_bucket_bodies[grid_bucket_start[h]++] = i;
+    }
+    for (int h = buckets; h > 0; h--) {
+        grid_bucket_start[h] = grid_bucket_start[h - 1];
+    }
+    grid_bucket_start[0] = 0;
+}
+
+void collision_candidates_task(int task, int thread, void *context) {
+    PairList *list = &thread_pairs[thread];
+    int begin = task * ROW_BLOCK;
+    int end = begin + ROW_BLOCK < body_count ? begin + ROW_BLOCK : body_count;
+    
+    for (int i = begin; i < end; i++) {
+        if (!bodies.active[i]) continue;
+        
+        for (int ny = grid_cell_y[i] - 1; ny <= grid_cell_y[i] + 1; ny++) {
+            for (int nx = grid_cell_x[i] - 1; nx <= grid_cell_x[i] + 1; nx++) {
+                unsigned int h = grid_hash(nx, ny);
+                for (int k = grid_bucket_start[h]; k < grid_bucket_start[h + 1]; k++) {
+                    int j = grid_bucket_bodies[k];
+                    // Each pair is reported once, from its lower index
+                    if (j <= i || grid_cell_x[j] != nx || grid_cell_y[j] != ny) continue;
+                    if (bodies_touch(i, j, 0)) push_pair(list, i, j);
+                }
+            }
+        }
+    }
+}
+
+// Uses the candidates from the last direct sum while the bodies have drifted
+// less than contact_margin / 2 since; otherwise runs the grid search
+void gather_collision_pairs() {
+    bool fused = contacts_current && 2 * contact_drift <= contact_margin && wrapped_count <= CONTACT_WRAP_LIMIT;
+    if (!fused) {
+        size_t mark = arena_mark(&step_arena);
+        build_collision_grid();
+        for (int t = 0; t < thread_count; t++) {
+            thread_pairs[t].count = 0;
+        }
+        parallel_for((body_count + ROW_BLOCK - 1) / ROW_BLOCK, collision_candidates_task, NULL);
+        arena_release(&step_arena, mark);
+    }
+    contacts_current = false;
+    
+    collision_pairs.count = 0;
+    for (int t = 0; t < thread_count; t++) {
+        for (int k = 0; k < thread_pairs[t].count; k++) {
+            int a = thread_pairs[t].pairs[k].a, b = thread_pairs[t].pairs[k].b;
+            if (!fused || bodies_touch(a, b, 0)) push_pair(&collision_pairs, a, b);
+        }
+    }
+    if (fused) {
+        // A body that wrapped around the edge may now touch bodies that were
+        // nowhere near it when the candidates were taken
+        for (int k = 0; k < wrapped_count; k++) {
+            int i = wrapped_bodies[k];
+            for (int j = 0; j < body_count; j++) {
+                if (j == i || !bodies.active[j]) continue;
+                int a = i < j ? i : j, b = i < j ? j : i;
+                if (bodies_touch(a, b, 0)) push_pair(&collision_pairs, a, b);
+            }
+        }
+    }
+}
+
+// Cluster merging. Touching pairs are joined into connected components with
+// a lock-free union-find, so a chain a-b-c is one merger however its pairs
+// are ordered. Each cluster then collapses into its most massive member (the
+// lowest index on ties), conserving momentum, in one parallel pass.
+typedef struct {
+    int survivor, absorbed;
+    double mass;
+} ClusterMerge;
+atomic_int *merge_parent = NULL;
+uint64_t *merge_members = NULL;
+int *cluster_start = NULL;
+ClusterMerge *cluster_merges = NULL;
+int cluster_count = 0;
+
+// Path halving; a failed exchange only means another thread shortened it first
+int merge_find(int i) {
+    for (;;) {
+        int parent = atomic_load_explicit(&merge_parent[i], memory_order_relaxed);
+        if (parent == i) return i;
+        int grandparent = atomic_load_explicit(&merge_parent[parent], memory_order_relaxed);
+        if (grandparent != parent) {
+            atomic_compare_exchange_weak_explicit(&merge_parent[i], &parent, grandparent,
+                                                  memory_order_relaxed, memory_order_relaxed);
+        }
+        i = grandparent;
+    }
+}
+
+// The higher root is always linked under the lower one, so parents only
+// point downwards, no cycle can form and each root is its cluster's lowest index
+void merge_union(int a, int b) {
+    for (;;) {
+        a = merge_find(a);
+        b = merge_find(b);
+        if (a == b) return;
+        if (a > b) {
+            int t = a;
+            a = b;
+            b = t;
+        }
+        int expected = b;
+        if (atomic_compare_exchange_strong_explicit(&merge_parent[b], &expected, a,
+                                                    memory_order_relaxed, memory_order_relaxed)) return;
+    }
+}
+
+void merge_union_task(int task, int thread, void *context) {
+    int begin = task * MERGE_BLOCK;
+    int end = begin + MERGE_BLOCK < collision_pairs.count ? begin + MERGE_BLOCK : collision_pairs.count;
+    for (int k = begin; k < end; k++) {
+        merge_union(collision_pairs.pairs[k].a, collision_pairs.pairs[k].b);
+    }
+}
+
+// Tags every pair endpoint with its root in the high word, so sorting groups
+// each cluster's members together in index order
+void merge_root_task(int task, int thread, void *context) {
+    int begin = task * MERGE_BLOCK;
+    int end = begin + MERGE_BLOCK < 2 * collision_pairs.count ? begin + MERGE_BLOCK : 2 * collision_pairs.count;
+    for (int k = begin; k < end; k++) {
+        const CollisionPair *pair = &collision_pairs.pairs[k / 2];
+        int i = k % 2 ? pair->b : pair->a;
+        merge_members[k] = (uint64_t)merge_find(i) << 32 | (uint32_t)i;
+    }
+}
+
+int compare_members(const void *lhs, const void *rhs) {
+    uint64_t p = *(const uint64_t *)lhs, q = *(const uint64_t *)rhs;
+    return (p > q) - (p < q);
+}
+
+// Sums are taken in index order, so the result does not depend on threads.
+// The colour is the mass-weighted mean, as repeated pairwise blending gives.
+void merge_cluster_task(int task, int thread, void *context) {
+    int begin = cluster_start[task], end = cluster_start[task + 1];
+    int survivor = (int)(uint32_t)merge_members[begin];
+    double mass = 0, px = 0, py = 0, r = 0, g = 0, b = 0;
+    for (int k = begin; k < end; k++) {
+        int i = (int)(uint32_t)merge_members[k];
+        double m = bodies.mass[i];
+        if (m > bodies.mass[survivor]) survivor = i;
+        mass += m;
+        px += m * bodies.vx[i];
+        py += m * bodies.vy[i];
+        r += m * bodies.r[i];
+        g += m * bodies.g[i];
+        b += m * bodies.b[i];
+    }
+    
+    double total_mass = fmin(mass, max_mass);
+    bodies.vx[survivor] = px / total_mass;
+    bodies.vy[survivor] = py / total_mass;
+    bodies.mass[survivor] = total_mass;
+    bodies.radius[survivor] = fmin(BODY_RADIUS + total_mass / 200, MAX_RADIUS);
+    bodies.r[survivor] = (Uint8)(r / mass);
+    bodies.g[survivor] = (Uint8)(g / mass);
+    bodies.b[survivor] = (Uint8)(b / mass);
+    
+    // remove_body() without its shared counters, which the caller updates
+    for (int k = begin; k < end; k++) {
+        int i = (int)(uint32_t)merge_members[k];
+        if (i == survivor) continue;
+        bodies.active[i] = false;
+        bodies.mass[i] = 0;
+    }
+    cluster_merges[task] = (ClusterMerge){survivor, end - begin - 1, mass};
+}
+
+// Merges every cluster of collision_pairs; returns the number of bodies absorbed
+int merge_clusters() {
+    int pairs = collision_pairs.count;
+    cluster_count = 0;
+    if (pairs == 0) return 0;
+    
+    size_t mark = arena_mark(&step_arena);
+    merge_parent = arena_alloc(&step_arena, body_count * sizeof(atomic_int));
+    for (int k = 0; k < pairs; k++) {
+        atomic_init(&merge_parent[collision_pairs.pairs[k].a], collision_pairs.pairs[k].a);
+        atomic_init(&merge_parent[collision_pairs.pairs[k].b], collision_pairs.pairs[k].b);
+    }
+    int tasks = (pairs + MERGE_BLOCK - 1) / MERGE_BLOCK;
+    parallel_for(tasks, merge_union_task, NULL);
+    
+    merge_members = arena_alloc(&step_arena, 2 * (size_t)pairs * sizeof(uint64_t));
+    parallel_for((2 * pairs + MERGE_BLOCK - 1) / MERGE_BLOCK, merge_root_task, NULL);
+    qsort(merge_members, 2 * pairs, sizeof(uint64_t), compare_members);
+    
+    // Drop repeated endpoints, then cut the runs of equal roots into clusters
+    cluster_start = arena_alloc(&step_arena, ((size_t)pairs + 1) * sizeof(int));
+    int members = 0;
+    for (int k = 0; k < 2 * pairs; k++) {
+        if (members > 0 && merge_members[k] == merge_members[members - 1]) continue;
+        if (members == 0 || merge_members[k] >> 32 != merge_members[members - 1] >> 32) {
+            cluster_start[cluster_count++] = members;
+        }
+        merge_members[members++] = merge_members[k];
+    }
+    cluster_start[cluster_count] = members;
+    
+    cluster_merges = arena_alloc(&step_arena, cluster_count * sizeof(ClusterMerge));
+    parallel_for(cluster_count, merge_cluster_task, NULL);
+    
+    int absorbed = 0;
+    for (int c = 0; c < cluster_count; c++) {
+        const ClusterMerge *merge = &cluster_merges[c];
+        absorbed += merge->absorbed;
+        if (merge->mass > max_mass) {
+            log_message(LOG_WARN, TOPIC_MASS_LIMIT, "WARNING: Mass limit reached! Body %d mass clamped at %.1f (would be %.1f)\n",
+                                                    merge->survivor, max_mass, merge->mass);
+            simulation_paused = true;
+        }
+        if (merge->absorbed == 1) {
+            int other = (int)(uint32_t)merge_members[cluster_start[c]];
+            if (other == merge->survivor) other = (int)(uint32_t)merge_members[cluster_start[c] + 1];
+            log_message(LOG_INFO, TOPIC_COLLISION, "Collision! Body %d absorbed body %d (new mass: %.1f)\n",
+                                                   merge->survivor, other, bodies.mass[merge->survivor]);
+        } else {
+            log_message(LOG_INFO, TOPIC_COLLISION, "Collision! Body %d absorbed %d bodies (new mass: %.1f)\n",
+                                                   merge->survivor, merge->absorbed, bodies.mass[merge->survivor]);
+        }
+    }
+    arena_release(&step_arena, mark);
+    dead_body_count += absorbed;
+    forces_current = false;
+    return absorbed;
+}
+
+// Resolves every cluster of bodies touching at the start of the pass; any
+// overlap the merged bodies create is picked up next step
+void handle_collisions() {
+    gather_collision_pairs();
+    merge_clusters();
+}
+
+// Add a new body at mouse position with velocity
+void add_body_with_velocity(int x, int y, int mass, double vx, double vy) {
+    Uint8 r = (Uint8)(256 * random_uniform(&interactive_random));
+    Uint8 g = (Uint8)(256 * random_uniform(&interactive_random));
+    Uint8 b = (Uint8)(256 * random_uniform(&interactive_random));
+    int i = append_body(x, y, vx, vy, mass, r, g, b);
+    if (i >= 0) bodies.radius[i] = BODY_RADIUS + (mass / 200);
+}
+
+void add_body(int x, int y, int mass) {
+    add_body_with_velocity(x, y, mass, 0, 0);
+}
+
+int delete_body_at(int x, int y) {
+    for (int i = 0; i < body_count; i++) {
+        if (!bodies.active[i]) continue;
+        
+        double dx = x - bodies.x[i];
+        double dy = y - bodies.y[i];
+        double dist = sqrt(dx * dx + dy * dy);
+        
+        if (dist <= bodies.radius[i]) {
+            log_message(LOG_INFO, TOPIC_GENERAL, "Deleted body %d (mass: %.1f) at (%.0f, %.0f)\n", 
+                                                 i, bodies.mass[i], bodies.x[i], bodies.y[i]);
+            remove_body(i);
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Trajectory output. The step loop copies the live bodies into whichever of
+// two frames is free and returns; an I/O thread quantizes, compresses and
+// writes the other one. If both frames are busy the new one is dropped
+// rather than making the solver wait for the disk.
+//
+// File layout: a TrajectoryFileHeader, then per frame a TrajectoryFrameHeader
+// and its payload. Uncompressed, the payload is id[count] (uint32) followed
+// by the x, y, vx and vy arrays in the frame's format: f64, f32, or fixed
+// (int32 positions and int16 velocities; value = stored * scale). Before
+// compression each array is byte-shuffled (all first bytes, then all second
+// bytes, ...), which groups the slowly varying high bytes together.
+typedef enum { TRAJECTORY_F64, TRAJECTORY_F32, TRAJECTORY_FIXED } TrajectoryFormat;
+typedef enum { CODEC_NONE, CODEC_LZ4, CODEC_ZSTD } TrajectoryCodec;
+const char *trajectory_format_names[] = {"f64", "f32", "fixed"};
+const char *trajectory_codec_names[] = {"none", "lz4", "zstd"};
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t format;
+    uint32_t codec;
+    double time_step;
+    int32_t interval;
+    int32_t reserved;
+} TrajectoryFileHeader;
+typedef struct {
+    char magic[4];
+    uint32_t count;
+    int64_t step;
+    double time;
+    double position_scale, velocity_scale;
+    uint64_t raw_size, stored_size;
+} TrajectoryFrameHeader;
+
+typedef enum { FRAME_FREE, FRAME_READY, FRAME_WRITING } FrameState;
+typedef struct {
+    double *x, *y, *vx, *vy;
+    uint32_t *id;
+    int count, capacity;
+    int step;
+    double area;
+    FrameState state;
+} TrajectoryFrame;
+TrajectoryFrame trajectory_frames[2];
+TrajectoryFormat trajectory_format = TRAJECTORY_F64;
+TrajectoryCodec trajectory_codec = CODEC_NONE;
+FILE *trajectory_file = NULL;
+pthread_t trajectory_thread;
+pthread_mutex_t trajectory_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t trajectory_ready = PTHREAD_COND_INITIALIZER;
+bool trajectory_running = false;
+int trajectory_written = 0, trajectory_dropped = 0;
+uint64_t trajectory_raw_bytes = 0, trajectory_stored_bytes = 0;
+
+bool select_trajectory_options() {
+    int format = 0, codec = 0;
+    while (format < 3 && strcmp(trajectory_format_name, trajectory_format_names[format]) != 0) format++;
+    while (codec < 3 && strcmp(trajectory_codec_name, trajectory_codec_names[codec]) != 0) codec++;
+    if (format == 3) {
+        printf("Unknown trajectory format '%s' (f64, f32 or fixed)\n", trajectory_format_name);
+        return false;
+    }
+    if (codec == 3) {
+        printf("Unknown trajectory compression '%s' (none, lz4 or zstd)\n", trajectory_codec_name);
+        return false;
+    }
+#ifndef USE_LZ4
+    if (codec == CODEC_LZ4) {
+        printf("This build has no LZ4 support (build with -DUSE_LZ4 -llz4)\n");
+        return false;
+    }
+#endif
+#ifndef USE_ZSTD
+    if (codec == CODEC_ZSTD) {
+        printf("This build has no zstd support (build with -DUSE_ZSTD -lzstd)\n");
+        return false;
+    }
+#endif
+    trajectory_format = format;
+    trajectory_codec = codec;
+    return true;
+}
+
+// Called by the step loop: copies the live bodies and hands the frame over
+void trajectory_capture() {
+    pthread_mutex_lock(&trajectory_lock);
+    TrajectoryFrame *frame = NULL;
+    for (int k = 0; k < 2; k++) {
+        if (trajectory_frames[k].state == FRAME_FREE) frame = &trajectory_frames[k];
+    }
+    if (!frame) trajectory_dropped++;
+    pthread_mutex_unlock(&trajectory_lock);
+    if (!frame) return;
+    
+    if (frame->capacity < body_count) {
+        int capacity = frame->capacity;
+        frame->x = grow_buffer(frame->x, &capacity, body_count, sizeof(double));
+        capacity = frame->capacity;
+        frame->y = grow_buffer(frame->y, &capacity, body_count, sizeof(double));
+        capacity = frame->capacity;
+        frame->vx = grow_buffer(frame->vx, &capacity, body_count, sizeof(double));
+        capacity = frame->capacity;
+        frame->vy = grow_buffer(frame->vy, &capacity, body_count, sizeof(double));
+        capacity = frame->capacity;
+        frame->id = grow_buffer(frame->id, &capacity, body_count, sizeof(uint32_t));
+        frame->capacity = capacity;
+    }
+    int n = 0;
+    for (int i = 0; i < body_count; i++) {
+        if (!bodies.active[i]) continue;
+        frame->x[n] = bodies.x[i];
+        frame->y[n] = bodies.y[i];
+        frame->vx[n] = bodies.vx[i];
+        frame->vy[n] = bodies.vy[i];
+        frame->id[n] = bodies.id[i];
+        n++;
+    }
+    frame->count = n;
+    frame->step = step_count;
+    frame->area = fmax(window_width, window_height);
+    
+    pthread_mutex_lock(&trajectory_lock);
+    frame->state = FRAME_READY;
+    pthread_cond_signal(&trajectory_ready);
+    pthread_mutex_unlock(&trajectory_lock);
+}
+
+void store_f32(const double *values, int count, float *out) {
+    for (int k = 0; k < count; k++) out[k] = (float)values[k];
+}
+
+void store_fixed32(const double *values, int count, double scale, int32_t *out) {
+    for (int k = 0; k < count; k++) out[k] = (int32_t)lrint(fmax(-2147483647.0, fmin(2147483647.0, values[k] / scale)));
+}
+
+void store_fixed16(const double *values, int count, double scale, int16_t *out) {
+    for (int k = 0; k < count; k++) out[k] = (int16_t)lrint(fmax(-32767.0, fmin(32767.0, values[k] / scale)));
+}
+
+char *trajectory_raw = NULL, *trajectory_packed = NULL, *trajectory_shuffled = NULL;
+int trajectory_raw_capacity = 0, trajectory_packed_capacity = 0, trajectory_shuffled_capacity = 0;
+#ifdef USE_ZSTD
+// One context for the whole run; ZSTD_compress() would set one up per frame
+ZSTD_CCtx *trajectory_zstd = NULL;
+#endif
+
+void shuffle_bytes(const char *in, int count, int element_size, char *out) {
+    for (int k = 0; k < count; k++) {
+        for (int b = 0; b < element_size; b++) out[(size_t)b * count + k] = in[(size_t)k * element_size + b];
+    }
+}
+
+void write_trajectory_frame(TrajectoryFrame *frame) {
+    int count = frame->count;
+    size_t position_size = trajectory_format == TRAJECTORY_F64 ? 8 : 4;
+    size_t velocity_size = trajectory_format == TRAJECTORY_F64 ? 8 : trajectory_format == TRAJECTORY_F32 ? 4 : 2;
+    size_t raw_size = (size_t)count * (sizeof(uint32_t) + 2 * position_size + 2 * velocity_size);
+    char *raw = trajectory_raw = grow_buffer(trajectory_raw, &trajectory_raw_capacity, (int)raw_size, 1);
+    
+    TrajectoryFrameHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "FRAM", 4);
+    header.count = count;
+    header.step = frame->step;
+    header.time = frame->step * time_step;
+    header.position_scale = trajectory_format == TRAJECTORY_FIXED ? frame->area / (1 << 30) : 1;
+    header.velocity_scale = trajectory_format == TRAJECTORY_FIXED ? max_velocity / 32767 : 1;
+    
+    char *cursor = raw;
+    memcpy(cursor, frame->id, count * sizeof(uint32_t));
+    cursor += count * sizeof(uint32_t);
+    const double *arrays[4] = {frame->x, frame->y, frame->vx, frame->vy};
+    for (int a = 0; a < 4; a++) {
+        bool velocity = a >= 2;
+        if (trajectory_format == TRAJECTORY_F64) {
+            memcpy(cursor, arrays[a], count * sizeof(double));
+        } else if (trajectory_format == TRAJECTORY_F32) {
+            store_f32(arrays[a], count, (float *)cursor);
+        } else if (velocity) {
+            store_fixed16(arrays[a], count, header.velocity_scale, (int16_t *)cursor);
+        } else {
+            store_fixed32(arrays[a], count, header.position_scale, (int32_t *)cursor);
+        }
+        cursor += (size_t)count * (velocity ? velocity_size : position_size);
+    }
+    
+    const char *payload = raw;
+    size_t stored_size = raw_size;
+    if (trajectory_codec != CODEC_NONE) {
+        char *shuffled = trajectory_shuffled = grow_buffer(trajectory_shuffled, &trajectory_shuffled_capacity, (int)raw_size, 1);
+        int sizes[5] = {sizeof(uint32_t), position_size, position_size, velocity_size, velocity_size};
+        size_t offset = 0;
+        for (int a = 0; a < 5; a++) {
+            shuffle_bytes(raw + offset, count, sizes[a], shuffled + offset);
+            offset += (size_t)count * sizes[a];
+        }
+        raw = shuffled;
+    }
+#ifdef USE_LZ4
+    if (trajectory_codec == CODEC_LZ4) {
+        trajectory_packed = grow_buffer(trajectory_packed, &trajectory_packed_capacity, LZ4_compressBound((int)raw_size), 1);
+        stored_size = LZ4_compress_default(raw, trajectory_packed, (int)raw_size, trajectory_packed_capacity);
+        payload = trajectory_packed;
+    }
+#endif
+#ifdef USE_ZSTD
+    if (trajectory_codec == CODEC_ZSTD) {
+        trajectory_packed = grow_buffer(trajectory_packed, &trajectory_packed_capacity, (int)ZSTD_compressBound(raw_size), 1);
+        if (!trajectory_zstd) trajectory_zstd = ZSTD_createCCtx();
+        stored_size = ZSTD_compressCCtx(trajectory_zstd, trajectory_packed, trajectory_packed_capacity, raw, raw_size, ZSTD_LEVEL);
+        if (ZSTD_isError(stored_size)) stored_size = 0;
+        payload = trajectory_packed;
+    }
+#endif
+    if (stored_size == 0 && raw_size > 0) {
+        log_message(LOG_ERROR, TOPIC_GENERAL, "ERROR: Compressing trajectory frame %d failed\n", frame->step);
+        return;
+    }
+    
+    header.raw_size = raw_size;
+    header.stored_size = stored_size;
+    if (fwrite(&header, sizeof(header), 1, trajectory_file) != 1 ||
+        fwrite(payload, 1, stored_size, trajectory_file) != stored_size) {
+        log_message(LOG_ERROR, TOPIC_GENERAL, "ERROR: Writing trajectory '%s' failed\n", trajectory_path);
+        return;
+    }
+    trajectory_written++;
+    trajectory_raw_bytes += raw_size;
+    trajectory_stored_bytes += stored_size + sizeof(header);
+}
+
+void *trajectory_thread_main(void *arg) {
+    pthread_mutex_lock(&trajectory_lock);
+    for (;;) {
+        // Oldest ready frame first
+        TrajectoryFrame *frame = NULL;
+        for (int k = 0; k < 2; k++) {
+            TrajectoryFrame *candidate = &trajectory_frames[k];
+            if (candidate->state == FRAME_READY && (!frame || candidate->step < frame->step)) frame = candidate;
+        }
+        if (!frame) {
+            if (!trajectory_running) break;
+            pthread_cond_wait(&trajectory_ready, &trajectory_lock);
+            continue;
+        }
+        frame->state = FRAME_WRITING;
+        pthread_mutex_unlock(&trajectory_lock);
+        write_trajectory_frame(frame);
+        pthread_mutex_lock(&trajectory_lock);
+        frame->state = FRAME_FREE;
+    }
+    pthread_mutex_unlock(&trajectory_lock);
+    return NULL;
+}
+
+bool start_trajectory() {
+    if (!trajectory_path) return true;
+    trajectory_file = fopen(trajectory_path, "wb");
+    if (!trajectory_file) {
+        log_message(LOG_ERROR, TOPIC_GENERAL, "ERROR: Cannot write trajectory '%s'\n", trajectory_path);
+        return false;
+    }
+    TrajectoryFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "GSIMTRAJ", 8);
+    header.version = TRAJECTORY_VERSION;
+    header.header_size = sizeof(header);
+    header.format = trajectory_format;
+    header.codec = trajectory_codec;
+    header.time_step = time_step;
+    header.interval = trajectory_interval;
+    fwrite(&header, sizeof(header), 1, trajectory_file);
+    
+    trajectory_running = true;
+    if (pthread_create(&trajectory_thread, NULL, trajectory_thread_main, NULL) != 0) {
+        printf("ERROR: Could not start the trajectory writer\n");
+        exit(1);
+    }
+    return true;
+}
+
+// Writes out whatever is still queued, then closes the file
+void stop_trajectory() {
+    if (!trajectory_file) return;
+    pthread_mutex_lock(&trajectory_lock);
+    trajectory_running = false;
+    pthread_cond_signal(&trajectory_ready);
+    pthread_mutex_unlock(&trajectory_lock);
+    pthread_join(trajectory_thread, NULL);
+    fclose(trajectory_file);
+    trajectory_file = NULL;
+#ifdef USE_ZSTD
+    ZSTD_freeCCtx(trajectory_zstd);
+    trajectory_zstd = NULL;
+#endif
+    
+    log_message(LOG_INFO, TOPIC_GENERAL, "Trajectory: %d frames (%s, %s) to %s, %.1f MB raw, %.1f MB stored, %d dropped\n",
+                                         trajectory_written, trajectory_format_names[trajectory_format],
+                                         trajectory_codec_names[trajectory_codec], trajectory_path,
+                                         trajectory_raw_bytes / 1e6, trajectory_stored_bytes / 1e6, trajectory_dropped);
+}
+
+// Distributed runs (build with mpicc -DUSE_MPI, launch with mpirun and
+// --headless). Each rank holds the bodies of one domain: a run of the Morton
+// curve over the simulation area, cut so that the ranks' measured force
+// costs come out equal. A force pass sends every other rank the sources it
+// needs from here (cells of the local tree that pass the opening test for
+// that rank's whole bounding box, bodies where they do not; every body for
+// the direct backends, which stay exact), computes the local forces while
+// they travel, and adds the imported ones through a small tree of their own.
+// Collisions are resolved within a domain; bodies found touching across a
+// boundary all go to the lowest of their ranks, which merges them on arrival. Checkpoints, trajectories, traces
+// and --output are written per rank, to the path with ".rank<N>" appended;
+// --ic finds such per-rank checkpoints by the same name.
+#ifdef USE_MPI
+typedef struct {
+    double mass, mx, my;
+    double min_x, min_y, max_x, max_y;
+    // The largest radius of a body source below, or -1 for none
+    double reach;
+    int begin, end, level;
+    int children, child_count;
+} ImportCell;
+// Sources are (x, y, mass, radius) records; a cell goes as a monopole with radius -1
+#define SOURCE_SIZE 4
+
+#define BODY_RECORD_FIELD(type, name) + sizeof(type)
+enum { BODY_RECORD_SIZE = 0 BODY_FIELDS(BODY_RECORD_FIELD) };
+#undef BODY_RECORD_FIELD
+
+// Domain r owns the curve keys in [domain_splits[r], domain_splits[r + 1])
+uint64_t *domain_splits = NULL;
+double *domain_boxes = NULL;
+int *rank_send_counts = NULL, *rank_send_offsets = NULL;
+int *rank_recv_counts = NULL, *rank_recv_offsets = NULL;
+MPI_Request *rank_requests = NULL;
+double *export_sources = NULL, *import_sources = NULL;
+int export_capacity = 0, import_capacity = 0, export_count = 0;
+double *import_x = NULL, *import_y = NULL, *import_mass = NULL, *import_radius = NULL;
+int *import_rank = NULL;
+// Where body i must go to meet the bodies it touches on other ranks: the
+// lowest rank among theirs and this one, or -1 with no such contact
+int *handoff_ranks = NULL;
+int handoff_capacity = 0;
+ImportCell *import_cells = NULL;
+int import_cell_count = 0, import_cell_capacity = 0;
+char *migrate_send = NULL, *migrate_recv = NULL;
+int migrate_send_capacity = 0, migrate_recv_capacity = 0;
+bool distributed_input = false;
+double rank_compute_seconds = 0, rank_wait_seconds = 0, rank_balance_start = 0, rank_imbalance = 1;
+long long rank_imported = 0, rank_evaluations = 0, rank_migrated = 0;
+int rank_rebalances = 0;
+
+// path.rank<N>; allocated once at startup
+const char *rank_path(const char *path) {
+    size_t size = strlen(path) + 24;
+    char *ranked = malloc(size);
+    if (!ranked) {
+        printf("ERROR: Out of memory\n");
+        exit(1);
+    }
+    snprintf(ranked, size, "%s.rank%d", path, rank_id);
+    return ranked;
+}
+
+// Every rank parsed the same command line, so all reach the same verdict
+bool start_ranks() {
+    int provided;
+    MPI_Init_thread(NULL, NULL, MPI_THREAD_FUNNELED, &provided);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank_id);
+    MPI_Comm_size(MPI_COMM_WORLD, &rank_count);
+    if (rank_count == 1) return true;
+    
+    const char *problem = NULL;
+    if (!headless || benchmark) problem = "Distributed runs are headless only (--headless)";
+    else if (report_force_error) problem = "--force-error needs every body on one rank";
+    if (problem) {
+        if (rank_id == 0) printf("ERROR: %s\n", problem);
+        return false;
+    }
+    if (rank_id > 0 && log_level < LOG_WARN) log_level = LOG_WARN;
+    
+    // Ranks on one node share its cores unless --threads says otherwise
+    if (requested_threads <= 0) {
+        MPI_Comm node;
+        int node_ranks;
+        MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node);
+        MPI_Comm_size(node, &node_ranks);
+        MPI_Comm_free(&node);
+        requested_threads = (int)fmax(1, sysconf(_SC_NPROCESSORS_ONLN) / node_ranks);
+    }
+    // Every rank generates the same bodies before keeping its share
+    if (!seed_given) random_seed = (uint64_t)time(NULL);
+    MPI_Bcast(&random_seed, 1, MPI_UINT64_T, 0, MPI_COMM_WORLD);
+    seed_given = true;
+    
+    if (initial_conditions_path) {
+        const char *own = rank_path(initial_conditions_path);
+        int found = access(own, R_OK) == 0, all, any;
+        MPI_Allreduce(&found, &all, 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+        MPI_Allreduce(&found, &any, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+        char beyond[4096];
+        snprintf(beyond, sizeof(beyond), "%s.rank%d", initial_conditions_path, rank_count);
+        if (any && (!all || access(beyond, R_OK) == 0)) {
+            if (rank_id == 0) printf("ERROR: The per-rank files of '%s' were written by a different number of ranks\n", initial_conditions_path);
+            return false;
+        }
+        if (all) {
+            initial_conditions_path = own;
+            distributed_input = true;
+        }
+    }
+    if (output_path) output_path = rank_path(output_path);
+    if (checkpoint_path) checkpoint_path = rank_path(checkpoint_path);
+    default_checkpoint_path = rank_path(DEFAULT_CHECKPOINT_PATH);
+    if (trajectory_path) trajectory_path = rank_path(trajectory_path);
+    if (trace_path) trace_path = rank_path(trace_path);
+    
+    domain_splits = calloc(rank_count + 1, sizeof(uint64_t));
+    domain_boxes = malloc(5 * rank_count * sizeof(double));
+    rank_send_counts = malloc(rank_count * sizeof(int));
+    rank_send_offsets = malloc(rank_count * sizeof(int));
+    rank_recv_counts = malloc(rank_count * sizeof(int));
+    rank_recv_offsets = malloc(rank_count * sizeof(int));
+    rank_requests = malloc(2 * rank_count * sizeof(MPI_Request));
+    if (!domain_splits || !domain_boxes || !rank_send_counts || !rank_send_offsets ||
+        !rank_recv_counts || !rank_recv_offsets || !rank_requests) {
+        printf("ERROR: Out of memory\n");
+        exit(1);
+    }
+    return true;
+}
+
+void stop_ranks() {
+    MPI_Finalize();
+}
+
+bool ranks_all(bool value) {
+    int local = value, all;
+    MPI_Allreduce(&local, &all, 1, MPI_INT, MPI_LAND, MPI_COMM_WORLD);
+    return all;
+}
+
+void ranks_sum(double *values, int count) {
+    MPI_Allreduce(MPI_IN_PLACE, values, count, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+}
+
+uint32_t domain_key(double x, double y) {
+    return morton_key(x, y, 0, 0, 65536 / fmax(window_width, window_height));
+}
+
+int domain_owner(uint32_t key) {
+    int low = 0, high = rank_count - 1;
+    while (low < high) {
+        int mid = (low + high + 1) / 2;
+        if (domain_splits[mid] <= key) low = mid;
+        else high = mid - 1;
+    }
+    return low;
+}
+
+// Each rank offers DOMAIN_SAMPLES keys at evenly spaced quantiles of its
+// bodies, each carrying an equal part of its cost; every rank then cuts the
+// same gathered samples into equal cost, so all agree on the new splits
+void rebalance_domains(double cost) {
+    size_t mark = arena_mark(&step_arena);
+    uint64_t *keys = arena_alloc(&step_arena, body_count * sizeof(uint64_t));
+    uint64_t *scratch = arena_alloc(&step_arena, body_count * sizeof(uint64_t));
+    int live = 0;
+    for (int i = 0; i < body_count; i++) {
+        if (bodies.active[i]) keys[live++] = (uint64_t)domain_key(bodies.x[i], bodies.y[i]) << 32 | (uint32_t)i;
+    }
+    morton_sort(keys, scratch, live);
+    
+    uint32_t samples[DOMAIN_SAMPLES];
+    double weights[DOMAIN_SAMPLES];
+    for (int k = 0; k < DOMAIN_SAMPLES; k++) {
+        samples[k] = live ? (uint32_t)(keys[(2 * k + 1) * (long long)live / (2 * DOMAIN_SAMPLES)] >> 32) : 0;
+        weights[k] = live ? cost / DOMAIN_SAMPLES : 0;
+    }
+    int total = DOMAIN_SAMPLES * rank_count;
+    uint32_t *all_samples = arena_alloc(&step_arena, total * sizeof(uint32_t));
+    double *all_weights = arena_alloc(&step_arena, total * sizeof(double));
+    MPI_Allgather(samples, DOMAIN_SAMPLES, MPI_UINT32_T, all_samples, DOMAIN_SAMPLES, MPI_UINT32_T, MPI_COMM_WORLD);
+    MPI_Allgather(weights, DOMAIN_SAMPLES, MPI_DOUBLE, all_weights, DOMAIN_SAMPLES, MPI_DOUBLE, MPI_COMM_WORLD);
+    
+    uint64_t *order = arena_alloc(&step_arena, total * sizeof(uint64_t));
+    uint64_t *order_scratch = arena_alloc(&step_arena, total * sizeof(uint64_t));
+    double sum = 0;
+    for (int s = 0; s < total; s++) {
+        order[s] = (uint64_t)all_samples[s] << 32 | (uint32_t)s;
+        sum += all_weights[s];
+    }
+    morton_sort(order, order_scratch, total);
+    if (sum > 0) {
+        double share = sum / rank_count, cumulative = 0;
+        int r = 1;
+        for (int k = 0; k < total; k++) {
+            while (r < rank_count && cumulative >= r * share) domain_splits[r++] = order[k] >> 32;
+            cumulative += all_weights[(uint32_t)order[k]];
+        }
+        while (r < rank_count) domain_splits[r++] = (uint64_t)1 << 32;
+    }
+    domain_splits[0] = 0;
+    domain_splits[rank_count] = (uint64_t)1 << 32;
+    arena_release(&step_arena, mark);
+}
+
+// Hands every body outside this rank's domain to its owner. Accelerations
+// travel with the bodies, so forces_current survives the exchange
+void migrate_bodies() {
+    size_t mark = arena_mark(&step_arena);
+    int *owners = arena_alloc(&step_arena, body_count * sizeof(int));
+    int *fill = arena_alloc(&step_arena, rank_count * sizeof(int));
+    for (int r = 0; r < rank_count; r++) rank_send_counts[r] = 0;
+    for (int i = 0; i < body_count; i++) {
+        owners[i] = rank_id;
+        if (bodies.active[i]) {
+            owners[i] = domain_owner(domain_key(bodies.x[i], bodies.y[i]));
+            if (i < handoff_capacity && handoff_ranks[i] >= 0) owners[i] = handoff_ranks[i];
+        }
+        if (owners[i] != rank_id) rank_send_counts[owners[i]]++;
+    }
+    int sending = 0;
+    for (int r = 0; r < rank_count; r++) {
+        fill[r] = rank_send_offsets[r] = sending * BODY_RECORD_SIZE;
+        sending += rank_send_counts[r];
+        rank_send_counts[r] *= BODY_RECORD_SIZE;
+    }
+    migrate_send = grow_buffer(migrate_send, &migrate_send_capacity, sending * BODY_RECORD_SIZE, 1);
+    for (int i = 0; i < body_count; i++) {
+        if (owners[i] == rank_id) continue;
+        char *record = migrate_send + fill[owners[i]];
+        fill[owners[i]] += BODY_RECORD_SIZE;
+#define PACK_BODY_FIELD(type, name) memcpy(record, &bodies.name[i], sizeof(type)); record += sizeof(type);
+        BODY_FIELDS(PACK_BODY_FIELD)
+#undef PACK_BODY_FIELD
+        bodies.active[i] = false;
+        bodies.mass[i] = 0;
+        dead_body_count++;
+    }
+    
+    MPI_Alltoall(rank_send_counts, 1, MPI_INT, rank_recv_counts, 1, MPI_INT, MPI_COMM_WORLD);
+    int receiving = 0;
+    for (int r = 0; r < rank_count; r++) {
+        rank_recv_offsets[r] = receiving;
+        receiving += rank_recv_counts[r];
+    }
+    migrate_recv = grow_buffer(migrate_recv, &migrate_recv_capacity, receiving, 1);
+    MPI_Alltoallv(migrate_send, rank_send_counts, rank_send_offsets, MPI_BYTE,
+                  migrate_recv, rank_recv_counts, rank_recv_offsets, MPI_BYTE, MPI_COMM_WORLD);
+    
+    if (sending > 0) compact_bodies();
+    int arrivals = receiving / BODY_RECORD_SIZE;
+    if (arrivals > 0) {
+        reserve_bodies(body_count + arrivals);
+        const char *record = migrate_recv;
+        for (int k = 0; k < arrivals; k++) {
+            int i = body_count++;
+#define UNPACK_BODY_FIELD(type, name) memcpy(&bodies.name[i], record, sizeof(type)); record += sizeof(type);
+            BODY_FIELDS(UNPACK_BODY_FIELD)
+#undef UNPACK_BODY_FIELD
+        }
+        contacts_current = false;
+        // Arrivals from outside the domain were handed over for a contact;
+        // merging them now keeps them from overlapping through another pass
+        bool handed = false;
+        for (int i = body_count - arrivals; i < body_count; i++) {
+            handed |= domain_owner(domain_key(bodies.x[i], bodies.y[i])) != rank_id;
+        }
+        if (handed) handle_collisions();
+    }
+    rank_migrated += sending;
+    arena_release(&step_arena, mark);
+}
+
+// Leaves each rank with the bodies of its domain, equal in number
+bool distribute_bodies() {
+    // Checked only now, as a checkpoint may have chosen the integrator
+    if (integrator == integrate_block) {
+        if (rank_id == 0) printf("ERROR: The block integrator cannot run distributed: each rank would keep its own clock\n");
+        return false;
+    }
+    if (!distributed_input) {
+        // Every rank holds every body; keep a disjoint share before the exchange
+        for (int i = 0; i < body_count; i++) {
+            if (!bodies.active[i] || i % rank_count == rank_id) continue;
+            bodies.active[i] = false;
+            bodies.mass[i] = 0;
+            dead_body_count++;
+        }
+        compact_bodies();
+    }
+    int live = 0;
+    for (int i = 0; i < body_count; i++) live += bodies.active[i];
+    rebalance_domains(live);
+    migrate_bodies();
+    forces_current = ranks_all(forces_current);
+    
+    int held[3] = {body_count, body_count, body_count};
+    MPI_Allreduce(MPI_IN_PLACE, &held[0], 1, MPI_INT, MPI_MIN, MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE, &held[1], 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE, &held[2], 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+    log_message(LOG_INFO, TOPIC_GENERAL, "Distributed %d bodies over %d ranks (%d to %d each, %d threads per rank)\n",
+                                         held[2], rank_count, held[0], held[1], thread_count);
+    return true;
+}
+
+void push_export(double x, double y, double mass, double radius) {
+    export_sources = grow_buffer(export_sources, &export_capacity, SOURCE_SIZE * (export_count + 1), sizeof(double));
+    double *source = &export_sources[SOURCE_SIZE * export_count++];
+    source[0] = x;
+    source[1] = y;
+    source[2] = mass;
+    source[3] = radius;
+}
+
+// A node far enough from every point of the box, by the walk's own opening
+// test, goes as one source; the others are opened down to their bodies.
+// Nodes within reach of the box are always opened, so contacts are seen
+void export_tree(const double *box, double theta, double reach) {
+    int stack[4 * QUAD_MAX_DEPTH + 8];
+    int top = 0;
+    double theta_sq = theta * theta;
+    
+    stack[top++] = 0;
+    while (top > 0) {
+        const QuadNode *node = &quad_nodes[stack[--top]];
+        if (node->mass == 0) continue;
+        
+        if (node->children < 0) {
+            for (int j = node->first; j >= 0; j = quad_next[j]) {
+                push_export(bodies.x[j], bodies.y[j], bodies.mass[j], bodies.radius[j]);
+            }
+            continue;
+        }
+        double dx = fmax(0, fmax(box[0] - node->mx, node->mx - box[2]));
+        double dy = fmax(0, fmax(box[1] - node->my, node->my - box[3]));
+        double size = 2 * node->half;
+        double half = node->half + reach;
+        bool overlaps = node->cx + half >= box[0] && node->cx - half <= box[2] &&
+                        node->cy + half >= box[1] && node->cy - half <= box[3];
+        if (!overlaps && size * size < theta_sq * (dx * dx + dy * dy)) {
+            push_export(node->mx, node->my, node->mass, -1);
+        } else {
+            for (int c = node->children; c < node->children + 4; c++) {
+                stack[top++] = c;
+            }
+        }
+    }
+}
+
+int import_new_cell(int begin, int end, int level) {
+    import_cells = grow_buffer(import_cells, &import_cell_capacity, import_cell_count + 1, sizeof(ImportCell));
+    ImportCell *cell = &import_cells[import_cell_count];
+    cell->begin = begin;
+    cell->end = end;
+    cell->level = level;
+    cell->children = -1;
+    cell->child_count = 0;
+    return import_cell_count++;
+}
+
+// Sorted along the curve and cut like the FMM cells; each cell keeps the
+// bounding box of its sources for the opening test
+void build_import_tree(const double *sources, int count) {
+    double min_x = INFINITY, min_y = INFINITY;
+    double max_x = -INFINITY, max_y = -INFINITY;
+    for (int k = 0; k < count; k++) {
+        min_x = fmin(min_x, sources[SOURCE_SIZE * k]);
+        min_y = fmin(min_y, sources[SOURCE_SIZE * k + 1]);
+        max_x = fmax(max_x, sources[SOURCE_SIZE * k]);
+        max_y = fmax(max_y, sources[SOURCE_SIZE * k + 1]);
+    }
+    uint64_t *keys = arena_alloc(&step_arena, count * sizeof(uint64_t));
+    uint64_t *scratch = arena_alloc(&step_arena, count * sizeof(uint64_t));
+    double scale = 65536 / (fmax(max_x - min_x, max_y - min_y) * 1.0001 + 1e-9);
+    for (int k = 0; k < count; k++) {
+        const double *source = &sources[SOURCE_SIZE * k];
+        keys[k] = (uint64_t)morton_key(source[0], source[1], min_x, min_y, scale) << 32 | (uint32_t)k;
+    }
+    morton_sort(keys, scratch, count);
+    int *ranks = arena_alloc(&step_arena, count * sizeof(int));
+    for (int r = 0; r < rank_count; r++) {
+        int first = rank_recv_offsets[r] / SOURCE_SIZE, last = first + rank_recv_counts[r] / SOURCE_SIZE;
+        for (int k = first; k < last; k++) ranks[k] = r;
+    }
+    import_x = arena_alloc(&step_arena, count * sizeof(double));
+    import_y = arena_alloc(&step_arena, count * sizeof(double));
+    import_mass = arena_alloc(&step_arena, count * sizeof(double));
+    import_radius = arena_alloc(&step_arena, count * sizeof(double));
+    import_rank = arena_alloc(&step_arena, count * sizeof(int));
+    for (int k = 0; k < count; k++) {
+        int original = (int)(uint32_t)keys[k];
+        const double *source = &sources[SOURCE_SIZE * original];
+        import_x[k] = source[0];
+        import_y[k] = source[1];
+        import_mass[k] = source[2];
+        import_radius[k] = source[3];
+        import_rank[k] = ranks[original];
+    }
+    
+    import_cell_count = 0;
+    import_new_cell(0, count, 0);
+    for (int c = 0; c < import_cell_count; c++) {
+        int begin = import_cells[c].begin, end = import_cells[c].end, level = import_cells[c].level;
+        if (end - begin <= IMPORT_LEAF_SIZE) continue;
+        int bounds[5];
+        while (level < 16) {
+            bounds[0] = begin;
+            for (uint32_t digit = 1; digit < 4; digit++) bounds[digit] = morton_digit_bound(keys, begin, end, level, digit);
+            bounds[4] = end;
+            int occupied = 0;
+            for (int d = 0; d < 4; d++) occupied += bounds[d + 1] > bounds[d];
+            if (occupied > 1) break;
+            level++;
+        }
+        if (level == 16) continue;
+        import_cells[c].children = import_cell_count;
+        for (int d = 0; d < 4; d++) {
+            if (bounds[d + 1] > bounds[d]) {
+                import_new_cell(bounds[d], bounds[d + 1], level + 1);
+                import_cells[c].child_count++;
+            }
+        }
+    }
+    
+    // Children come after their parent, so a reverse sweep is bottom-up
+    for (int c = import_cell_count - 1; c >= 0; c--) {
+        ImportCell *cell = &import_cells[c];
+        double mass = 0, mx = 0, my = 0;
+        cell->min_x = cell->min_y = INFINITY;
+        cell->max_x = cell->max_y = -INFINITY;
+        cell->reach = -1;
+        if (cell->children < 0) {
+            for (int k = cell->begin; k < cell->end; k++) {
+                cell->reach = fmax(cell->reach, import_radius[k]);
+                mass += import_mass[k];
+                mx += import_mass[k] * import_x[k];
+                my += import_mass[k] * import_y[k];
+                cell->min_x = fmin(cell->min_x, import_x[k]);
+                cell->min_y = fmin(cell->min_y, import_y[k]);
+                cell->max_x = fmax(cell->max_x, import_x[k]);
+                cell->max_y = fmax(cell->max_y, import_y[k]);
+            }
+        } else {
+            for (int child = cell->children; child < cell->children + cell->child_count; child++) {
+                const ImportCell *sub = &import_cells[child];
+                cell->reach = fmax(cell->reach, sub->reach);
+                mass += sub->mass;
+                mx += sub->mass * sub->mx;
+                my += sub->mass * sub->my;
+                cell->min_x = fmin(cell->min_x, sub->min_x);
+                cell->min_y = fmin(cell->min_y, sub->min_y);
+                cell->max_x = fmax(cell->max_x, sub->max_x);
+                cell->max_y = fmax(cell->max_y, sub->max_y);
+            }
+        }
+        cell->mass = mass;
+        cell->mx = mass > 0 ? mx / mass : (cell->min_x + cell->max_x) / 2;
+        cell->my = mass > 0 ? my / mass : (cell->min_y + cell->max_y) / 2;
+    }
+}
+
+// Adds the imported sources' pull to the local accelerations. Cells that
+// may hold a body within contact range are opened whatever their distance,
+// so that every contact across a boundary is found
+void import_forces_task(int task, int thread, void *context) {
+    double theta_sq = *(const double *)context;
+    double soft_sq = softening_length * softening_length;
+    int begin = task * ROW_BLOCK;
+    int end = begin + ROW_BLOCK < body_count ? begin + ROW_BLOCK : body_count;
+    
+    for (int i = begin; i < end; i++) {
+        if (!bodies.active[i]) continue;
+        int stack[4 * 17 + 8];
+        int top = 0;
+        double x = bodies.x[i], y = bodies.y[i];
+        double ax = 0, ay = 0;
+        double margin = bodies.radius[i] + contact_margin;
+        int handoff = rank_count;
+        
+        stack[top++] = 0;
+        while (top > 0) {
+            const ImportCell *cell = &import_cells[stack[--top]];
+            double dx = cell->mx - x;
+            double dy = cell->my - y;
+            double d_sq = dx * dx + dy * dy;
+            double size = fmax(cell->max_x - cell->min_x, cell->max_y - cell->min_y);
+            double reach = cell->reach >= 0 ? margin + cell->reach : 0;
+            bool inside = x >= cell->min_x - reach && x <= cell->max_x + reach &&
+                          y >= cell->min_y - reach && y <= cell->max_y + reach;
+            
+            if (!inside && size * size < theta_sq * d_sq) {
+                double dist_sq = d_sq + soft_sq;
+                double inv_dist3 = 1.0 / (dist_sq * sqrt(dist_sq));
+                ax += cell->mass * dx * inv_dist3;
+                ay += cell->mass * dy * inv_dist3;
+            } else if (cell->children < 0) {
+                for (int k = cell->begin; k < cell->end; k++) {
+                    double sx = import_x[k] - x;
+                    double sy = import_y[k] - y;
+                    double dist_sq = sx * sx + sy * sy + soft_sq;
+                    double inv_dist3 = 1.0 / (dist_sq * sqrt(dist_sq));
+                    ax += import_mass[k] * sx * inv_dist3;
+                    ay += import_mass[k] * sy * inv_dist3;
+                    double touch = margin + import_radius[k];
+                    if (import_radius[k] >= 0 && import_rank[k] < handoff && sx * sx + sy * sy < touch * touch) {
+                        handoff = import_rank[k];
+                    }
+                }
+            } else {
+                for (int c = cell->children; c < cell->children + cell->child_count; c++) {
+                    stack[top++] = c;
+                }
+            }
+        }
+        bodies.ax[i] += gravity_constant * ax;
+        bodies.ay[i] += gravity_constant * ay;
+        handoff_ranks[i] = handoff == rank_count ? -1 : handoff < rank_id ? handoff : rank_id;
+    }
+}
+
+void calculate_forces_distributed() {
+    double start = now_seconds();
+    // Bounding box of the live bodies, then their largest contact reach
+    double box[5] = {INFINITY, INFINITY, -INFINITY, -INFINITY, 0};
+    for (int i = 0; i < body_count; i++) {
+        if (!bodies.active[i]) continue;
+        box[0] = fmin(box[0], bodies.x[i]);
+        box[1] = fmin(box[1], bodies.y[i]);
+        box[2] = fmax(box[2], bodies.x[i]);
+        box[3] = fmax(box[3], bodies.y[i]);
+        box[4] = fmax(box[4], bodies.radius[i]);
+    }
+    box[4] += contact_margin;
+    MPI_Allgather(box, 5, MPI_DOUBLE, domain_boxes, 5, MPI_DOUBLE, MPI_COMM_WORLD);
+    handoff_ranks = grow_buffer(handoff_ranks, &handoff_capacity, body_count, sizeof(int));
+    for (int i = 0; i < body_count; i++) handoff_ranks[i] = -1;
+    
+    // Theta 0 opens every import cell, so the direct backends stay exact
+    bool tree = force_backend == FORCE_BARNES_HUT || force_backend == FORCE_FMM;
+    if (tree) update_quadtree();
+    export_count = 0;
+    for (int r = 0; r < rank_count; r++) {
+        int first = export_count;
+        const double *other = &domain_boxes[5 * r];
+        // A rank without bodies has an inside-out box and needs nothing
+        if (r != rank_id && other[0] <= other[2]) {
+            if (tree) {
+                export_tree(other, bh_theta, other[4] + box[4]);
+            } else {
+                for (int i = 0; i < body_count; i++) {
+                    if (bodies.active[i]) push_export(bodies.x[i], bodies.y[i], bodies.mass[i], bodies.radius[i]);
+                }
+            }
+        }
+        rank_send_offsets[r] = SOURCE_SIZE * first;
+        rank_send_counts[r] = SOURCE_SIZE * (export_count - first);
+    }
+    MPI_Alltoall(rank_send_counts, 1, MPI_INT, rank_recv_counts, 1, MPI_INT, MPI_COMM_WORLD);
+    int received = 0;
+    for (int r = 0; r < rank_count; r++) {
+        rank_recv_offsets[r] = received;
+        received += rank_recv_counts[r];
+    }
+    import_sources = grow_buffer(import_sources, &import_capacity, received, sizeof(double));
+    int requests = 0;
+    for (int r = 0; r < rank_count; r++) {
+        if (rank_recv_counts[r] == 0) continue;
+        MPI_Irecv(import_sources + rank_recv_offsets[r], rank_recv_counts[r], MPI_DOUBLE, r, 0, MPI_COMM_WORLD, &rank_requests[requests++]);
+    }
+    for (int r = 0; r < rank_count; r++) {
+        if (rank_send_counts[r] == 0) continue;
+        MPI_Isend(export_sources + rank_send_offsets[r], rank_send_counts[r], MPI_DOUBLE, r, 0, MPI_COMM_WORLD, &rank_requests[requests++]);
+    }
+    
+    // The local pass hides the transfer
+    calculate_local_forces();
+    double local_done = now_seconds();
+    MPI_Waitall(requests, rank_requests, MPI_STATUSES_IGNORE);
+    double arrived = now_seconds();
+    
+    int sources = received / SOURCE_SIZE;
+    if (sources > 0) {
+        size_t mark = arena_mark(&step_arena);
+        build_import_tree(import_sources, sources);
+        double theta_sq = tree ? bh_theta * bh_theta : 0;
+        parallel_for((body_count + ROW_BLOCK - 1) / ROW_BLOCK, import_forces_task, &theta_sq);
+        arena_release(&step_arena, mark);
+    }
+    rank_compute_seconds += (local_done - start) + (now_seconds() - arrived);
+    rank_wait_seconds += arrived - local_done;
+    rank_imported += sources;
+    rank_evaluations++;
+}
+
+// After every step: rebalance when the force cost has drifted apart, hand
+// moved bodies to their owners, then agree on whether the forces are still
+// current, since a merge on one rank must not leave it evaluating them alone
+void end_distributed_step() {
+    if (step_count % DOMAIN_BALANCE_INTERVAL == 0) {
+        double cost = rank_compute_seconds - rank_balance_start, peak, sum;
+        MPI_Allreduce(&cost, &peak, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+        MPI_Allreduce(&cost, &sum, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+        rank_imbalance = sum > 0 ? peak * rank_count / sum : 1;
+        if (rank_imbalance > DOMAIN_IMBALANCE_LIMIT) {
+            rebalance_domains(cost);
+            rank_rebalances++;
+        }
+        rank_balance_start = rank_compute_seconds;
+    }
+    migrate_bodies();
+    forces_current = ranks_all(forces_current);
+}
+
+void report_ranks() {
+    double totals[3] = {rank_compute_seconds, rank_wait_seconds, (double)rank_imported};
+    double peak;
+    long long migrated;
+    MPI_Allreduce(&rank_compute_seconds, &peak, 1, MPI_DOUBLE, MPI_MAX, MPI_COMM_WORLD);
+    MPI_Allreduce(MPI_IN_PLACE, totals, 3, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+    MPI_Allreduce(&rank_migrated, &migrated, 1, MPI_LONG_LONG, MPI_SUM, MPI_COMM_WORLD);
+    double busy = totals[0] + totals[1];
+    log_message(LOG_INFO, TOPIC_GENERAL, "Ranks: force cost imbalance %.2f (%d rebalances), %lld bodies migrated, "
+                                         "%.0f sources imported per rank and pass, %.1f%% of force time waiting\n",
+                                         totals[0] > 0 ? peak * rank_count / totals[0] : 1, rank_rebalances, migrated,
+                                         rank_evaluations ? totals[2] / rank_count / rank_evaluations : 0,
+                                         busy > 0 ? 100 * totals[1] / busy : 0);
+}
+#else
+bool start_ranks() {
+    return true;
+}
+
+void stop_ranks() {
+}
+
+bool ranks_all(bool value) {
+    return value;
+}
+
+void ranks_sum(double *values, int count) {
+}
+
+bool distribute_bodies() {
+    return true;
+}
+
+void calculate_forces_distributed() {
+}
+
+void end_distributed_step() {
+}
+
+void report_ranks() {
+}
+#endif
+
+// Heap allocations made during the last step and the step arena's peak,
+// published for the profile overlay
+atomic_llong step_allocations = 0, step_arena_peak = 0;
+
+void step_simulation() {
+    long long allocations = heap_allocations;
+    double start = now_seconds();
+    forces_seconds = 0;
+    integrator();
+    profile_end_excluding(ZONE_INTEGRATE, start, forces_seconds);
+    
+    start = now_seconds();
+    handle_collisions();
+    profile_end(ZONE_COLLISIONS, start);
+    step_count++;
+    // Before any compaction, so the indices of the last force pass still hold
+    if (rank_count > 1) end_distributed_step();
+    maybe_compact_bodies();
+    if (checkpoint_interval > 0 && step_count % checkpoint_interval == 0) {
+        save_checkpoint(checkpoint_target());
+    }
+    if (trajectory_file && step_count % trajectory_interval == 0) trajectory_capture();
+    arena_reset(&step_arena);
+    step_allocations = heap_allocations - allocations;
+    step_arena_peak = (long long)step_arena.high_water;
+}
+
+// Runs a fixed number of steps as fast as possible, without touching SDL
+int run_headless() {
+    if (!ranks_all(init_bodies())) return 1;
+    if (rank_count > 1 && !distribute_bodies()) return 1;
+    
+    log_message(LOG_INFO, TOPIC_GENERAL, "Headless run: %d bodies, %d steps, %s forces (%s), %s integrator (dt %g), %d threads\n",
+                                         body_count, headless_steps, force_backend == FORCE_DIRECT ? direct_kernel_name : force_backend_name(),
+                                         force_precision_name(), integrator_name, time_step, thread_count);
+    
+    // The energy is a direct sum, so it needs every body in one place
+    bool track_energy = rank_count == 1 && body_count <= ENERGY_DIRECT_LIMIT;
+    double initial_energy = track_energy ? total_energy() : 0;
+    double start = now_seconds();
+    long long warm_allocations = 0;
+    int steps = 0;
+    for (; steps < headless_steps; steps++) {
+        double stability_start = now_seconds();
+        bool stable = ranks_all(check_stability());
+        profile_end(ZONE_STABILITY, stability_start);
+        if (!stable) {
+            log_message(LOG_WARN, TOPIC_GENERAL, "Simulation became unstable at step %d\n", step_count);
+            break;
+        }
+        step_simulation();
+        if (steps == 0) warm_allocations = heap_allocations;
+    }
+    double elapsed = now_seconds() - start;
+    
+    int live = 0;
+    double px = 0, py = 0, total_mass = 0;
+    for (int i = 0; i < body_count; i++) {
+        if (!bodies.active[i]) continue;
+        live++;
+        total_mass += bodies.mass[i];
+        px += bodies.mass[i] * bodies.vx[i];
+        py += bodies.mass[i] * bodies.vy[i];
+    }
+    double totals[4] = {live, total_mass, px, py};
+    ranks_sum(totals, 4);
+    log_message(LOG_INFO, TOPIC_GENERAL, "Completed %d steps in %.3f s (%.1f steps/s), %d bodies left, mass %.1f, momentum (%.4f, %.4f)\n",
+                                         steps, elapsed, elapsed > 0 ? steps / elapsed : 0, (int)totals[0], totals[1], totals[2], totals[3]);
+    if (track_energy) {
+        double final_energy = total_energy();
+        log_message(LOG_INFO, TOPIC_GENERAL, "Energy %.6e -> %.6e (relative drift %.3e, includes merger losses)\n",
+                                             initial_energy, final_energy,
+                                             initial_energy != 0 ? (final_energy - initial_energy) / fabs(initial_energy) : 0);
+    }
+    if (integrator == integrate_block) report_block_levels();
+    if (quad_rebuilds + quad_refits > 0) {
+        log_message(LOG_INFO, TOPIC_GENERAL, "Quadtree: %lld full rebuilds, %lld refits\n", quad_rebuilds, quad_refits);
+    }
+    if (rank_count > 1) report_ranks();
+    if (steps > 1) {
+        log_message(LOG_INFO, TOPIC_GENERAL, "Scratch: step arena high water %.2f MB, %lld heap allocations after the first step\n",
+                                             step_arena.high_water / 1e6, heap_allocations - warm_allocations);
+    }
+    for (int zone = ZONE_STABILITY; zone <= ZONE_COLLISIONS; zone++) {
+        double p50, p99;
+        if (zone_percentiles(zone, &p50, &p99)) {
+            log_message(LOG_INFO, TOPIC_GENERAL, "  %-10s p50 %8.3f ms  p99 %8.3f ms\n", zone_names[zone], p50, p99);
+        }
+    }
+    
+    if (output_path && !save_bodies_text(output_path)) return 1;
+    if (checkpoint_path && !save_checkpoint(checkpoint_path)) return 1;
+    return steps == headless_steps ? 0 : 2;
+}
+
+bool try_step_simulation() {
+    double start = now_seconds();
+    bool stable = check_stability();
+    profile_end(ZONE_STABILITY, start);
+    if (!stable) {
+        simulation_paused = true;
+        log_message(LOG_WARN, TOPIC_GENERAL, "Simulation automatically paused due to instability. Press 'P' to resume or Space to reset.\n");
+        return false;
+    }
+    step_simulation();
+    return true;
+}
+
+// Render snapshots are triple buffered: the physics thread fills the back
+// buffer, the renderer owns the front one, and the middle slot holds the
+// latest complete frame. Swapping is a single atomic exchange, so neither
+// side ever waits for the other.
+#define SNAPSHOT_FIELDS(X) \
+    X(double, x) X(double, y) \
+    X(double, vx) X(double, vy) \
+    X(double, radius) \
+    X(Uint8, r) X(Uint8, g) X(Uint8, b)
+typedef struct {
+#define DECLARE_SNAPSHOT_FIELD(type, name) type *name;
+    SNAPSHOT_FIELDS(DECLARE_SNAPSHOT_FIELD)
+#undef DECLARE_SNAPSHOT_FIELD
+    int count, capacity;
+    int step;
+    bool paused;
+} Snapshot;
+#define SNAPSHOT_FRESH 4
+Snapshot snapshots[3];
+atomic_int snapshot_middle = 1;
+int snapshot_back = 2;
+int snapshot_front = 0;
+// Set while the renderer sleeps for want of anything new to draw; the next
+// publish wakes it with snapshot_wake_event
+atomic_bool renderer_waiting = false;
+#ifndef NO_SDL
+Uint32 snapshot_wake_event = 0;
+#endif
+
+void capture_snapshot(Snapshot *snap) {
+    if (snap->capacity < body_count) {
+        int capacity = snap->capacity;
+#define GROW_SNAPSHOT_FIELD(type, name) { \
+            capacity = snap->capacity; \
+            snap->name = grow_buffer(snap->name, &capacity, body_count, sizeof(type)); \
+        }
+        SNAPSHOT_FIELDS(GROW_SNAPSHOT_FIELD)
+#undef GROW_SNAPSHOT_FIELD
+        snap->capacity = capacity;
+    }
+    
+    int n = 0;
+    for (int i = 0; i < body_count; i++) {
+        if (!bodies.active[i]) continue;
+#define COPY_SNAPSHOT_FIELD(type, name) snap->name[n] = bodies.name[i];
+        SNAPSHOT_FIELDS(COPY_SNAPSHOT_FIELD)
+#undef COPY_SNAPSHOT_FIELD
+        n++;
+    }
+    snap->count = n;
+    snap->step = step_count;
+    snap->paused = simulation_paused;
+}
+
+void publish_snapshot() {
+    capture_snapshot(&snapshots[snapshot_back]);
+    snapshot_back = atomic_exchange(&snapshot_middle, snapshot_back | SNAPSHOT_FRESH) & ~SNAPSHOT_FRESH;
+#ifndef NO_SDL
+    if (atomic_exchange(&renderer_waiting, false) && snapshot_wake_event) {
+        SDL_Event wake = {.type = snapshot_wake_event};
+        SDL_PushEvent(&wake);
+    }
+#endif
+}
+
+bool snapshot_ready() {
+    return atomic_load(&snapshot_middle) & SNAPSHOT_FRESH;
+}
+
+const Snapshot *acquire_snapshot() {
+    if (atomic_load(&snapshot_middle) & SNAPSHOT_FRESH) {
+        snapshot_front = atomic_exchange(&snapshot_middle, snapshot_front) & ~SNAPSHOT_FRESH;
+    }
+    return &snapshots[snapshot_front];
+}
+
+// Input is forwarded to the physics thread through a single-producer,
+// single-consumer ring; the body arrays are only ever touched by that thread
+typedef enum {
+    COMMAND_ADD_BODY,
+    COMMAND_DELETE_AT,
+    COMMAND_RESET,
+    COMMAND_TOGGLE_PAUSE,
+    COMMAND_TOGGLE_FORCE,
+    COMMAND_ADJUST_THETA,
+    COMMAND_RESIZE,
+    COMMAND_SAVE,
+    COMMAND_LOAD
+} CommandType;
+typedef struct {
+    CommandType type;
+    double x, y, vx, vy;
+} PhysicsCommand;
+PhysicsCommand command_queue[COMMAND_QUEUE_SIZE];
+atomic_int command_head = 0;
+atomic_int command_tail = 0;
+atomic_bool physics_running = false;
+pthread_t physics_thread;
+
+bool send_command(CommandType type, double x, double y, double vx, double vy) {
+    int head = atomic_load_explicit(&command_head, memory_order_relaxed);
+    int next = (head + 1) % COMMAND_QUEUE_SIZE;
+    if (next == atomic_load_explicit(&command_tail, memory_order_acquire)) {
+        log_message(LOG_WARN, TOPIC_GENERAL, "WARNING: Input queue full, event dropped\n");
+        return false;
+    }
+    
+    PhysicsCommand *command = &command_queue[head];
+    command->type = type;
+    command->x = x;
+    command->y = y;
+    command->vx = vx;
+    command->vy = vy;
+    atomic_store_explicit(&command_head, next, memory_order_release);
+    return true;
+}
+
+void apply_command(const PhysicsCommand *command) {
+    switch (command->type) {
+    case COMMAND_ADD_BODY:
+        add_body_with_velocity((int)command->x, (int)command->y, 500, command->vx, command->vy);
+        break;
+    case COMMAND_DELETE_AT:
+        if (delete_body_at((int)command->x, (int)command->y) == -1) {
+            log_message(LOG_INFO, TOPIC_GENERAL, "No body found at (%d, %d)\n", (int)command->x, (int)command->y);
+        }
+        break;
+    case COMMAND_RESET:
+        init_bodies();
+        simulation_paused = false;
+        warning_shown = false;
+        log_message(LOG_INFO, TOPIC_GENERAL, "Simulation reset!\n");
+        break;
+    case COMMAND_TOGGLE_PAUSE:
+        simulation_paused = !simulation_paused;
+        log_message(LOG_INFO, TOPIC_GENERAL, "Simulation %s\n", simulation_paused ? "PAUSED" : "RESUMED");
+        break;
+    case COMMAND_TOGGLE_FORCE:
+        if (force_backend == FORCE_DIRECT) force_backend = FORCE_BARNES_HUT;
+        else if (force_backend == FORCE_BARNES_HUT) force_backend = FORCE_FMM;
+        else if (force_backend == FORCE_FMM && gpu_ready) force_backend = FORCE_GPU;
+        else force_backend = FORCE_DIRECT;
+        forces_current = false;
+        log_message(LOG_INFO, TOPIC_GENERAL, "Force solver: %s\n", force_backend_name());
+        break;
+    case COMMAND_ADJUST_THETA:
+        bh_theta = fmax(0, bh_theta + command->x);
+        forces_current = false;
+        log_message(LOG_INFO, TOPIC_GENERAL, "Barnes-Hut opening angle: %.2f\n", bh_theta);
+        break;
+    case COMMAND_RESIZE:
+        window_width = (int)command->x;
+        window_height = (int)command->y;
+        break;
+    case COMMAND_SAVE:
+        save_checkpoint(checkpoint_target());
+        break;
+    case COMMAND_LOAD: {
+        // The checkpoint's area replaces the window's only until the next resize
+        int width = window_width, height = window_height;
+        if (load_checkpoint(checkpoint_target())) {
+            window_width = width;
+            window_height = height;
+        }
+        break;
+    }
+    }
+}
+
+bool drain_commands() {
+    bool applied = false;
+    int tail = atomic_load_explicit(&command_tail, memory_order_relaxed);
+    while (tail != atomic_load_explicit(&command_head, memory_order_acquire)) {
+        apply_command(&command_queue[tail]);
+        tail = (tail + 1) % COMMAND_QUEUE_SIZE;
+        atomic_store_explicit(&command_tail, tail, memory_order_release);
+        applied = true;
+    }
+    return applied;
+}
+
+// Fixed-timestep loop: real time is accumulated and paid out in whole
+// time_step steps at physics_rate per second (or flat out when it is 0),
+// independently of how fast frames are drawn
+void *physics_thread_main(void *arg) {
+    profile_thread = 1;
+    double step_interval = physics_rate > 0 ? 1.0 / physics_rate : 0;
+    double last = now_seconds();
+    double last_publish = 0;
+    double accumulator = 0;
+    bool dirty = true;
+    
+    while (atomic_load(&physics_running)) {
+        if (drain_commands()) dirty = true;
+        
+        double now = now_seconds();
+        accumulator += now - last;
+        last = now;
+        
+        int steps = 0;
+        if (simulation_paused) {
+            accumulator = 0;
+        } else if (step_interval == 0) {
+            if (try_step_simulation()) steps++;
+        } else {
+            while (accumulator >= step_interval && steps < MAX_SUBSTEPS_PER_TICK) {
+                if (!try_step_simulation()) break;
+                accumulator -= step_interval;
+                steps++;
+            }
+            // Too far behind to catch up: drop the backlog rather than spiral
+            if (accumulator >= step_interval * MAX_SUBSTEPS_PER_TICK) accumulator = 0;
+        }
+        if (steps > 0) dirty = true;
+        
+        if (dirty && (simulation_paused || now - last_publish >= SNAPSHOT_INTERVAL)) {
+            publish_snapshot();
+            last_publish = now;
+            dirty = false;
+        }
+        
+        if (steps == 0) {
+            double wait = simulation_paused ? PAUSED_POLL_INTERVAL : fmin(step_interval - accumulator, 0.001);
+            if (wait > 0) usleep((useconds_t)(wait * 1e6));
+        }
+    }
+    return NULL;
+}
+
+void start_physics_thread() {
+    publish_snapshot();
+    atomic_store(&physics_running, true);
+    if (pthread_create(&physics_thread, NULL, physics_thread_main, NULL) != 0) {
+        printf("ERROR: Could not start the physics thread\n");
+        exit(1);
+    }
+}
+
+void stop_physics_thread() {
+    atomic_store(&physics_running, false);
+    pthread_join(physics_thread, NULL);
+}
+
+#ifndef NO_SDL
+void draw_circle(SDL_Renderer *renderer, int cx, int cy, int radius) {
+    for (int dy = -radius; dy <= radius; dy++) {
+        for (int dx = -radius; dx <= radius; dx++) {
+            if (dx * dx + dy * dy <= radius * radius) {
+                SDL_RenderDrawPoint(renderer, cx + dx, cy + dy);
+            }
+        }
+    }
+}
+
+void draw_glowing_circle(SDL_Renderer *renderer, int cx, int cy, int radius, Uint8 r, Uint8 g, Uint8 b) {
+    for (int glow = 3; glow > 0; glow--) {
+        int glow_radius = radius + glow * 3;
+        Uint8 alpha = 30 / glow;
+        SDL_SetRenderDrawColor(renderer, r, g, b, alpha);
+        
+        for (int angle = 0; angle < 360; angle += 5) {
+            double rad = angle * M_PI / 180.0;
+            int x = cx + (int)(glow_radius * cos(rad));
+            int y = cy + (int)(glow_radius * sin(rad));
+            
+            for (int dy = -2; dy <= 2; dy++) {
+                for (int dx = -2; dx <= 2; dx++) {
+                    if (dx * dx + dy * dy <= 4) {
+                        SDL_RenderDrawPoint(renderer, x + dx, y + dy);
+                    }
+                }
+            }
+        }
+    }
+    
+    for (int layer = radius; layer > 0; layer--) {
+        float brightness = 1.0 + (radius - layer) * 0.3 / radius;
+        Uint8 bright_r = (Uint8)fmin(255, r * brightness);
+        Uint8 bright_g = (Uint8)fmin(255, g * brightness);
+        Uint8 bright_b = (Uint8)fmin(255, b * brightness);
+        
+        SDL_SetRenderDrawColor(renderer, bright_r, bright_g, bright_b, 255);
+        draw_circle(renderer, cx, cy, layer);
+    }
+}
+
+// Camera and level of detail. Screen = (world - camera) * zoom. Each frame
+// build_view() culls the snapshot against the window and sorts the visible
+// bodies into tiers by on-screen radius: full glow (with trail), a plain
+// disk, or a single pixel. Pixel-tier bodies are binned into SPLAT_CELL
+// cells, and a cell holding SPLAT_MIN_COUNT or more becomes one density
+// splat, so the draw cost follows the covered pixels rather than N.
+typedef struct {
+    double x, y, zoom;
+} Camera;
+Camera camera = {0, 0, 1};
+
+typedef enum { TIER_GLOW, TIER_DISK, TIER_SPLAT } ViewTier;
+// Positions are whole screen pixels, as the sprite quads are laid out. A
+// splat (a lone pixel is a splat of size 1) is a square of `radius` pixels
+// whose top-left corner is (x, y).
+typedef struct {
+    float x, y, trail_x, trail_y, radius;
+    Uint8 r, g, b, a;
+    Uint8 tier, moving, padding[2];
+} ViewItem;
+typedef struct {
+    int count, r, g, b;
+} SplatCell;
+ViewItem *view_items = NULL, *view_points = NULL;
+// Frame-arena scratch, valid until the end of the frame that built it
+SplatCell *splat_cells = NULL;
+int view_count = 0, view_visible = 0, view_total = 0;
+
+double screen_to_world_x(int x) {
+    return camera.x + x / camera.zoom;
+}
+
+double screen_to_world_y(int y) {
+    return camera.y + y / camera.zoom;
+}
+
+// Keeps the world point under (x, y) in place
+void zoom_camera(int x, int y, double factor) {
+    double world_x = screen_to_world_x(x), world_y = screen_to_world_y(y);
+    camera.zoom = fmin(CAMERA_MAX_ZOOM, fmax(CAMERA_MIN_ZOOM, camera.zoom * factor));
+    camera.x = world_x - x / camera.zoom;
+    camera.y = world_y - y / camera.zoom;
+}
+
+ViewTier view_tier(double radius) {
+    if (radius >= LOD_GLOW_RADIUS) return TIER_GLOW;
+    if (radius >= LOD_DISK_RADIUS) return TIER_DISK;
+    return TIER_SPLAT;
+}
+
+void build_view(const Snapshot *snap, int width, int height) {
+    view_items = arena_alloc(&frame_arena, snap->count * sizeof(ViewItem));
+    view_points = arena_alloc(&frame_arena, snap->count * sizeof(ViewItem));
+    int cells_x = width / SPLAT_CELL + 1, cells_y = height / SPLAT_CELL + 1;
+    splat_cells = arena_alloc(&frame_arena, (size_t)cells_x * cells_y * sizeof(SplatCell));
+    memset(splat_cells, 0, (size_t)cells_x * cells_y * sizeof(SplatCell));
+    
+    int count = 0, points = 0;
+    view_visible = 0;
+    for (int i = 0; i < snap->count; i++) {
+        double sx = (snap->x[i] - camera.x) * camera.zoom;
+        double sy = (snap->y[i] - camera.y) * camera.zoom;
+        double radius = snap->radius[i] * camera.zoom;
+        ViewTier tier = view_tier(radius);
+        bool moving = tier == TIER_GLOW && (snap->vx[i] != 0 || snap->vy[i] != 0);
+        // Past the largest sprite the glow is drawn scaled up, margin and all
+        double extent = tier == TIER_GLOW ? radius + GLOW_MARGIN * fmax(1, radius / MAX_RADIUS) + 1 : radius + 1;
+        double tx = sx, ty = sy;
+        if (moving) {
+            tx = (snap->x[i] - snap->vx[i] * 5 - camera.x) * camera.zoom;
+            ty = (snap->y[i] - snap->vy[i] * 5 - camera.y) * camera.zoom;
+        }
+        // Written so that NaN positions are culled too
+        if (!(fmax(sx + extent, tx) >= 0 && fmin(sx - extent, tx) <= width &&
+              fmax(sy + extent, ty) >= 0 && fmin(sy - extent, ty) <= height)) continue;
+        
+        ViewItem item = {(float)(int)sx, (float)(int)sy, (float)(int)tx, (float)(int)ty, (float)radius,
+                         snap->r[i], snap->g[i], snap->b[i], 255, tier, moving, {0, 0}};
+        if (tier != TIER_SPLAT) {
+            view_items[count++] = item;
+            view_visible++;
+            continue;
+        }
+        if (sx < 0 || sy < 0 || sx >= width || sy >= height) continue;
+        SplatCell *cell = &splat_cells[(int)sy / SPLAT_CELL * cells_x + (int)sx / SPLAT_CELL];
+        cell->count++;
+        cell->r += item.r;
+        cell->g += item.g;
+        cell->b += item.b;
+        item.radius = 1;
+        view_points[points++] = item;
+        view_visible++;
+    }
+    
+    for (int k = 0; k < points; k++) {
+        const ViewItem *point = &view_points[k];
+        if (splat_cells[(int)point->y / SPLAT_CELL * cells_x + (int)point->x / SPLAT_CELL].count < SPLAT_MIN_COUNT) {
+            view_items[count++] = *point;
+        }
+    }
+    // There are at most points / SPLAT_MIN_COUNT splats, so they fit too
+    for (int c = 0; c < cells_x * cells_y; c++) {
+        const SplatCell *cell = &splat_cells[c];
+        if (cell->count < SPLAT_MIN_COUNT) continue;
+        view_items[count++] = (ViewItem){(float)(c % cells_x * SPLAT_CELL), (float)(c / cells_x * SPLAT_CELL), 0, 0, SPLAT_CELL,
+                                         (Uint8)(cell->r / cell->count), (Uint8)(cell->g / cell->count), (Uint8)(cell->b / cell->count),
+                                         (Uint8)fmin(255, SPLAT_ALPHA * cell->count), TIER_SPLAT, false, {0, 0}};
+    }
+    view_count = count;
+    view_total = snap->count;
+}
+
+// Density view: every body in the window adds one count and its colour to
+// the pixel it falls in, and the histogram is tone-mapped on a log scale
+// into a streaming texture. Cost is O(N + pixels), whatever the radii.
+Uint32 *density_bins = NULL;
+Uint8 *density_pixels = NULL;
+SDL_Texture *density_texture = NULL;
+int density_texture_width = 0, density_texture_height = 0;
+
+void build_density(const Snapshot *snap, int width, int height) {
+    int pixels = width * height;
+    density_bins = arena_alloc(&frame_arena, 4 * (size_t)pixels * sizeof(Uint32));
+    density_pixels = arena_alloc(&frame_arena, 4 * (size_t)pixels * sizeof(Uint8));
+    memset(density_bins, 0, (size_t)pixels * 4 * sizeof(Uint32));
+    
+    Uint32 peak = 0;
+    view_visible = 0;
+    for (int i = 0; i < snap->count; i++) {
+        double sx = (snap->x[i] - camera.x) * camera.zoom;
+        double sy = (snap->y[i] - camera.y) * camera.zoom;
+        if (!(sx >= 0 && sy >= 0 && sx < width && sy < height)) continue;
+        Uint32 *bin = &density_bins[4 * ((int)sy * width + (int)sx)];
+        bin[1] += snap->r[i];
+        bin[2] += snap->g[i];
+        bin[3] += snap->b[i];
+        if (++bin[0] > peak) peak = bin[0];
+        view_visible++;
+    }
+    
+    float scale = peak > 0 ? 255 / log1pf((float)peak) : 0;
+    for (int p = 0; p < pixels; p++) {
+        const Uint32 *bin = &density_bins[4 * p];
+        Uint8 *pixel = &density_pixels[4 * p];
+        if (bin[0] == 0) {
+            memset(pixel, 0, 4);
+            continue;
+        }
+        pixel[0] = (Uint8)(bin[1] / bin[0]);
+        pixel[1] = (Uint8)(bin[2] / bin[0]);
+        pixel[2] = (Uint8)(bin[3] / bin[0]);
+        // A lone body still shows against the background
+        pixel[3] = (Uint8)fmaxf(32, log1pf((float)bin[0]) * scale);
+    }
+    view_count = 0;
+    view_total = snap->count;
+}
+
+void render_density(SDL_Renderer *renderer, const Snapshot *snap, int width, int height) {
+    if (width <= 0 || height <= 0) return;
+    if (!density_texture || density_texture_width != width || density_texture_height != height) {
+        if (density_texture) SDL_DestroyTexture(density_texture);
+        density_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STREAMING, width, height);
+        if (!density_texture) {
+            log_message(LOG_WARN, TOPIC_GENERAL, "Cannot create the density texture: %s\n", SDL_GetError());
+            density_view = false;
+            return;
+        }
+        SDL_SetTextureBlendMode(density_texture, SDL_BLENDMODE_BLEND);
+        density_texture_width = width;
+        density_texture_height = height;
+    }
+    build_density(snap, width, height);
+    SDL_UpdateTexture(density_texture, NULL, density_pixels, 4 * width);
+    SDL_RenderCopy(renderer, density_texture, NULL, NULL);
+}
+
+// The gradient depends only on the window height, so it is rendered once into
+// a one pixel wide texture and stretched across the window with one copy
+SDL_Texture *background_texture = NULL;
+
+Uint8 background_channel(int y, int height, int peak) {
+    float ratio = (float)y / height;
+    return (Uint8)(peak * (1 - ratio));
+}
+
+void rebuild_background(SDL_Renderer *renderer, int height) {
+    if (background_texture) SDL_DestroyTexture(background_texture);
+    background_texture = NULL;
+    
+    Uint8 *pixels = malloc((size_t)height * 4);
+    if (!pixels) return;
+    for (int y = 0; y < height; y++) {
+        pixels[4 * y] = background_channel(y, height, 5);
+        pixels[4 * y + 1] = background_channel(y, height, 10);
+        pixels[4 * y + 2] = background_channel(y, height, 25);
+        pixels[4 * y + 3] = 255;
+    }
+    
+    background_texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STATIC, 1, height);
+    if (background_texture) {
+        SDL_UpdateTexture(background_texture, NULL, pixels, 4);
+        SDL_SetTextureBlendMode(background_texture, SDL_BLENDMODE_NONE);
+    }
+    free(pixels);
+}
+
+void draw_background(SDL_Renderer *renderer, int width, int height) {
+    if (background_texture) {
+        SDL_RenderCopy(renderer, background_texture, NULL, NULL);
+        return;
+    }
+    
+    for (int y = 0; y < height; y++) {
+        SDL_SetRenderDrawColor(renderer, background_channel(y, height, 5), background_channel(y, height, 10),
+                               background_channel(y, height, 25), 255);
+        SDL_RenderDrawLine(renderer, 0, y, width, y);
+    }
+}
+
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+// Every integer radius gets a pre-rendered glow sprite and disk sprite in one
+// atlas texture, reproducing draw_glowing_circle() pixel for pixel. Bodies
+// are then drawn as colour-modulated quads in a single SDL_RenderGeometry call.
+typedef struct {
+    float u0, v0, u1, v1;
+    int half;
+} SpriteRect;
+#define MAX_SPRITE_RADIUS ((int)MAX_RADIUS)
+SDL_Texture *sprite_atlas = NULL;
+SpriteRect glow_sprites[MAX_SPRITE_RADIUS + 1];
+SpriteRect disk_sprites[MAX_SPRITE_RADIUS + 1];
+SDL_FPoint white_texel;
+SDL_Vertex *sprite_vertices = NULL;
+int *sprite_indices = NULL;
+int sprite_index_capacity = 0;
+int sprite_indices_filled = 0;
+
+typedef struct {
+    int x, y, row_height, width, height;
+} AtlasCursor;
+
+// Shelf packing: sprites go left to right, wrapping to a new row when full
+void atlas_place(AtlasCursor *cursor, int size, int *x, int *y) {
+    if (cursor->x + size > cursor->width) {
+        cursor->x = 0;
+        cursor->y += cursor->row_height;
+        cursor->row_height = 0;
+    }
+    *x = cursor->x;
+    *y = cursor->y;
+    cursor->x += size;
+    if (size > cursor->row_height) cursor->row_height = size;
+    if (cursor->y + cursor->row_height > cursor->height) cursor->height = cursor->y + cursor->row_height;
+}
+
+void set_sprite_rect(SpriteRect *rect, int x, int y, int size, int atlas_height) {
+    rect->u0 = (float)x / SPRITE_ATLAS_WIDTH;
+    rect->v0 = (float)y / atlas_height;
+    rect->u1 = (float)(x + size) / SPRITE_ATLAS_WIDTH;
+    rect->v1 = (float)(y + size) / atlas_height;
+    rect->half = size / 2;
+}
+
+// Replays the 72 dots per ring of draw_glowing_circle and stacks their alpha
+void paint_glow_sprite(Uint8 *pixels, int ox, int oy, int radius) {
+    int half = radius + GLOW_MARGIN;
+    int size = 2 * half + 1;
+    int *hits = calloc((size_t)size * size, sizeof(int));
+    float *transmit = malloc((size_t)size * size * sizeof(float));
+    if (!hits || !transmit) {
+        free(hits);
+        free(transmit);
+        return;
+    }
+    for (int k = 0; k < size * size; k++) transmit[k] = 1.0f;
+    
+    for (int glow = 3; glow > 0; glow--) {
+        int glow_radius = radius + glow * 3;
+        float alpha = (30 / glow) / 255.0f;
+        memset(hits, 0, (size_t)size * size * sizeof(int));
+        
+        for (int angle = 0; angle < 360; angle += 5) {
+            double rad = angle * M_PI / 180.0;
+            int x = half + (int)(glow_radius * cos(rad));
+            int y = half + (int)(glow_radius * sin(rad));
+            for (int dy = -2; dy <= 2; dy++) {
+                for (int dx = -2; dx <= 2; dx++) {
+                    if (dx * dx + dy * dy <= 4) hits[(y + dy) * size + (x + dx)]++;
+                }
+            }
+        }
+        for (int k = 0; k < size * size; k++) {
+            if (hits[k]) transmit[k] *= powf(1 - alpha, (float)hits[k]);
+        }
+    }
+    
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            Uint8 *texel = pixels + 4 * ((size_t)(oy + y) * SPRITE_ATLAS_WIDTH + ox + x);
+            texel[0] = texel[1] = texel[2] = 255;
+            texel[3] = (Uint8)lroundf((1 - transmit[y * size + x]) * 255);
+        }
+    }
+    free(hits);
+    free(transmit);
+}
+
+// Disk texels store brightness / 1.3 so that a vertex colour of 1.3 * rgb
+// restores the brighter core of draw_glowing_circle()
+void paint_disk_sprite(Uint8 *pixels, int ox, int oy, int radius) {
+    int size = 2 * radius + 1;
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            int dx = x - radius, dy = y - radius;
+            int dist_sq = dx * dx + dy * dy;
+            Uint8 *texel = pixels + 4 * ((size_t)(oy + y) * SPRITE_ATLAS_WIDTH + ox + x);
+            if (dist_sq > radius * radius) {
+                texel[0] = texel[1] = texel[2] = texel[3] = 0;
+                continue;
+            }
+            
+            int layer = (int)ceil(sqrt((double)dist_sq));
+            if (layer < 1) layer = 1;
+            float brightness = 1.0 + (radius - layer) * 0.3 / radius;
+            texel[0] = texel[1] = texel[2] = (Uint8)fmin(255, 255 * brightness / 1.3);
+            texel[3] = 255;
+        }
+    }
+}
+
+// Lays out and paints every sprite, filling in the sprite rects; the caller
+// frees the RGBA pixels
+Uint8 *paint_sprite_atlas(int *height) {
+    int glow_x[MAX_SPRITE_RADIUS + 1], glow_y[MAX_SPRITE_RADIUS + 1];
+    int disk_x[MAX_SPRITE_RADIUS + 1], disk_y[MAX_SPRITE_RADIUS + 1];
+    int white_x, white_y;
+    AtlasCursor cursor = {0, 0, 0, SPRITE_ATLAS_WIDTH, 0};
+    
+    for (int r = 1; r <= MAX_SPRITE_RADIUS; r++) {
+        atlas_place(&cursor, 2 * (r + GLOW_MARGIN) + 1, &glow_x[r], &glow_y[r]);
+        atlas_place(&cursor, 2 * r + 1, &disk_x[r], &disk_y[r]);
+    }
+    atlas_place(&cursor, 3, &white_x, &white_y);
+    int atlas_height = cursor.height;
+    
+    Uint8 *pixels = calloc((size_t)SPRITE_ATLAS_WIDTH * atlas_height, 4);
+    if (!pixels) return NULL;
+    
+    for (int r = 1; r <= MAX_SPRITE_RADIUS; r++) {
+        paint_glow_sprite(pixels, glow_x[r], glow_y[r], r);
+        paint_disk_sprite(pixels, disk_x[r], disk_y[r], r);
+        set_sprite_rect(&glow_sprites[r], glow_x[r], glow_y[r], 2 * (r + GLOW_MARGIN) + 1, atlas_height);
+        set_sprite_rect(&disk_sprites[r], disk_x[r], disk_y[r], 2 * r + 1, atlas_height);
+    }
+    memset(pixels + 4 * ((size_t)white_y * SPRITE_ATLAS_WIDTH + white_x), 255, 12);
+    memset(pixels + 4 * ((size_t)(white_y + 1) * SPRITE_ATLAS_WIDTH + white_x), 255, 12);
+    memset(pixels + 4 * ((size_t)(white_y + 2) * SPRITE_ATLAS_WIDTH + white_x), 255, 12);
+    white_texel.x = (white_x + 1.5f) / SPRITE_ATLAS_WIDTH;
+    white_texel.y = (white_y + 1.5f) / atlas_height;
+    *height = atlas_height;
+    return pixels;
+}
+
+bool start_gl_bodies(const Uint8 *pixels, int atlas_height);
+
+bool create_sprite_atlas(SDL_Renderer *renderer) {
+    int atlas_height;
+    Uint8 *pixels = paint_sprite_atlas(&atlas_height);
+    if (!pixels) return false;
+    
+    SDL_RendererInfo info;
+    bool have_info = SDL_GetRendererInfo(renderer, &info) == 0;
+    // The GL path draws from its own copy of the atlas
+    if (gl_bodies_requested) {
+        if (!have_info || strcmp(info.name, "opengl") != 0) {
+            log_message(LOG_WARN, TOPIC_GENERAL, "The SDL opengl render driver is unavailable; using sprite batches\n");
+        } else if (start_gl_bodies(pixels, atlas_height)) {
+            free(pixels);
+            return true;
+        }
+    }
+    
+    if (have_info && info.max_texture_height > 0 &&
+        (atlas_height > info.max_texture_height || SPRITE_ATLAS_WIDTH > info.max_texture_width)) {
+        log_message(LOG_WARN, TOPIC_GENERAL, "Sprite atlas (%dx%d) exceeds the renderer's texture limit; using per-pixel drawing\n",
+                                             SPRITE_ATLAS_WIDTH, atlas_height);
+        free(pixels);
+        return false;
+    }
+    
+    sprite_atlas = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STATIC,
+                                     SPRITE_ATLAS_WIDTH, atlas_height);
+    if (sprite_atlas) {
+        SDL_UpdateTexture(sprite_atlas, NULL, pixels, SPRITE_ATLAS_WIDTH * 4);
+        SDL_SetTextureBlendMode(sprite_atlas, SDL_BLENDMODE_BLEND);
+    } else {
+        log_message(LOG_WARN, TOPIC_GENERAL, "Sprite atlas creation failed: %s\n", SDL_GetError());
+    }
+    free(pixels);
+    return sprite_atlas != NULL;
+}
+
+void stop_gl_bodies();
+
+void destroy_sprite_atlas() {
+    if (sprite_atlas) SDL_DestroyTexture(sprite_atlas);
+    sprite_atlas = NULL;
+    stop_gl_bodies();
+}
+
+void push_quad(SDL_Vertex *v, float x0, float y0, float x1, float y1, const SpriteRect *rect, SDL_Color color) {
+    v[0].position = (SDL_FPoint){x0, y0};
+    v[1].position = (SDL_FPoint){x1, y0};
+    v[2].position = (SDL_FPoint){x1, y1};
+    v[3].position = (SDL_FPoint){x0, y1};
+    v[0].tex_coord = (SDL_FPoint){rect->u0, rect->v0};
+    v[1].tex_coord = (SDL_FPoint){rect->u1, rect->v0};
+    v[2].tex_coord = (SDL_FPoint){rect->u1, rect->v1};
+    v[3].tex_coord = (SDL_FPoint){rect->u0, rect->v1};
+    for (int k = 0; k < 4; k++) v[k].color = color;
+}
+
+// A one pixel wide quad sampling the white texel stands in for SDL_RenderDrawLine
+void push_line(SDL_Vertex *v, float x0, float y0, float x1, float y1, SDL_Color color) {
+    float dx = x1 - x0, dy = y1 - y0;
+    float length = sqrtf(dx * dx + dy * dy);
+    float nx = length > 0 ? -dy / length * 0.5f : 0.5f;
+    float ny = length > 0 ? dx / length * 0.5f : 0;
+    v[0].position = (SDL_FPoint){x0 + nx, y0 + ny};
+    v[1].position = (SDL_FPoint){x1 + nx, y1 + ny};
+    v[2].position = (SDL_FPoint){x1 - nx, y1 - ny};
+    v[3].position = (SDL_FPoint){x0 - nx, y0 - ny};
+    for (int k = 0; k < 4; k++) {
+        v[k].tex_coord = white_texel;
+        v[k].color = color;
+    }
+}
+
+void render_bodies_batched(SDL_Renderer *renderer) {
+    int max_quads = 3 * view_count;
+    sprite_vertices = arena_alloc(&frame_arena, 4 * (size_t)max_quads * sizeof(SDL_Vertex));
+    sprite_indices = grow_buffer(sprite_indices, &sprite_index_capacity, 6 * max_quads, sizeof(int));
+    // The index pattern never changes, so it is only extended when the buffer grows
+    for (int q = sprite_indices_filled; q < sprite_index_capacity / 6; q++) {
+        int *index = sprite_indices + 6 * q;
+        index[0] = 4 * q;
+        index[1] = 4 * q + 1;
+        index[2] = 4 * q + 2;
+        index[3] = 4 * q + 2;
+        index[4] = 4 * q + 3;
+        index[5] = 4 * q;
+    }
+    sprite_indices_filled = sprite_index_capacity / 6;
+    
+    const SpriteRect white = {white_texel.x, white_texel.y, white_texel.x, white_texel.y, 0};
+    int quads = 0;
+    for (int k = 0; k < view_count; k++) {
+        const ViewItem *item = &view_items[k];
+        float cx = item->x, cy = item->y;
+        if (item->tier == TIER_SPLAT) {
+            SDL_Color color = {item->r, item->g, item->b, item->a};
+            push_quad(sprite_vertices + 4 * quads++, cx, cy, cx + item->radius, cy + item->radius, &white, color);
+            continue;
+        }
+        int radius = (int)item->radius;
+        if (radius < 1) radius = 1;
+        if (radius > MAX_SPRITE_RADIUS) radius = MAX_SPRITE_RADIUS;
+        // Bodies larger on screen than the largest sprite stretch it to their true radius
+        float scale = item->radius > MAX_SPRITE_RADIUS ? item->radius / MAX_SPRITE_RADIUS : 1;
+        
+        if (item->tier == TIER_GLOW) {
+            const SpriteRect *glow = &glow_sprites[radius];
+            SDL_Color glow_color = {item->r, item->g, item->b, 255};
+            float half = glow->half * scale;
+            push_quad(sprite_vertices + 4 * quads++, cx - half, cy - half,
+                      cx + half + scale, cy + half + scale, glow, glow_color);
+        }
+        
+        const SpriteRect *disk = &disk_sprites[radius];
+        SDL_Color disk_color = {(Uint8)fmin(255, item->r * 1.3), (Uint8)fmin(255, item->g * 1.3),
+                                (Uint8)fmin(255, item->b * 1.3), 255};
+        float half = disk->half * scale;
+        push_quad(sprite_vertices + 4 * quads++, cx - half, cy - half,
+                  cx + half + scale, cy + half + scale, disk, disk_color);
+        
+        if (item->moving) {
+            SDL_Color trail_color = {item->r, item->g, item->b, 128};
+            push_line(sprite_vertices + 4 * quads++, cx + 0.5f, cy + 0.5f, item->trail_x + 0.5f, item->trail_y + 0.5f,
+                      trail_color);
+        }
+    }
+    
+    if (quads > 0) {
+        SDL_RenderGeometry(renderer, sprite_atlas, sprite_vertices, 4 * quads, sprite_indices, 6 * quads);
+    }
+}
+
+// Instanced OpenGL path for the SDL "opengl" render driver. Each frame the
+// view list is copied as-is into a streamed buffer, one instance per item,
+// and a single glDrawArraysInstanced call expands every instance into the
+// same glow, disk, trail and splat quads as render_bodies_batched(), sampling
+// the same atlas, so both paths give the same picture. SDL's own GL state is
+// saved and restored around the draw, so the rest of the frame stays on
+// SDL_Renderer.
+#ifdef USE_GL
+
+static const char *gl_bodies_vertex_shader =
+    "#version 330\n"
+    "layout(location = 0) in vec2 position;\n"
+    "layout(location = 1) in vec2 trail;\n"
+    "layout(location = 2) in float radius;\n"
+    "layout(location = 3) in vec4 colour;\n"
+    "layout(location = 4) in uvec2 flags;\n"
+    "uniform vec2 screen;\n"
+    "uniform vec4 glow_rects[101];\n"
+    "uniform vec4 disk_rects[101];\n"
+    "uniform vec2 white_texel;\n"
+    "uniform float glow_margin;\n"
+    "out vec2 uv;\n"
+    "out vec4 tint;\n"
+    "const vec2 corners[6] = vec2[](vec2(0, 0), vec2(1, 0), vec2(1, 1), vec2(1, 1), vec2(0, 1), vec2(0, 0));\n"
+    "void main() {\n"
+    "    int layer = gl_VertexID / 6;\n"
+    "    vec2 corner = corners[gl_VertexID % 6];\n"
+    "    uint tier = flags.x;\n"
+    "    int r = clamp(int(radius), 1, 100);\n"
+    "    float scale = max(radius / 100.0, 1.0);\n"
+    "    vec2 centre = position;\n"
+    "    vec2 p = vec2(-1.0);\n"
+    "    uv = white_texel;\n"
+    "    tint = vec4(0.0);\n"
+    "    if (tier == 2u) {\n"
+    "        if (layer == 0) {\n"
+    "            p = position + corner * radius;\n"
+    "            tint = colour;\n"
+    "        }\n"
+    "    } else if (layer == 1 || (layer == 0 && tier == 0u)) {\n"
+    "        float half_size = (float(r) + (layer == 0 ? glow_margin : 0.0)) * scale;\n"
+    "        vec4 rect = layer == 0 ? glow_rects[r] : disk_rects[r];\n"
+    "        p = centre - half_size + corner * (2.0 * half_size + scale);\n"
+    "        uv = mix(rect.xy, rect.zw, corner);\n"
+    "        tint = vec4(layer == 0 ? colour.rgb : min(floor(colour.rgb * 255.0 * 1.3), 255.0) / 255.0, 1.0);\n"
+    "    } else if (layer == 2 && flags.y != 0u) {\n"
+    "        vec2 a = centre + 0.5;\n"
+    "        vec2 b = trail + 0.5;\n"
+    "        vec2 d = b - a;\n"
+    "        float len = length(d);\n"
+    "        vec2 n = len > 0.0 ? vec2(-d.y, d.x) / len * 0.5 : vec2(0.5, 0.0);\n"
+    "        p = mix(a, b, corner.x) + n * (1.0 - 2.0 * corner.y);\n"
+    "        tint = vec4(colour.rgb, 128.0 / 255.0);\n"
+    "    }\n"
+    "    gl_Position = vec4(p.x / screen.x * 2.0 - 1.0, 1.0 - p.y / screen.y * 2.0, 0.0, 1.0);\n"
+    "}\n";
+
+static const char *gl_bodies_fragment_shader =
+    "#version 330\n"
+    "uniform sampler2D atlas;\n"
+    "in vec2 uv;\n"
+    "in vec4 tint;\n"
+    "out vec4 fragment;\n"
+    "void main() {\n"
+    "    fragment = texture(atlas, uv) * tint;\n"
+    "}\n";
+
+GLuint gl_bodies_program = 0, gl_bodies_vao = 0, gl_bodies_buffer = 0, gl_atlas_texture = 0;
+GLint gl_screen_uniform = -1;
+GLsizeiptr gl_bodies_buffer_size = 0;
+
+GLuint compile_gl_shader(GLenum type, const char *source) {
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+    GLint ok = 0;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+    if (!ok) {
+        char info[1024] = "";
+        glGetShaderInfoLog(shader, sizeof(info), NULL, info);
+        log_message(LOG_WARN, TOPIC_GENERAL, "Body shader failed to compile: %s\n", info);
+        glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+
+// Needs the caller's GL 3.3 context current; false leaves the SDL paths in charge
+bool start_gl_bodies(const Uint8 *pixels, int atlas_height) {
+    const char *version = (const char *)glGetString(GL_VERSION);
+    int major = 0, minor = 0;
+    if (!version || sscanf(version, "%d.%d", &major, &minor) != 2 || major * 10 + minor < 33) {
+        log_message(LOG_WARN, TOPIC_GENERAL, "OpenGL 3.3 is needed for instanced bodies (have %s)\n", version ? version : "none");
+        return false;
+    }
+    GLuint vertex = compile_gl_shader(GL_VERTEX_SHADER, gl_bodies_vertex_shader);
+    GLuint fragment = compile_gl_shader(GL_FRAGMENT_SHADER, gl_bodies_fragment_shader);
+    GLint linked = 0;
+    if (vertex && fragment) {
+        gl_bodies_program = glCreateProgram();
+        glAttachShader(gl_bodies_program, vertex);
+        glAttachShader(gl_bodies_program, fragment);
+        glLinkProgram(gl_bodies_program);
+        glGetProgramiv(gl_bodies_program, GL_LINK_STATUS, &linked);
+    }
+    if (vertex) glDeleteShader(vertex);
+    if (fragment) glDeleteShader(fragment);
+    if (!linked) {
+        if (gl_bodies_program) glDeleteProgram(gl_bodies_program);
+        gl_bodies_program = 0;
+        return false;
+    }
+    
+    GLint previous_program, previous_vao, previous_buffer, previous_texture, previous_active;
+    glGetIntegerv(GL_CURRENT_PROGRAM, &previous_program);
+    glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &previous_vao);
+    glGetIntegerv(GL_ARRAY_BUFFER_BINDING, &previous_buffer);
+    glGetIntegerv(GL_ACTIVE_TEXTURE, &previous_active);
+    glActiveTexture(GL_TEXTURE0);
+    glGetIntegerv(GL_TEXTURE_BINDING_2D, &previous_texture);
+    
+    glUseProgram(gl_bodies_program);
+    float glow_rects[4 * (MAX_SPRITE_RADIUS + 1)] = {0}, disk_rects[4 * (MAX_SPRITE_RADIUS + 1)] = {0};
+    for (int r = 1; r <= MAX_SPRITE_RADIUS; r++) {
+        memcpy(&glow_rects[4 * r], &glow_sprites[r], 4 * sizeof(float));
+        memcpy(&disk_rects[4 * r], &disk_sprites[r], 4 * sizeof(float));
+    }
+    glUniform4fv(glGetUniformLocation(gl_bodies_program, "glow_rects"), MAX_SPRITE_RADIUS + 1, glow_rects);
+    glUniform4fv(glGetUniformLocation(gl_bodies_program, "disk_rects"), MAX_SPRITE_RADIUS + 1, disk_rects);
+    glUniform2f(glGetUniformLocation(gl_bodies_program, "white_texel"), white_texel.x, white_texel.y);
+    glUniform1f(glGetUniformLocation(gl_bodies_program, "glow_margin"), GLOW_MARGIN);
+    glUniform1i(glGetUniformLocation(gl_bodies_program, "atlas"), 0);
+    gl_screen_uniform = glGetUniformLocation(gl_bodies_program, "screen");
+    
+    glGenTextures(1, &gl_atlas_texture);
+    glBindTexture(GL_TEXTURE_2D, gl_atlas_texture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, SPRITE_ATLAS_WIDTH, atlas_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    
+    glGenVertexArrays(1, &gl_bodies_vao);
+    glGenBuffers(1, &gl_bodies_buffer);
+    glBindVertexArray(gl_bodies_vao);
+    glBindBuffer(GL_ARRAY_BUFFER, gl_bodies_buffer);
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    glEnableVertexAttribArray(2);
+    glEnableVertexAttribArray(3);
+    glEnableVertexAttribArray(4);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(ViewItem), (void *)offsetof(ViewItem, x));
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(ViewItem), (void *)offsetof(ViewItem, trail_x));
+    glVertexAttribPointer(2, 1, GL_FLOAT, GL_FALSE, sizeof(ViewItem), (void *)offsetof(ViewItem, radius));
+    glVertexAttribPointer(3, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(ViewItem), (void *)offsetof(ViewItem, r));
+    glVertexAttribIPointer(4, 2, GL_UNSIGNED_BYTE, sizeof(ViewItem), (void *)offsetof(ViewItem, tier));
+    for (int k = 0; k < 5; k++) glVertexAttribDivisor(k, 1);
+    
+    glBindVertexArray(previous_vao);
+    glBindBuffer(GL_ARRAY_BUFFER, previous_buffer);
+    glBindTexture(GL_TEXTURE_2D, previous_texture);
+    glActiveTexture(previous_active);
+    glUseProgram(previous_program);
+    gl_bodies_ready = true;
+    log_message(LOG_INFO, TOPIC_GENERAL, "Instanced OpenGL body rendering (%s)\n", version);
+    return true;
+}
+
+void stop_gl_bodies() {
+    if (!gl_bodies_ready) return;
+    glDeleteBuffers(1, &gl_bodies_buffer);
+    glDeleteVertexArrays(1, &gl_bodies_vao);
+    glDeleteTextures(1, &gl_atlas_texture);
+    glDeleteProgram(gl_bodies_program);
+    gl_bodies_buffer_size = 0;
+    gl_bodies_ready = false;
+}
+
+// Draws the view list into the current GL framebuffer of the given size
+void draw_gl_bodies(int width, int height) {
+    if (view_count == 0) return;
+    GLint previous_program, previous_vao, previous_buffer, previous_texture, previous_active;
+    GLint src_rgb, dst_rgb, src_alpha, dst_alpha;
+    GLboolean blend = glIsEnabled(GL_BLEND);
+    glGetIntegerv(GL_CURRENT_PROGRAM, &previous_program);
+    glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &previous_vao);
+    glGetIntegerv(GL_ARRAY_BUFFER_BINDING, &previous_buffer);
+    glGetIntegerv(GL_ACTIVE_TEXTURE, &previous_active);
+    glGetIntegerv(GL_BLEND_SRC_RGB, &src_rgb);
+    glGetIntegerv(GL_BLEND_DST_RGB, &dst_rgb);
+    glGetIntegerv(GL_BLEND_SRC_ALPHA, &src_alpha);
+    glGetIntegerv(GL_BLEND_DST_ALPHA, &dst_alpha);
+    glActiveTexture(GL_TEXTURE0);
+    glGetIntegerv(GL_TEXTURE_BINDING_2D, &previous_texture);
+    
+    glBindVertexArray(gl_bodies_vao);
+    glBindBuffer(GL_ARRAY_BUFFER, gl_bodies_buffer);
+    GLsizeiptr size = (GLsizeiptr)view_count * sizeof(ViewItem);
+    if (size > gl_bodies_buffer_size) gl_bodies_buffer_size = size;
+    // Orphaning the buffer lets the driver hand out fresh memory while the
+    // previous frame may still be drawing from the old one
+    glBufferData(GL_ARRAY_BUFFER, gl_bodies_buffer_size, NULL, GL_STREAM_DRAW);
+    ViewItem *instances = glMapBufferRange(GL_ARRAY_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    if (instances) {
+        memcpy(instances, view_items, size);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+        
+        glUseProgram(gl_bodies_program);
+        glUniform2f(gl_screen_uniform, (float)width, (float)height);
+        glBindTexture(GL_TEXTURE_2D, gl_atlas_texture);
+        glEnable(GL_BLEND);
+        glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+        glDrawArraysInstanced(GL_TRIANGLES, 0, 18, view_count);
+    }
+    
+    glBlendFuncSeparate(src_rgb, dst_rgb, src_alpha, dst_alpha);
+    if (!blend) glDisable(GL_BLEND);
+    glBindTexture(GL_TEXTURE_2D, previous_texture);
+    glActiveTexture(previous_active);
+    glBindVertexArray(previous_vao);
+    glBindBuffer(GL_ARRAY_BUFFER, previous_buffer);
+    glUseProgram(previous_program);
+}
+
+void render_bodies_gl(SDL_Renderer *renderer, int width, int height) {
+    SDL_RenderFlush(renderer);
+    draw_gl_bodies(width, height);
+}
+#else
+bool start_gl_bodies(const Uint8 *pixels, int atlas_height) { return false; }
+void stop_gl_bodies() {}
+void render_bodies_gl(SDL_Renderer *renderer, int width, int height) {}
+#endif
+#else
+SDL_Texture *sprite_atlas = NULL;
+bool create_sprite_atlas(SDL_Renderer *renderer) { return false; }
+void destroy_sprite_atlas() {}
+void render_bodies_batched(SDL_Renderer *renderer) {}
+void render_bodies_gl(SDL_Renderer *renderer, int width, int height) {}
+#endif
+
+void render_bodies(SDL_Renderer *renderer, const Snapshot *snap) {
+    int width, height;
+    SDL_GetRendererOutputSize(renderer, &width, &height);
+    if (density_view) {
+        render_density(renderer, snap, width, height);
+        return;
+    }
+    build_view(snap, width, height);
+    
+    SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+    if (gl_bodies_ready) {
+        render_bodies_gl(renderer, width, height);
+        return;
+    }
+    if (sprite_atlas) {
+        render_bodies_batched(renderer);
+        return;
+    }
+    
+    for (int k = 0; k < view_count; k++) {
+        const ViewItem *item = &view_items[k];
+        int x = (int)item->x, y = (int)item->y;
+        if (item->tier == TIER_SPLAT) {
+            SDL_SetRenderDrawColor(renderer, item->r, item->g, item->b, item->a);
+            SDL_Rect splat = {x, y, (int)item->radius, (int)item->radius};
+            SDL_RenderFillRect(renderer, &splat);
+        } else if (item->tier == TIER_DISK) {
+            SDL_SetRenderDrawColor(renderer, (Uint8)fmin(255, item->r * 1.3), (Uint8)fmin(255, item->g * 1.3),
+                                   (Uint8)fmin(255, item->b * 1.3), 255);
+            draw_circle(renderer, x, y, (int)item->radius);
+        } else {
+            draw_glowing_circle(renderer, x, y, (int)item->radius, item->r, item->g, item->b);
+        }
+        
+        if (item->moving) {
+            SDL_SetRenderDrawColor(renderer, item->r, item->g, item->b, 128);
+            SDL_RenderDrawLine(renderer, x, y, (int)item->trail_x, (int)item->trail_y);
+        }
+    }
+}
+
+// 3x5 bitmap font for the overlay: one octal digit per row, high bit on the left
+int glyph_bits(char c) {
+    static const int digits[10] = {
+        075557, 026227, 071747, 071717, 055711, 074717, 074757, 071111, 075757, 075717
+    };
+    static const int letters[26] = {
+        025755, 065656, 034443, 065556, 074647, 074644, 034553, 055755, 072227, 011152,
+        055655, 044447, 057755, 065555, 025552, 065644, 025563, 065655, 034216, 072222,
+        055557, 055552, 055775, 055255, 055222, 071247
+    };
+    if (c >= '0' && c <= '9') return digits[c - '0'];
+    if (c >= 'a' && c <= 'z') return letters[c - 'a'];
+    if (c >= 'A' && c <= 'Z') return letters[c - 'A'];
+    if (c == '.') return 000002;
+    if (c == ':') return 002020;
+    if (c == '-') return 000700;
+    if (c == '/') return 011244;
+    return 0;
+}
+
+void draw_text(SDL_Renderer *renderer, int x, int y, int scale, const char *text) {
+    SDL_Rect pixels[15];
+    for (; *text; text++, x += 4 * scale) {
+        int bits = glyph_bits(*text);
+        int n = 0;
+        for (int row = 0; row < 5; row++) {
+            for (int col = 0; col < 3; col++) {
+                if (bits & (1 << (3 * (4 - row) + 2 - col))) {
+                    pixels[n++] = (SDL_Rect){x + col * scale, y + row * scale, scale, scale};
+                }
+            }
         }
+        if (n > 0) SDL_RenderFillRects(renderer, pixels, n);
     }
 }
 
-void update_bodies() {
-    for (int i = 0; i < body_count; i++) {
-        if (!bodies[i].active) continue;
-        
-        bodies[i].vx += bodies[i].ax * TIME_STEP;
-        bodies[i].vy += bodies[i].ay * TIME_STEP;
-        
-        double speed = sqrt(bodies[i].vx * bodies[i].vx + bodies[i].vy * bodies[i].vy);
-        if (speed > MAX_VELOCITY) {
-            double scale = MAX_VELOCITY / speed;
-            bodies[i].vx *= scale;
-            bodies[i].vy *= scale;
-            if (!warning_shown) {
-                printf("WARNING: Body %d velocity clamped (was %.2f, now %.2f)\n", i, speed, MAX_VELOCITY);
-                warning_shown = true;
-            }
+// Heap allocations by any thread over the last frame
+long long frame_allocations = 0;
+
+// One row per zone with p50 and p99 in milliseconds; the bar shows p50
+// against a 60 Hz frame, with a tick at p99
+void draw_profile_overlay(SDL_Renderer *renderer) {
+    const int scale = 2, line = 8 * scale, width = 300;
+    SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
+    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 170);
+    SDL_Rect panel = {8, 8, width, line * (ZONE_COUNT + 4) + 8};
+    SDL_RenderFillRect(renderer, &panel);
+    
+    char text[64];
+    snprintf(text, sizeof(text), "%-12s %6s %6s", "ZONE", "P50", "P99 MS");
+    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+    draw_text(renderer, 14, 14, scale, text);
+    for (int zone = 0; zone < ZONE_COUNT; zone++) {
+        int y = 14 + line * (zone + 1);
+        double p50 = 0, p99 = 0;
+        if (zone_percentiles(zone, &p50, &p99)) {
+            snprintf(text, sizeof(text), "%-12s %6.2f %6.2f", zone_names[zone], p50, p99);
+        } else {
+            snprintf(text, sizeof(text), "%-12s      -      -", zone_names[zone]);
         }
+        SDL_SetRenderDrawColor(renderer, zone < ZONE_BACKGROUND ? 140 : 255, 220, zone < ZONE_BACKGROUND ? 255 : 140, 255);
+        draw_text(renderer, 14, y, scale, text);
         
-        bodies[i].x += bodies[i].vx * TIME_STEP;
-        bodies[i].y += bodies[i].vy * TIME_STEP;
-        
-        if (bodies[i].x < 0) bodies[i].x = window_width;
-        if (bodies[i].x > window_width) bodies[i].x = 0;
-        if (bodies[i].y < 0) bodies[i].y = window_height;
-        if (bodies[i].y > window_height) bodies[i].y = 0;
+        const double frame_ms = 1000.0 / 60.0;
+        int bar_x = 14 + 28 * 4 * scale;
+        int bar_width = width - (bar_x - 8) - 6;
+        SDL_Rect bar = {bar_x, y, (int)(bar_width * fmin(1.0, p50 / frame_ms)), 5 * scale};
+        SDL_RenderFillRect(renderer, &bar);
+        SDL_Rect tick = {bar_x + (int)(bar_width * fmin(1.0, p99 / frame_ms)), y, 1, 5 * scale};
+        SDL_RenderFillRect(renderer, &tick);
     }
+    
+    snprintf(text, sizeof(text), "VIEW %d/%d ZOOM %.2f", view_visible, view_total, camera.zoom);
+    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
+    draw_text(renderer, 14, 14 + line * (ZONE_COUNT + 1), scale, text);
+    snprintf(text, sizeof(text), "ARENA STEP %.1f FRAME %.1f MB", step_arena_peak / 1e6, frame_arena.high_water / 1e6);
+    draw_text(renderer, 14, 14 + line * (ZONE_COUNT + 2), scale, text);
+    snprintf(text, sizeof(text), "ALLOCS STEP %lld FRAME %lld", (long long)step_allocations, frame_allocations);
+    draw_text(renderer, 14, 14 + line * (ZONE_COUNT + 3), scale, text);
 }
 
-bool check_stability() {
-    int active_count = 0;
-    for (int i = 0; i < body_count; i++) {
-        if (!bodies[i].active) continue;
-        active_count++;
-        
-        if (isnan(bodies[i].x) || isnan(bodies[i].y) || 
-            isnan(bodies[i].vx) || isnan(bodies[i].vy) ||
-            isinf(bodies[i].x) || isinf(bodies[i].y) ||
-            isinf(bodies[i].vx) || isinf(bodies[i].vy)) {
-            printf("ERROR: Body %d has invalid values! Pausing simulation.\n", i);
-            printf("  Position: (%.2f, %.2f), Velocity: (%.2f, %.2f)\n", 
-                   bodies[i].x, bodies[i].y, bodies[i].vx, bodies[i].vy);
-            return false;
+#endif
+
+// Benchmark suite: seeded scenarios timed stage by stage, reported as JSON.
+// Scenarios draw from their own Philox stream so they match across platforms.
+typedef enum {
+    SCENARIO_UNIFORM_DISK,
+    SCENARIO_PLUMMER,
+    SCENARIO_COLLIDING_CLUSTERS,
+    SCENARIO_COUNT
+} BenchScenario;
+const char *scenario_names[SCENARIO_COUNT] = {"uniform_disk", "plummer", "colliding_clusters"};
+RandomStream bench_random;
+BodyArrays bench_backup;
+int bench_backup_capacity = 0;
+int bench_backup_count = 0;
+
+double bench_uniform() {
+    return random_uniform(&bench_random);
+}
+
+void bench_add_body(double x, double y, double vx, double vy) {
+    double mass = 100 + 900 * bench_uniform();
+    Uint8 r = (Uint8)(256 * bench_uniform());
+    Uint8 g = (Uint8)(256 * bench_uniform());
+    Uint8 b = (Uint8)(256 * bench_uniform());
+    append_body(x, y, vx, vy, mass, r, g, b);
+}
+
+// Projected Plummer sphere with scale a, truncated at 10a, moving at (vx, vy)
+void bench_add_plummer(int n, double cx, double cy, double a, double vx, double vy) {
+    for (int k = 0; k < n; k++) {
+        double r;
+        do {
+            double u = fmax(bench_uniform(), 1e-12);
+            r = a / sqrt(pow(u, -2.0 / 3.0) - 1);
+        } while (r > 10 * a);
+        double cos_theta = 2 * bench_uniform() - 1;
+        double sin_theta = sqrt(1 - cos_theta * cos_theta);
+        double phi = 2 * M_PI * bench_uniform();
+        bench_add_body(cx + r * sin_theta * cos(phi), cy + r * sin_theta * sin(phi), vx, vy);
+    }
+}
+
+// The area grows with N so the collision density stays comparable
+void generate_scenario(BenchScenario scenario, int n) {
+    bench_random = random_stream(seed_given ? random_seed : 12345, (uint64_t)scenario << 32 | (uint32_t)n);
+    body_count = 0;
+    dead_body_count = 0;
+    step_count = 0;
+    reserve_bodies(n);
+    
+    double scale = 12 * sqrt((double)n);
+    if (scenario == SCENARIO_UNIFORM_DISK) {
+        double total_mass = 550.0 * n;
+        window_width = window_height = (int)(2 * scale + 100);
+        for (int k = 0; k < n; k++) {
+            double r = scale * sqrt(bench_uniform());
+            double phi = 2 * M_PI * bench_uniform();
+            double v = r > 0 ? sqrt(gravity_constant * total_mass * r) / scale : 0;
+            bench_add_body(window_width / 2 + r * cos(phi), window_height / 2 + r * sin(phi),
+                           -v * sin(phi), v * cos(phi));
         }
-        
-        if (bodies[i].x < -1000 || bodies[i].x > window_width + 1000 ||
-            bodies[i].y < -1000 || bodies[i].y > window_height + 1000) {
-            printf("WARNING: Body %d is far from visible area at (%.1f, %.1f)\n", 
-                   i, bodies[i].x, bodies[i].y);
+    } else if (scenario == SCENARIO_PLUMMER) {
+        double a = scale / 2;
+        window_width = window_height = (int)(20 * a + 100);
+        bench_add_plummer(n, window_width / 2, window_height / 2, a, 0, 0);
+    } else {
+        double a = scale / 3;
+        window_width = (int)(40 * a + 100);
+        window_height = (int)(20 * a + 100);
+        bench_add_plummer(n / 2, window_width / 2 - 3 * a, window_height / 2, a, 1, 0);
+        bench_add_plummer(n - n / 2, window_width / 2 + 3 * a, window_height / 2, a, -1, 0);
+    }
+}
+
+void bench_save_state() {
+    if (bench_backup_capacity < body_count) {
+        int capacity = bench_backup_capacity;
+#define GROW_BACKUP_FIELD(type, name) { \
+            capacity = bench_backup_capacity; \
+            bench_backup.name = grow_buffer(bench_backup.name, &capacity, body_count, sizeof(type)); \
         }
+        BODY_FIELDS(GROW_BACKUP_FIELD)
+#undef GROW_BACKUP_FIELD
+        bench_backup_capacity = capacity;
     }
+#define SAVE_BODY_FIELD(type, name) memcpy(bench_backup.name, bodies.name, body_count * sizeof(type));
+    BODY_FIELDS(SAVE_BODY_FIELD)
+#undef SAVE_BODY_FIELD
+    bench_backup_count = body_count;
+}
+
+void bench_restore_state() {
+    body_count = bench_backup_count;
+    dead_body_count = 0;
+#define RESTORE_BODY_FIELD(type, name) memcpy(bodies.name, bench_backup.name, body_count * sizeof(type));
+    BODY_FIELDS(RESTORE_BODY_FIELD)
+#undef RESTORE_BODY_FIELD
+}
+
+// Mean seconds per call after one warm-up call; state is restored around
+// every call so that mutating stages always see the generated scenario
+// The untimed first call also sizes the step arena for the timed ones
+double bench_time(void (*stage)()) {
+    bench_restore_state();
+    stage();
+    arena_reset(&step_arena);
     
-    return true;
+    double total = 0;
+    int repeats = 0;
+    while (repeats < BENCH_MAX_REPEATS && (repeats == 0 || total < BENCH_MIN_SECONDS)) {
+        bench_restore_state();
+        double start = now_seconds();
+        stage();
+        total += now_seconds() - start;
+        arena_reset(&step_arena);
+        repeats++;
+    }
+    return total / repeats;
 }
 
-void handle_collisions() {
+// A full build, so the figure stays comparable from run to run
+void bench_tree_stage() {
+    quad_rebuild_pending = true;
+    calculate_forces_barnes_hut();
+}
+
+// The state is restored before every call, so drifting half a step back and
+// forth moves each body one step from where the last call left the tree
+void bench_tree_refit_stage() {
+    static double direction = 0.5;
+    direction = -direction;
     for (int i = 0; i < body_count; i++) {
-        if (!bodies[i].active) continue;
-        
-        for (int j = i + 1; j < body_count; j++) {
-            if (!bodies[j].active) continue;
-            
-            double dx = bodies[j].x - bodies[i].x;
-            double dy = bodies[j].y - bodies[i].y;
-            double dist = sqrt(dx * dx + dy * dy);
-            
-            if (dist < bodies[i].radius + bodies[j].radius) {
-                Body *larger, *smaller;
-                int larger_idx, smaller_idx;
-                
-                if (bodies[i].mass >= bodies[j].mass) {
-                    larger = &bodies[i];
-                    smaller = &bodies[j];
-                    larger_idx = i;
-                    smaller_idx = j;
-                } else {
-                    larger = &bodies[j];
-                    smaller = &bodies[i];
-                    larger_idx = j;
-                    smaller_idx = i;
-                }
-                
-                double total_mass = larger->mass + smaller->mass;
-                
-                if (total_mass > MAX_MASS) {
-                    printf("WARNING: Mass limit reached! Body %d mass clamped at %.1f (would be %.1f)\n", 
-                           larger_idx, MAX_MASS, total_mass);
-                    total_mass = MAX_MASS;
-                    simulation_paused = true;
-                }
-                
-                larger->vx = (larger->mass * larger->vx + smaller->mass * smaller->vx) / total_mass;
-                larger->vy = (larger->mass * larger->vy + smaller->mass * smaller->vy) / total_mass;
-                
-                larger->mass = total_mass;
-                larger->radius = BODY_RADIUS + (larger->mass / 200);
-                
-                if (larger->radius > MAX_RADIUS) {
-                    larger->radius = MAX_RADIUS;
-                }
-                
-                double ratio = smaller->mass / total_mass;
-                larger->r = (Uint8)(larger->r * (1 - ratio) + smaller->r * ratio);
-                larger->g = (Uint8)(larger->g * (1 - ratio) + smaller->g * ratio);
-                larger->b = (Uint8)(larger->b * (1 - ratio) + smaller->b * ratio);
-                
-                smaller->active = false;
-                
-                printf("Collision! Body %d absorbed body %d (new mass: %.1f)\n", 
-                       larger_idx, smaller_idx, larger->mass);
-            }
-        }
+        bodies.x[i] += bodies.vx[i] * time_step * direction;
+        bodies.y[i] += bodies.vy[i] * time_step * direction;
     }
+    calculate_forces_barnes_hut();
 }
 
-void draw_circle(SDL_Renderer *renderer, int cx, int cy, int radius) {
-    for (int dy = -radius; dy <= radius; dy++) {
-        for (int dx = -radius; dx <= radius; dx++) {
-            if (dx * dx + dy * dy <= radius * radius) {
-                SDL_RenderDrawPoint(renderer, cx + dx, cy + dy);
-            }
-        }
+void bench_update_stage() {
+    update_bodies();
+}
+
+// The direct sum with its contact list, and the collision stage that uses it
+void bench_fused_stage() {
+    calculate_forces_with_contacts();
+    handle_collisions();
+}
+
+#ifndef NO_SDL
+SDL_Renderer *bench_renderer = NULL;
+
+void bench_render_stage() {
+    capture_snapshot(&snapshots[0]);
+    draw_background(bench_renderer, INITIAL_WINDOW_WIDTH, INITIAL_WINDOW_HEIGHT);
+    render_bodies(bench_renderer, &snapshots[0]);
+    SDL_RenderPresent(bench_renderer);
+    arena_reset(&frame_arena);
+}
+
+void bench_density_stage() {
+    bool saved = density_view;
+    density_view = true;
+    bench_render_stage();
+    density_view = saved;
+}
+#endif
+
+void write_stage_json(FILE *out, const char *name, double seconds, double interactions, bool *first) {
+    fprintf(out, "%s\n        \"%s\": {\"ms\": %.6f", *first ? "" : ",", name, seconds * 1000);
+    if (interactions > 0) {
+        fprintf(out, ", \"interactions\": %.0f, \"ns_per_interaction\": %.6f", interactions, seconds * 1e9 / interactions);
     }
+    fprintf(out, "}");
+    *first = false;
 }
 
-void draw_glowing_circle(SDL_Renderer *renderer, int cx, int cy, int radius, Uint8 r, Uint8 g, Uint8 b) {
-    for (int glow = 3; glow > 0; glow--) {
-        int glow_radius = radius + glow * 3;
-        Uint8 alpha = 30 / glow;
-        SDL_SetRenderDrawColor(renderer, r, g, b, alpha);
+int run_benchmark() {
+    FILE *out = benchmark_output ? fopen(benchmark_output, "w") : stdout;
+    if (!out) {
+        log_message(LOG_ERROR, TOPIC_GENERAL, "ERROR: Cannot write '%s'\n", benchmark_output);
+        return 1;
+    }
+    // Only errors may share stdout with the JSON
+    log_flush();
+    LogLevel saved_level = log_level;
+    if (log_level < LOG_ERROR) log_level = LOG_ERROR;
+    
+#ifndef NO_SDL
+    SDL_Window *window = NULL;
+    if (SDL_Init(SDL_INIT_VIDEO) == 0) {
+        window = SDL_CreateWindow("Gravity Simulator benchmark", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+                                  INITIAL_WINDOW_WIDTH, INITIAL_WINDOW_HEIGHT, SDL_WINDOW_HIDDEN);
+        if (window) bench_renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+        if (bench_renderer) {
+            create_sprite_atlas(bench_renderer);
+            rebuild_background(bench_renderer, INITIAL_WINDOW_HEIGHT);
+        }
+    }
+#endif
+    
+    fprintf(out, "{\n  \"threads\": %d,\n  \"direct_kernel\": \"%s\",\n  \"precision\": \"%s\",\n  \"theta\": %.3f,\n  \"results\": [",
+            thread_count, direct_kernel_name, FORCE_PRECISION_NAME, bh_theta);
+    
+    bool first_result = true;
+    const char *cursor = benchmark_sizes;
+    while (*cursor) {
+        int n = atoi(cursor);
+        while (*cursor && *cursor != ',') cursor++;
+        if (*cursor == ',') cursor++;
+        if (n <= 0) continue;
         
-        for (int angle = 0; angle < 360; angle += 5) {
-            double rad = angle * M_PI / 180.0;
-            int x = cx + (int)(glow_radius * cos(rad));
-            int y = cy + (int)(glow_radius * sin(rad));
+        for (int scenario = 0; scenario < SCENARIO_COUNT; scenario++) {
+            generate_scenario(scenario, n);
+            bench_save_state();
+            double pair_count = (double)body_count * (body_count - 1);
             
-            for (int dy = -2; dy <= 2; dy++) {
-                for (int dx = -2; dx <= 2; dx++) {
-                    if (dx * dx + dy * dy <= 4) {
-                        SDL_RenderDrawPoint(renderer, x + dx, y + dy);
-                    }
+            fprintf(out, "%s\n    {\n      \"scenario\": \"%s\",\n      \"bodies\": %d,\n      \"stages\": {",
+                    first_result ? "" : ",", scenario_names[scenario], body_count);
+            first_result = false;
+            bool first_stage = true;
+            
+            double pairwise = 0, rows = 0, fused = 0;
+            if (body_count <= BENCH_DIRECT_LIMIT) {
+                pairwise = bench_time(calculate_forces_pairwise);
+                write_stage_json(out, "forces_pairwise", pairwise, pair_count, &first_stage);
+                if (direct_kernel) {
+                    rows = bench_time(calculate_forces_rows);
+                    char name[64];
+                    snprintf(name, sizeof(name), "forces_%s", direct_kernel_name);
+                    write_stage_json(out, name, rows, pair_count, &first_stage);
                 }
+                fused = bench_time(bench_fused_stage);
+                write_stage_json(out, "forces_and_collisions_fused", fused, pair_count, &first_stage);
+            }
+            double tree = bench_time(bench_tree_stage);
+            write_stage_json(out, "forces_tree", tree, (double)count_tree_interactions(), &first_stage);
+            double refit = bench_time(bench_tree_refit_stage);
+            write_stage_json(out, "forces_tree_refit", refit, (double)count_tree_interactions(), &first_stage);
+            double fmm = bench_time(calculate_forces_fmm);
+            write_stage_json(out, "forces_fmm", fmm, (double)count_fmm_interactions(), &first_stage);
+            
+            // Accuracy of the two approximate backends against the direct sum
+            double tree_error = -1, fmm_error = -1, max_err;
+            if (body_count <= BENCH_DIRECT_LIMIT) {
+                bench_restore_state();
+                compute_reference_forces();
+                bench_tree_stage();
+                tree_error = force_error(&max_err);
+                calculate_forces_fmm();
+                fmm_error = force_error(&max_err);
+            }
+            
+            // Integration and collisions run on the tree accelerations
+            calculate_forces_barnes_hut();
+            bench_save_state();
+            double update = bench_time(bench_update_stage);
+            write_stage_json(out, "update", update, 0, &first_stage);
+            double collisions = bench_time(handle_collisions);
+            write_stage_json(out, "collisions", collisions, 0, &first_stage);
+            int pairs = collision_pairs.count;
+#ifndef NO_SDL
+            if (bench_renderer) {
+                write_stage_json(out, "render", bench_time(bench_render_stage), 0, &first_stage);
+                write_stage_json(out, "render_density", bench_time(bench_density_stage), 0, &first_stage);
             }
+#endif
+            
+            fprintf(out, "\n      },\n      \"steps_per_second\": {");
+            double rest = update + collisions;
+            fprintf(out, "\"tree\": %.3f, \"tree_refit\": %.3f, \"fmm\": %.3f", 1 / (tree + rest), 1 / (refit + rest), 1 / (fmm + rest));
+            if (pairwise > 0) fprintf(out, ", \"pairwise\": %.3f", 1 / (pairwise + rest));
+            if (rows > 0) fprintf(out, ", \"%s\": %.3f", direct_kernel_name, 1 / (rows + rest));
+            if (fused > 0) fprintf(out, ", \"fused\": %.3f", 1 / (fused + update));
+            fprintf(out, "},\n      \"collision_pairs\": %d", pairs);
+            if (tree_error >= 0) {
+                fprintf(out, ",\n      \"rms_force_error\": {\"tree\": %.3e, \"fmm\": %.3e}", tree_error, fmm_error);
+            }
+            fprintf(out, "\n    }");
+            fflush(out);
         }
     }
+    fprintf(out, "\n  ]\n}\n");
     
-    for (int layer = radius; layer > 0; layer--) {
-        float brightness = 1.0 + (radius - layer) * 0.3 / radius;
-        Uint8 bright_r = (Uint8)fmin(255, r * brightness);
-        Uint8 bright_g = (Uint8)fmin(255, g * brightness);
-        Uint8 bright_b = (Uint8)fmin(255, b * brightness);
-        
-        SDL_SetRenderDrawColor(renderer, bright_r, bright_g, bright_b, 255);
-        draw_circle(renderer, cx, cy, layer);
-    }
+#ifndef NO_SDL
+    if (density_texture) SDL_DestroyTexture(density_texture);
+    density_texture = NULL;
+    if (bench_renderer) SDL_DestroyRenderer(bench_renderer);
+    if (window) SDL_DestroyWindow(window);
+    SDL_Quit();
+#endif
+    if (out != stdout) fclose(out);
+    log_level = saved_level;
+    return 0;
 }
 
-void render_bodies(SDL_Renderer *renderer) {
-    SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
-    
-    for (int i = 0; i < body_count; i++) {
-        if (!bodies[i].active) continue;
-        
-        draw_glowing_circle(renderer, (int)bodies[i].x, (int)bodies[i].y, 
-                           (int)bodies[i].radius, bodies[i].r, bodies[i].g, bodies[i].b);
-        
-        if (bodies[i].vx != 0 || bodies[i].vy != 0) {
-            SDL_SetRenderDrawColor(renderer, bodies[i].r, bodies[i].g, bodies[i].b, 128);
-            int trail_x = (int)(bodies[i].x - bodies[i].vx * 5);
-            int trail_y = (int)(bodies[i].y - bodies[i].vy * 5);
-            SDL_RenderDrawLine(renderer, (int)bodies[i].x, (int)bodies[i].y, trail_x, trail_y);
-        }
+void print_usage(const char *program) {
+    printf("Usage: %s [--force direct|tree|fmm] [--kernel NAME] [--threads N] [--theta VALUE] [--force-error] [--config FILE]\n", program);
+    printf("  --force direct   O(N^2) pairwise summation (default)\n");
+    printf("  --force tree     Barnes-Hut quadtree, O(N log N)\n");
+    printf("  --force fmm      Fast multipole method, O(N)\n");
+    printf("  --force gpu      Direct sum in an OpenGL compute shader, if built with USE_GL\n");
+    printf("  --kernel NAME    Direct-sum kernel: auto (default), pairwise, scalar, avx2, avx512, neon\n");
+    printf("  --threads N      Worker threads for the force pass (default: all cores)\n");
+    printf("  --theta VALUE    Barnes-Hut and FMM opening angle (default %.2f, 0 = exact; FMM caps it at %.1f)\n",
+           BH_DEFAULT_THETA, FMM_MAX_THETA);
+    printf("  --fmm-order P    FMM expansion order, 1 to %d (default %d); higher is more accurate\n", FMM_MAX_ORDER, FMM_DEFAULT_ORDER);
+    printf("  --force-error    Periodically report force error against double-precision direct summation\n");
+    printf("  --integrator I   euler (default), leapfrog, verlet, yoshida4 or block\n");
+    printf("  --block-eta VALUE  Block step accuracy factor (default %.2f, smaller = finer)\n", BLOCK_ETA);
+    printf("  --dt VALUE       Time step (default %.2f)\n", TIME_STEP);
+    printf("  --gravity VALUE  Gravitational constant G (default %.2f)\n", DEFAULT_GRAVITY);
+    printf("  --softening VALUE  Softening length (default %.2f)\n", DEFAULT_SOFTENING);
+    printf("  --max-velocity VALUE  Speed bodies are clamped to (default %.0f)\n", DEFAULT_MAX_VELOCITY);
+    printf("  --max-mass VALUE  Largest mass a merge can produce (default %.0f)\n", DEFAULT_MAX_MASS);
+    printf("  --max-bodies N   Most bodies the simulation will hold (default %d)\n", MAX_BODIES);
+    printf("  --config FILE    Read options from FILE, one 'name value' per line without the dashes ('#' comments);\n");
+    printf("                   options apply in order, so later ones win\n");
+    printf("  --headless       Run without a window for --steps steps, then exit; under mpirun (USE_MPI builds)\n");
+    printf("                   each rank steps one domain, writing its own --output, checkpoint and trajectory\n");
+    printf("  --steps N        Steps to run in headless mode (default %d)\n", DEFAULT_HEADLESS_STEPS);
+    printf("  --seed N         Seed for the random initial conditions\n");
+    printf("  --bodies N       Number of generated bodies (default %d)\n", DEFAULT_INITIAL_BODIES);
+    printf("  --distribution D random (default), uniform, plummer or kuzmin; all but random start in equilibrium\n");
+    printf("  --ic FILE        Load bodies from FILE ('x y vx vy mass [r g b]' per line, or a checkpoint)\n");
+    printf("  --output FILE    Write the final state in the --ic format (headless)\n");
+    printf("  --trajectory FILE  Stream positions and velocities every --trajectory-every steps\n");
+    printf("  --trajectory-every N  Steps between trajectory frames (default %d)\n", DEFAULT_TRAJECTORY_INTERVAL);
+    printf("  --trajectory-format F  f64 (default), f32 or fixed\n");
+    printf("  --trajectory-compress C  none (default), lz4 or zstd, if built with USE_LZ4 / USE_ZSTD\n");
+    printf("  --checkpoint FILE  Binary checkpoint for S/L, --checkpoint-every and the end of a headless run\n");
+    printf("  --checkpoint-every N  Save the checkpoint every N steps (default 0, never)\n");
+    printf("  --size WxH       Simulation area (default %dx%d)\n", INITIAL_WINDOW_WIDTH, INITIAL_WINDOW_HEIGHT);
+    printf("  --bench          Time each pipeline stage on seeded scenarios and print JSON\n");
+    printf("  --bench-sizes LIST  Comma-separated body counts (default %s)\n", benchmark_sizes);
+    printf("  --bench-output FILE Write the benchmark JSON to FILE\n");
+    printf("  --log-level L    debug, info (default), warn, error or quiet\n");
+    printf("  --trace FILE     Record stage timings as Chrome trace-event JSON\n");
+    printf("  --physics-rate HZ  Interactive physics steps per second (default %.0f, 0 = unthrottled)\n", PHYSICS_RATE);
+    printf("  --renderer R     sdl (default) or gl: instanced OpenGL bodies, if built with USE_GL\n");
+    printf("  --view V         bodies (default) or density: a log-scaled histogram of body positions\n");
+}
+
+bool load_config(const char *path, const char *program);
+
+// Numeric option values are taken whole, so "10 extra" or "abc" is an error rather than 10 or 0
+bool parse_int_option(const char *option, const char *text, int *value) {
+    char *end;
+    errno = 0;
+    long parsed = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || errno == ERANGE || parsed < INT_MIN || parsed > INT_MAX) {
+        printf("Expected a whole number for %s, got '%s'\n", option, text);
+        return false;
     }
+    *value = (int)parsed;
+    return true;
 }
 
-// Add a new body at mouse position with velocity
-void add_body_with_velocity(int x, int y, int mass, double vx, double vy) {
-    if (body_count < MAX_BODIES) {
-        bodies[body_count].x = x;
-        bodies[body_count].y = y;
-        bodies[body_count].vx = vx;
-        bodies[body_count].vy = vy;
-        bodies[body_count].ax = 0;
-        bodies[body_count].ay = 0;
-        bodies[body_count].mass = mass;
-        bodies[body_count].radius = BODY_RADIUS + (mass / 200);
-        bodies[body_count].active = true;
-        bodies[body_count].r = rand() % 256;
-        bodies[body_count].g = rand() % 256;
-        bodies[body_count].b = rand() % 256;
-        body_count++;
+bool parse_double_option(const char *option, const char *text, double *value) {
+    char *end;
+    errno = 0;
+    double parsed = strtod(text, &end);
+    if (end == text || *end != '\0' || errno == ERANGE || !isfinite(parsed)) {
+        printf("Expected a number for %s, got '%s'\n", option, text);
+        return false;
     }
+    *value = parsed;
+    return true;
 }
 
-void add_body(int x, int y, int mass) {
-    add_body_with_velocity(x, y, mass, 0, 0);
+bool parse_options(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--force") == 0 && i + 1 < argc) {
+            i++;
+            force_given = true;
+            if (strcmp(argv[i], "direct") == 0) {
+                force_backend = FORCE_DIRECT;
+            } else if (strcmp(argv[i], "tree") == 0) {
+                force_backend = FORCE_BARNES_HUT;
+            } else if (strcmp(argv[i], "fmm") == 0) {
+                force_backend = FORCE_FMM;
+            } else if (strcmp(argv[i], "gpu") == 0) {
+#ifndef USE_GL
+                printf("This build has no GPU support (build with -DUSE_GL -lGL -lEGL)\n");
+                return false;
+#endif
+                force_backend = FORCE_GPU;
+            } else {
+                printf("Unknown force backend '%s'\n", argv[i]);
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--kernel") == 0 && i + 1 < argc) {
+            direct_kernel_name = argv[++i];
+        }
+        else if (strcmp(argv[i], "--distribution") == 0 && i + 1 < argc) {
+            i++;
+            int k = 0;
+            while (k < DISTRIBUTION_COUNT && strcmp(argv[i], distribution_names[k]) != 0) k++;
+            if (k == DISTRIBUTION_COUNT) {
+                printf("Unknown distribution '%s' (random, uniform, plummer or kuzmin)\n", argv[i]);
+                return false;
+            }
+            distribution = k;
+        }
+        else if (strcmp(argv[i], "--integrator") == 0 && i + 1 < argc) {
+            integrator_name = argv[++i];
+            integrator_given = true;
+        }
+        else if (strcmp(argv[i], "--block-eta") == 0 && i + 1 < argc) {
+            i++;
+            if (!parse_double_option(argv[i - 1], argv[i], &block_eta)) return false;
+            block_eta_given = true;
+            if (block_eta <= 0) {
+                printf("Block accuracy factor must be positive\n");
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--dt") == 0 && i + 1 < argc) {
+            i++;
+            if (!parse_double_option(argv[i - 1], argv[i], &time_step)) return false;
+            dt_given = true;
+            if (time_step <= 0) {
+                printf("Time step must be positive\n");
+                return false;
+            }
+        }
+        else if ((strcmp(argv[i], "--gravity") == 0 || strcmp(argv[i], "--softening") == 0) && i + 1 < argc) {
+#ifdef FIXED_PHYSICS
+            printf("This build has G and the softening fixed (built with -DFIXED_PHYSICS)\n");
+            return false;
+#else
+            bool gravity = strcmp(argv[i], "--gravity") == 0;
+            double value;
+            i++;
+            if (!parse_double_option(argv[i - 1], argv[i], &value)) return false;
+            if (value <= 0) {
+                printf("%s must be positive\n", gravity ? "Gravitational constant" : "Softening length");
+                return false;
+            }
+            if (gravity) {
+                gravity_constant = value;
+                gravity_given = true;
+            } else {
+                softening_length = value;
+                softening_given = true;
+            }
+#endif
+        }
+        else if (strcmp(argv[i], "--max-velocity") == 0 && i + 1 < argc) {
+            i++;
+            if (!parse_double_option(argv[i - 1], argv[i], &max_velocity)) return false;
+            max_velocity_given = true;
+            if (max_velocity <= 0) {
+                printf("Velocity limit must be positive\n");
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--max-mass") == 0 && i + 1 < argc) {
+            i++;
+            if (!parse_double_option(argv[i - 1], argv[i], &max_mass)) return false;
+            max_mass_given = true;
+            if (max_mass <= 0) {
+                printf("Mass limit must be positive\n");
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--max-bodies") == 0 && i + 1 < argc) {
+            i++;
+            if (!parse_int_option(argv[i - 1], argv[i], &body_limit)) return false;
+            if (body_limit < 1 || body_limit > MAX_BODIES) {
+                printf("Body limit must be between 1 and %d\n", MAX_BODIES);
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--config") == 0 && i + 1 < argc) {
+            if (!load_config(argv[++i], argv[0])) return false;
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            i++;
+            if (!parse_int_option(argv[i - 1], argv[i], &requested_threads)) return false;
+            if (requested_threads < 0 || requested_threads > MAX_THREADS) {
+                printf("Thread count must be between 0 (all cores) and %d\n", MAX_THREADS);
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--theta") == 0 && i + 1 < argc) {
+            i++;
+            if (!parse_double_option(argv[i - 1], argv[i], &bh_theta)) return false;
+            theta_given = true;
+            if (bh_theta < 0) {
+                printf("Opening angle must be non-negative\n");
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--fmm-order") == 0 && i + 1 < argc) {
+            i++;
+            if (!parse_int_option(argv[i - 1], argv[i], &fmm_order)) return false;
+            fmm_order_given = true;
+            if (fmm_order < 1 || fmm_order > FMM_MAX_ORDER) {
+                printf("FMM order must be between 1 and %d\n", FMM_MAX_ORDER);
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--force-error") == 0) {
+            report_force_error = true;
+            // Measures the tree unless the direct kernels were asked for
+            if (!force_given) force_backend = FORCE_BARNES_HUT;
+        }
+        else if (strcmp(argv[i], "--headless") == 0) {
+            headless = true;
+        }
+        else if (strcmp(argv[i], "--steps") == 0 && i + 1 < argc) {
+            i++;
+            if (!parse_int_option(argv[i - 1], argv[i], &headless_steps)) return false;
+            if (headless_steps < 0) {
+                printf("Step count must be non-negative\n");
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            i++;
+            char *end;
+            errno = 0;
+            random_seed = strtoull(argv[i], &end, 10);
+            if (end == argv[i] || *end != '\0' || errno == ERANGE || strchr(argv[i], '-')) {
+                printf("Expected a non-negative whole number for --seed, got '%s'\n", argv[i]);
+                return false;
+            }
+            seed_given = true;
+        }
+        else if (strcmp(argv[i], "--bodies") == 0 && i + 1 < argc) {
+            i++;
+            if (!parse_int_option(argv[i - 1], argv[i], &initial_body_count)) return false;
+            if (initial_body_count < 0 || initial_body_count > MAX_BODIES) {
+                printf("Body count must be between 0 and %d\n", MAX_BODIES);
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--ic") == 0 && i + 1 < argc) {
+            initial_conditions_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            output_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--trajectory") == 0 && i + 1 < argc) {
+            trajectory_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--trajectory-every") == 0 && i + 1 < argc) {
+            i++;
+            if (!parse_int_option(argv[i - 1], argv[i], &trajectory_interval)) return false;
+            if (trajectory_interval <= 0) {
+                printf("Trajectory interval must be positive\n");
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--trajectory-format") == 0 && i + 1 < argc) {
+            trajectory_format_name = argv[++i];
+        }
+        else if (strcmp(argv[i], "--trajectory-compress") == 0 && i + 1 < argc) {
+            trajectory_codec_name = argv[++i];
+        }
+        else if (strcmp(argv[i], "--bench") == 0) {
+            benchmark = true;
+        }
+        else if (strcmp(argv[i], "--bench-sizes") == 0 && i + 1 < argc) {
+            benchmark_sizes = argv[++i];
+        }
+        else if (strcmp(argv[i], "--bench-output") == 0 && i + 1 < argc) {
+            benchmark_output = argv[++i];
+        }
+        else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+            i++;
+            int level = 0;
+            while (level <= LOG_QUIET && strcmp(argv[i], log_level_names[level]) != 0) level++;
+            if (level > LOG_QUIET) {
+                printf("Unknown log level '%s'\n", argv[i]);
+                return false;
+            }
+            log_level = level;
+        }
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+            checkpoint_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--checkpoint-every") == 0 && i + 1 < argc) {
+            i++;
+            if (!parse_int_option(argv[i - 1], argv[i], &checkpoint_interval)) return false;
+            if (checkpoint_interval < 0) {
+                printf("Checkpoint interval must be non-negative\n");
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--renderer") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "gl") == 0) {
+#ifndef USE_GL
+                printf("This build has no OpenGL support (build with -DUSE_GL -lGL -lEGL)\n");
+                return false;
+#endif
+                gl_bodies_requested = true;
+            } else if (strcmp(argv[i], "sdl") != 0) {
+                printf("Unknown renderer '%s' (sdl or gl)\n", argv[i]);
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--view") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "density") == 0) {
+                density_view = true;
+            } else if (strcmp(argv[i], "bodies") != 0) {
+                printf("Unknown view '%s' (bodies or density)\n", argv[i]);
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--physics-rate") == 0 && i + 1 < argc) {
+            i++;
+            if (!parse_double_option(argv[i - 1], argv[i], &physics_rate)) return false;
+            if (physics_rate < 0) {
+                printf("Physics rate must be non-negative\n");
+                return false;
+            }
+        }
+        else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            size_given = true;
+            char extra;
+            if (sscanf(argv[++i], "%dx%d%c", &window_width, &window_height, &extra) != 2 ||
+                window_width <= 0 || window_height <= 0) {
+                printf("Expected --size WIDTHxHEIGHT\n");
+                return false;
+            }
+        }
+        else {
+            print_usage(argv[0]);
+            return false;
+        }
+    }
+    return true;
 }
 
-int delete_body_at(int x, int y) {
-    for (int i = 0; i < body_count; i++) {
-        if (!bodies[i].active) continue;
-        
-        double dx = x - bodies[i].x;
-        double dy = y - bodies[i].y;
-        double dist = sqrt(dx * dx + dy * dy);
+// A config file holds one option per line, named as on the command line but
+// without the dashes, so a sweep can keep each scenario in its own file:
+//     force tree
+//     gravity 0.8
+//     ic disk.txt
+// The values are kept for the whole run, as the options point into them
+bool load_config(const char *path, const char *program) {
+    static int depth = 0;
+    if (depth == CONFIG_MAX_DEPTH) {
+        printf("Config files nest more than %d deep at '%s'\n", CONFIG_MAX_DEPTH, path);
+        return false;
+    }
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        printf("Could not open config file '%s'\n", path);
+        return false;
+    }
+    
+    depth++;
+    char line[4096];
+    int number = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), file)) {
+        number++;
+        line[strcspn(line, "#\r\n")] = '\0';
+        char *name = line + strspn(line, " \t-");
+        if (*name == '\0') continue;
+        char *value = name + strcspn(name, " \t=");
+        if (*value) *value++ = '\0';
+        value += strspn(value, " \t=");
+        size_t length = strlen(value);
+        while (length > 0 && (value[length - 1] == ' ' || value[length - 1] == '\t')) value[--length] = '\0';
         
-        if (dist <= bodies[i].radius) {
-            bodies[i].active = false;
-            printf("Deleted body %d (mass: %.1f) at (%.0f, %.0f)\n", 
-                   i, bodies[i].mass, bodies[i].x, bodies[i].y);
-            return i;
+        char option[sizeof(line) + 2];
+        snprintf(option, sizeof(option), "--%s", name);
+        char *args[3] = {(char *)program, option, *value ? strdup(value) : NULL};
+        if (*value && !args[2]) {
+            printf("ERROR: Out of memory\n");
+            exit(1);
         }
+        ok = parse_options(*value ? 3 : 2, args);
+        if (!ok) printf("  (%s, line %d)\n", path, number);
     }
-    return -1;
+    fclose(file);
+    depth--;
+    return ok;
 }
 
-int main(int argc, char *argv[]) {
+bool parse_args(int argc, char *argv[]) {
+    if (!parse_options(argc, argv)) return false;
+    if (initial_body_count > body_limit) {
+        printf("Body count %d is above the body limit of %d\n", initial_body_count, body_limit);
+        return false;
+    }
+    return select_direct_kernel(direct_kernel_name) && select_integrator(integrator_name) &&
+           select_trajectory_options();
+}
+
+#ifndef NO_SDL
+int run_interactive() {
     if (SDL_Init(SDL_INIT_VIDEO) < 0) {
         printf("SDL initialization failed: %s\n", SDL_GetError());
         return 1;
@@ -321,7 +6874,9 @@ int main(int argc, char *argv[]) {
         return 1;
     }
     
-    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    // Instanced bodies draw into SDL's own GL context, so they need its GL driver
+    if (gl_bodies_requested) SDL_SetHint(SDL_HINT_RENDER_DRIVER, "opengl");
+    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
     if (!renderer) {
         printf("Renderer creation failed: %s\n", SDL_GetError());
         SDL_DestroyWindow(window);
@@ -329,11 +6884,35 @@ int main(int argc, char *argv[]) {
         return 1;
     }
     
-    init_bodies();
+    // Without vsync the loop paces itself to the display's refresh rate
+    SDL_RendererInfo renderer_info;
+    bool vsync = SDL_GetRendererInfo(renderer, &renderer_info) == 0 && (renderer_info.flags & SDL_RENDERER_PRESENTVSYNC);
+    SDL_DisplayMode display_mode;
+    int display = SDL_GetWindowDisplayIndex(window);
+    double refresh_rate = display >= 0 && SDL_GetCurrentDisplayMode(display, &display_mode) == 0 && display_mode.refresh_rate > 0
+                          ? display_mode.refresh_rate : DEFAULT_REFRESH_RATE;
+    double frame_interval = 1.0 / refresh_rate;
+    snapshot_wake_event = SDL_RegisterEvents(1);
+    if (snapshot_wake_event == (Uint32)-1) snapshot_wake_event = 0;
+    
+    if (!create_sprite_atlas(renderer)) {
+        log_message(LOG_WARN, TOPIC_GENERAL, "Falling back to per-pixel body drawing\n");
+    }
+    
+    if (!init_bodies()) {
+        destroy_sprite_atlas();
+        SDL_DestroyRenderer(renderer);
+        SDL_DestroyWindow(window);
+        SDL_Quit();
+        return 1;
+    }
     
     bool running = true;
     SDL_Event event;
+    int screen_width = window_width;
+    int screen_height = window_height;
     
+    log_flush();
     printf("Gravity Simulator with Collision Detection:\n");
     printf("Controls:\n");
     printf("- Left Click & Drag: Launch body with velocity\n");
@@ -341,23 +6920,47 @@ int main(int argc, char *argv[]) {
     printf("- Right Click: Delete body (click on it)\n");
     printf("- P: Pause/Resume simulation\n");
     printf("- Space: Reset simulation\n");
+    printf("- T: Cycle direct / Barnes-Hut / FMM / GPU (with --force gpu) forces, [ and ]: Adjust opening angle\n");
+    printf("- Mouse wheel: Zoom, Middle drag / arrow keys: Pan, Home: Reset the view\n");
+    printf("- I: Toggle the stage timing overlay\n");
+    printf("- D: Toggle the density view\n");
+    printf("- S / L: Save / load the checkpoint %s\n", checkpoint_target());
     printf("- ESC: Exit\n");
     printf("\nFeatures:\n");
     printf("- Bodies merge on collision (conservation of momentum)\n");
     printf("- Drag-to-launch with visual trajectory preview\n");
     printf("- Auto-pause on extreme conditions with warnings\n");
-    printf("- Maximum velocity: %.0f, Maximum mass: %.0f\n\n", MAX_VELOCITY, MAX_MASS);
+    printf("- Maximum velocity: %.0f, Maximum mass: %.0f\n", max_velocity, max_mass);
+    printf("- Force solver: %s (theta %.2f, %s direct kernel in %s precision, %d threads)\n\n",
+           force_backend_name(), bh_theta,
+           direct_kernel_name, FORCE_PRECISION_NAME, thread_count);
     
+    rebuild_background(renderer, screen_height);
+    start_physics_thread();
+    // Frames are drawn only for input or a new snapshot, so a paused, idle
+    // simulator sleeps here instead of presenting the same picture
+    bool redraw = true;
     while (running) {
+        if (!redraw && !snapshot_ready()) {
+            atomic_store(&renderer_waiting, true);
+            if (!snapshot_ready()) SDL_WaitEventTimeout(NULL, IDLE_WAIT_MS);
+            atomic_store(&renderer_waiting, false);
+        }
+        long long allocations = heap_allocations;
+        double frame_start = now_seconds();
+        double zone_start = frame_start;
         while (SDL_PollEvent(&event)) {
+            redraw = true;
             if (event.type == SDL_QUIT) {
                 running = false;
             }
             else if (event.type == SDL_WINDOWEVENT) {
                 if (event.window.event == SDL_WINDOWEVENT_RESIZED) {
-                    window_width = event.window.data1;
-                    window_height = event.window.data2;
-                    printf("Window resized to %dx%d\n", window_width, window_height);
+                    screen_width = event.window.data1;
+                    screen_height = event.window.data2;
+                    send_command(COMMAND_RESIZE, screen_width, screen_height, 0, 0);
+                    rebuild_background(renderer, screen_height);
+                    log_message(LOG_INFO, TOPIC_GENERAL, "Window resized to %dx%d\n", screen_width, screen_height);
                 }
             }
             else if (event.type == SDL_KEYDOWN) {
@@ -365,15 +6968,43 @@ int main(int argc, char *argv[]) {
                     running = false;
                 }
                 else if (event.key.keysym.sym == SDLK_SPACE) {
-                    init_bodies();
-                    simulation_paused = false;
-                    warning_shown = false;
-                    printf("Simulation reset!\n");
+                    send_command(COMMAND_RESET, 0, 0, 0, 0);
                 }
                 else if (event.key.keysym.sym == SDLK_p) {
-                    simulation_paused = !simulation_paused;
-                    printf("Simulation %s\n", simulation_paused ? "PAUSED" : "RESUMED");
+                    send_command(COMMAND_TOGGLE_PAUSE, 0, 0, 0, 0);
+                }
+                else if (event.key.keysym.sym == SDLK_t) {
+                    send_command(COMMAND_TOGGLE_FORCE, 0, 0, 0, 0);
+                }
+                else if (event.key.keysym.sym == SDLK_i) {
+                    show_profile = !show_profile;
+                }
+                else if (event.key.keysym.sym == SDLK_d) {
+                    density_view = !density_view;
+                }
+                else if (event.key.keysym.sym == SDLK_s) {
+                    send_command(COMMAND_SAVE, 0, 0, 0, 0);
+                }
+                else if (event.key.keysym.sym == SDLK_l) {
+                    send_command(COMMAND_LOAD, 0, 0, 0, 0);
+                }
+                else if (event.key.keysym.sym == SDLK_LEFTBRACKET || event.key.keysym.sym == SDLK_RIGHTBRACKET) {
+                    send_command(COMMAND_ADJUST_THETA, event.key.keysym.sym == SDLK_RIGHTBRACKET ? 0.05 : -0.05, 0, 0, 0);
                 }
+                else if (event.key.keysym.sym == SDLK_LEFT || event.key.keysym.sym == SDLK_RIGHT) {
+                    camera.x += (event.key.keysym.sym == SDLK_RIGHT ? CAMERA_PAN_STEP : -CAMERA_PAN_STEP) / camera.zoom;
+                }
+                else if (event.key.keysym.sym == SDLK_UP || event.key.keysym.sym == SDLK_DOWN) {
+                    camera.y += (event.key.keysym.sym == SDLK_DOWN ? CAMERA_PAN_STEP : -CAMERA_PAN_STEP) / camera.zoom;
+                }
+                else if (event.key.keysym.sym == SDLK_HOME) {
+                    camera = (Camera){0, 0, 1};
+                }
+            }
+            else if (event.type == SDL_MOUSEWHEEL) {
+                int x, y;
+                SDL_GetMouseState(&x, &y);
+                if (event.wheel.y != 0) zoom_camera(x, y, pow(CAMERA_ZOOM_STEP, event.wheel.y));
             }
             else if (event.type == SDL_MOUSEBUTTONDOWN) {
                 int x, y;
@@ -387,10 +7018,10 @@ int main(int argc, char *argv[]) {
                     drag_current_y = y;
                 }
                 else if (event.button.button == SDL_BUTTON_RIGHT) {
-                    int deleted = delete_body_at(x, y);
-                    if (deleted == -1) {
-                        printf("No body found at (%d, %d)\n", x, y);
-                    }
+                    send_command(COMMAND_DELETE_AT, screen_to_world_x(x), screen_to_world_y(y), 0, 0);
+                }
+                else if (event.button.button == SDL_BUTTON_MIDDLE) {
+                    is_panning = true;
                 }
             }
             else if (event.type == SDL_MOUSEBUTTONUP) {
@@ -398,46 +7029,47 @@ int main(int argc, char *argv[]) {
                     int x, y;
                     SDL_GetMouseState(&x, &y);
                     
-                    double vx = (drag_start_x - x) / 10.0;
-                    double vy = (drag_start_y - y) / 10.0;
+                    // The drag is measured on screen; the launch velocity is in world units
+                    double vx = (drag_start_x - x) / 10.0 / camera.zoom;
+                    double vy = (drag_start_y - y) / 10.0 / camera.zoom;
+                    double start_x = screen_to_world_x(drag_start_x), start_y = screen_to_world_y(drag_start_y);
                     
-                    add_body_with_velocity(drag_start_x, drag_start_y, 500, vx, vy);
+                    send_command(COMMAND_ADD_BODY, start_x, start_y, vx, vy);
                     
                     double speed = sqrt(vx * vx + vy * vy);
-                    printf("Launched body from (%d, %d) with velocity (%.1f, %.1f), speed: %.1f\n", 
-                           drag_start_x, drag_start_y, vx, vy, speed);
+                    log_message(LOG_INFO, TOPIC_GENERAL, "Launched body from (%.0f, %.0f) with velocity (%.1f, %.1f), speed: %.1f\n", 
+                                                         start_x, start_y, vx, vy, speed);
                     
                     is_dragging = false;
                 }
+                else if (event.button.button == SDL_BUTTON_MIDDLE) {
+                    is_panning = false;
+                }
             }
             else if (event.type == SDL_MOUSEMOTION) {
                 if (is_dragging) {
                     SDL_GetMouseState(&drag_current_x, &drag_current_y);
                 }
+                if (is_panning) {
+                    camera.x -= event.motion.xrel / camera.zoom;
+                    camera.y -= event.motion.yrel / camera.zoom;
+                }
             }
         }
         
-        if (!simulation_paused) {
-            if (!check_stability()) {
-                simulation_paused = true;
-                printf("Simulation automatically paused due to instability. Press 'P' to resume or Space to reset.\n");
-            } else {
-                calculate_forces();
-                update_bodies();
-                handle_collisions();
-            }
-        }
+        profile_end(ZONE_EVENTS, zone_start);
+        if (!redraw && !snapshot_ready()) continue;
+        redraw = false;
         
-        for (int y = 0; y < window_height; y++) {
-            float ratio = (float)y / window_height;
-            Uint8 r = (Uint8)(5 * (1 - ratio));
-            Uint8 g = (Uint8)(10 * (1 - ratio));
-            Uint8 b = (Uint8)(25 * (1 - ratio));
-            SDL_SetRenderDrawColor(renderer, r, g, b, 255);
-            SDL_RenderDrawLine(renderer, 0, y, window_width, y);
-        }
+        const Snapshot *snap = acquire_snapshot();
         
-        render_bodies(renderer);
+        zone_start = now_seconds();
+        draw_background(renderer, screen_width, screen_height);
+        profile_end(ZONE_BACKGROUND, zone_start);
+        
+        zone_start = now_seconds();
+        render_bodies(renderer, snap);
+        profile_end(ZONE_BODIES, zone_start);
         
         if (is_dragging) {
             SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
@@ -458,8 +7090,9 @@ int main(int argc, char *argv[]) {
                 }
             }
             
-            double vx = (drag_start_x - drag_current_x) / 10.0;
-            double vy = (drag_start_y - drag_current_y) / 10.0;
+            // The launch velocity, in world units, as the release will send it
+            double vx = (drag_start_x - drag_current_x) / 10.0 / camera.zoom;
+            double vy = (drag_start_y - drag_current_y) / 10.0 / camera.zoom;
             double speed = sqrt(vx * vx + vy * vy);
             
             Uint8 speed_color = (Uint8)fmin(255, speed * 10);
@@ -475,12 +7108,12 @@ int main(int argc, char *argv[]) {
             }
         }
         
-        if (simulation_paused) {
+        if (snap->paused) {
             SDL_SetRenderDrawColor(renderer, 255, 255, 0, 200);
             SDL_SetRenderDrawBlendMode(renderer, SDL_BLENDMODE_BLEND);
             
-            int center_x = window_width / 2;
-            int center_y = window_height / 2;
+            int center_x = screen_width / 2;
+            int center_y = screen_height / 2;
             
             SDL_Rect bar1 = {center_x - 30, center_y - 40, 20, 80};
             SDL_Rect bar2 = {center_x + 10, center_y - 40, 20, 80};
@@ -492,14 +7125,73 @@ int main(int argc, char *argv[]) {
             SDL_RenderDrawRect(renderer, &bar2);
         }
         
+        if (show_profile) draw_profile_overlay(renderer);
+        
+        zone_start = now_seconds();
         SDL_RenderPresent(renderer);
+        profile_end(ZONE_PRESENT, zone_start);
+        arena_reset(&frame_arena);
+        frame_allocations = heap_allocations - allocations;
         
-        SDL_Delay(16);
+        // With vsync the present has already waited for the display
+        double remaining = frame_interval - (now_seconds() - frame_start);
+        if (!vsync && remaining > 0) SDL_Delay((Uint32)(remaining * 1000));
     }
     
+    stop_physics_thread();
+    destroy_sprite_atlas();
+    if (background_texture) SDL_DestroyTexture(background_texture);
+    if (density_texture) SDL_DestroyTexture(density_texture);
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
     
     return 0;
+}
+#endif
+
+int main(int argc, char *argv[]) {
+    if (!parse_args(argc, argv)) {
+        return 1;
+    }
+    if (!start_ranks()) {
+        stop_ranks();
+        return 1;
+    }
+    
+#ifdef NO_SDL
+    if (!headless && !benchmark) {
+        printf("This build has no SDL support; running headless\n");
+    }
+#endif
+    
+    start_logger();
+    start_thread_pool(requested_threads);
+    start_trace();
+    if (!start_trajectory()) {
+        stop_thread_pool();
+        stop_logger();
+        stop_ranks();
+        return 1;
+    }
+    if (force_backend == FORCE_GPU && !start_gpu()) {
+        stop_trajectory();
+        stop_thread_pool();
+        stop_logger();
+        stop_ranks();
+        return 1;
+    }
+#ifdef NO_SDL
+    int status = benchmark ? run_benchmark() : run_headless();
+#else
+    int status = benchmark ? run_benchmark() : headless ? run_headless() : run_interactive();
+#endif
+    stop_trajectory();
+    if (!write_trace() && status == 0) status = 1;
+    stop_gpu();
+    stop_thread_pool();
+    stop_logger();
+    stop_ranks();
+    
+    return status;
 }
\ No newline at end of file